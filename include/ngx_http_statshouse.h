@@ -17,6 +17,20 @@
 ngx_int_t  ngx_http_statshouse_send(ngx_http_request_t *request, ngx_str_t *phase);
 ngx_int_t  ngx_http_statshouse_send_stat(ngx_http_request_t *request, ngx_statshouse_stat_t *stat);
 
+/*
+ * metric of another module, registered at configuration with indexes of
+ * its keys; values of these keys are passed on send in index order
+ */
+ngx_statshouse_handle_t  *ngx_http_statshouse_register(ngx_conf_t *cf, ngx_str_t *name,
+    ngx_statshouse_stat_type_e type, ngx_uint_t *keys, ngx_uint_t nkeys);
+ngx_int_t  ngx_http_statshouse_send_handle(ngx_http_request_t *request, ngx_statshouse_handle_t *handle,
+    ngx_str_t *keys, double number);
+
+#define ngx_http_statshouse_increment(request, handle, keys)                  \
+    ngx_http_statshouse_send_handle(request, handle, keys, 1)
+#define ngx_http_statshouse_observe(request, handle, keys, value)             \
+    ngx_http_statshouse_send_handle(request, handle, keys, value)
+
 
 ngx_int_t  ngx_http_statshouse_send_ctx(ngx_cycle_t *cycle, ngx_http_conf_ctx_t *ctx,
     ngx_pool_t *pool, ngx_str_t *phase);
@@ -12,7 +12,8 @@
 #include <ngx_rbtree.h>
 
 
-#define NGX_STATSHOUSE_STAT_KEYS_MAX     (16 + 1) /* +1 skey */
+#define NGX_STATSHOUSE_STAT_KEYS_MAX     (48 + 1) /* +1 skey */
+#define NGX_STATSHOUSE_STAT_SKEY         48
 
 
 typedef enum {
@@ -27,24 +28,27 @@ typedef union {
     int64_t                              unique;
 } ngx_statshouse_stat_value_t;
 
-typedef struct {
-    ngx_str_t                            name;
-    ngx_str_t                            value;
-} ngx_statshouse_stat_key_t;
-
 typedef struct {
     ngx_statshouse_stat_type_e           type;
     ngx_str_t                            name;
 
-    ngx_statshouse_stat_key_t            keys[NGX_STATSHOUSE_STAT_KEYS_MAX];
-    ngx_int_t                            keys_count;
+    /* bit per key index, values of set keys are packed in index order */
+    uint64_t                             keys_mask;
+    ngx_str_t                           *keys;
+
+    /* events represented by values, 0 if one per value */
+    double                               count;
 
     ngx_int_t                            values_count;
     ngx_statshouse_stat_value_t          values[1];
 } ngx_statshouse_stat_t;
 
+/* metric registered at configuration, see ngx_http_statshouse_register() */
+typedef struct ngx_statshouse_handle_s  ngx_statshouse_handle_t;
 
-void  ngx_statshouse_stat_init(ngx_statshouse_stat_t *stat, ngx_str_t name, ngx_statshouse_stat_type_e type);
+
+void  ngx_statshouse_stat_init(ngx_statshouse_stat_t *stat, ngx_str_t name, ngx_statshouse_stat_type_e type,
+    ngx_str_t *keys);
 
 void  ngx_statshouse_stat_value_zero(ngx_statshouse_stat_t *stat);
 void  ngx_statshouse_stat_value(ngx_statshouse_stat_t *stat, ngx_statshouse_stat_value_t value);
@@ -52,8 +56,34 @@ void  ngx_statshouse_stat_value_counter(ngx_statshouse_stat_t *stat, int64_t cou
 void  ngx_statshouse_stat_value_value(ngx_statshouse_stat_t *stat, double value);
 void  ngx_statshouse_stat_value_nvalue(ngx_statshouse_stat_t *stat, double value);
 void  ngx_statshouse_stat_value_unique(ngx_statshouse_stat_t *stat, double unique);
+void  ngx_statshouse_stat_weight(ngx_statshouse_stat_t *stat, double weight);
+
+void  ngx_statshouse_stat_key(ngx_statshouse_stat_t *stat, ngx_uint_t index, ngx_str_t value);
+ngx_str_t  *ngx_statshouse_stat_key_name(ngx_uint_t index);
+
+
+static ngx_inline ngx_uint_t
+ngx_statshouse_stat_popcount(uint64_t mask)
+{
+#if (defined __GNUC__ || defined __clang__)
+    return __builtin_popcountll(mask);
+#else
+    ngx_uint_t  n;
+
+    for (n = 0; mask; n++) {
+        mask &= mask - 1;
+    }
+
+    return n;
+#endif
+}
+
+
+#define ngx_statshouse_stat_keys_count(stat)                                  \
+    ngx_statshouse_stat_popcount((stat)->keys_mask)
 
-void  ngx_statshouse_stat_key(ngx_statshouse_stat_t *stat, ngx_str_t name, ngx_str_t value);
+#define ngx_statshouse_stat_count(stat)                                       \
+    ((stat)->count ? (stat)->count : (double) (stat)->values_count)
 
 
 #endif
@@ -17,5 +17,19 @@
 ngx_int_t  ngx_stream_statshouse_send(ngx_stream_session_t *session, ngx_str_t *phase);
 ngx_int_t  ngx_stream_statshouse_send_stat(ngx_stream_session_t *session, ngx_statshouse_stat_t *stat);
 
+/*
+ * metric of another module, registered at configuration with indexes of
+ * its keys; values of these keys are passed on send in index order
+ */
+ngx_statshouse_handle_t  *ngx_stream_statshouse_register(ngx_conf_t *cf, ngx_str_t *name,
+    ngx_statshouse_stat_type_e type, ngx_uint_t *keys, ngx_uint_t nkeys);
+ngx_int_t  ngx_stream_statshouse_send_handle(ngx_stream_session_t *session, ngx_statshouse_handle_t *handle,
+    ngx_str_t *keys, double number);
+
+#define ngx_stream_statshouse_increment(session, handle, keys)                \
+    ngx_stream_statshouse_send_handle(session, handle, keys, 1)
+#define ngx_stream_statshouse_observe(session, handle, keys, value)           \
+    ngx_stream_statshouse_send_handle(session, handle, keys, value)
+
 
 #endif
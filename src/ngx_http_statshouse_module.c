@@ -13,33 +13,90 @@
 #include <ngx_statshouse_stat.h>
 
 #include "ngx_statshouse.h"
+#include "ngx_statshouse_predicate.h"
 
 
 #define NGX_HTTP_STATSHOUSE_CONF                0x100000000
 #define NGX_HTTP_STATSHOUSE_CONF_OFFSET         offsetof(ngx_http_statshouse_conf_ctx_t, statshouse_conf)
 
+#define NGX_HTTP_STATSHOUSE_PRESET_OFF          0x0002
+#define NGX_HTTP_STATSHOUSE_PRESET_REQUESTS     0x0004
+
 
 typedef struct {
     ngx_http_conf_ctx_t                         http_conf;
     void                                      **statshouse_conf;
 } ngx_http_statshouse_conf_ctx_t;
 
-typedef struct {
+typedef struct ngx_http_statshouse_loc_conf_s  ngx_http_statshouse_loc_conf_t;
+
+struct ngx_http_statshouse_loc_conf_s {
+    /* own metrics, inherited ones are sent by the chain of parents */
     ngx_array_t                                *confs;
+    ngx_array_t                                *phases;
+    ngx_http_statshouse_loc_conf_t             *inherit;
+
     ngx_statshouse_server_t                    *server;
 
     ngx_flag_t                                  enable;
-} ngx_http_statshouse_loc_conf_t;
+    ngx_uint_t                                  presets;
+};
 
 typedef struct {
     ngx_array_t                                *servers;
     ngx_array_t                                *confs;
+
+    ngx_statshouse_exprs_t                     *exprs;
+    ngx_statshouse_scratch_t                    scratch;
+
+    /* handles of ngx_http_statshouse_preset_requests metrics */
+    ngx_statshouse_handle_t                   **preset_requests;
 } ngx_http_statshouse_main_conf_t;
 
+typedef struct {
+    ngx_str_t                                   name;
+    ngx_statshouse_number_value_pt              handler;
+} ngx_http_statshouse_number_t;
+
+typedef struct {
+    ngx_http_complex_value_t                    complex;
+
+    /* index of the only variable of the value, NGX_ERROR if none */
+    ngx_int_t                                   index;
+} ngx_http_statshouse_complex_value_t;
+
+/* metric of a preset, read from the request, counter of 1 if no handler */
+typedef struct {
+    ngx_str_t                                   name;
+    ngx_statshouse_stat_type_e                  type;
+    ngx_statshouse_number_value_pt              handler;
+} ngx_http_statshouse_preset_t;
+
 
 static ngx_int_t   ngx_http_statshouse_init_complex(ngx_conf_t *cf);
+static ngx_int_t   ngx_http_statshouse_compile_complex_value(ngx_conf_t *cf, ngx_str_t *value,
+    ngx_http_statshouse_complex_value_t *cv);
+static ngx_http_statshouse_complex_value_t *ngx_http_statshouse_intern_complex_value(ngx_conf_t *cf,
+    ngx_str_t *value);
+static ngx_int_t   ngx_http_statshouse_complex_value(void *ctx, void *val, ngx_str_t *value);
+static void *      ngx_http_statshouse_predicate_operand(ngx_conf_t *cf, ngx_str_t *value,
+    ngx_statshouse_number_value_pt *accessor);
+static ngx_int_t   ngx_http_statshouse_script_value(ngx_http_request_t *r, ngx_http_complex_value_t *val,
+    ngx_str_t *value);
 static ngx_int_t   ngx_http_statshouse_variable_exists(ngx_conf_t *cf, ngx_str_t name);
+static ngx_statshouse_number_value_pt  ngx_http_statshouse_number_accessor(ngx_str_t *value);
+static ngx_int_t   ngx_http_statshouse_request_time(void *ctx, double *number);
+static ngx_int_t   ngx_http_statshouse_status(void *ctx, double *number);
+static ngx_int_t   ngx_http_statshouse_bytes_sent(void *ctx, double *number);
+static ngx_int_t   ngx_http_statshouse_body_bytes_sent(void *ctx, double *number);
+static ngx_int_t   ngx_http_statshouse_request_length(void *ctx, double *number);
+static ngx_int_t   ngx_http_statshouse_upstream_response_time(void *ctx, double *number);
+static ngx_int_t   ngx_http_statshouse_upstream_connect_time(void *ctx, double *number);
+static ngx_int_t   ngx_http_statshouse_upstream_header_time(void *ctx, double *number);
+static ngx_int_t   ngx_http_statshouse_upstream_time(ngx_http_request_t *r, double *number, size_t offset);
 static ngx_int_t   ngx_http_statshouse_init(ngx_conf_t *cf);
+static ngx_int_t   ngx_http_statshouse_init_phases(ngx_conf_t *cf, ngx_http_statshouse_loc_conf_t *slcf);
+static ngx_int_t   ngx_http_statshouse_bind(ngx_conf_t *cf, ngx_http_statshouse_loc_conf_t *slcf);
 static void *      ngx_http_statshouse_create_main_conf(ngx_conf_t *cf);
 static void *      ngx_http_statshouse_create_loc_conf(ngx_conf_t *cf);
 static char *      ngx_http_statshouse_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child);
@@ -48,7 +105,17 @@ static char *      ngx_http_statshouse_value_slot(ngx_conf_t *cf, ngx_command_t
 static char *      ngx_http_statshouse_key_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static char *      ngx_http_statshouse_server_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 
+static char *      ngx_http_statshouse_preset_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
 static ngx_int_t   ngx_http_statshouse_handler(ngx_http_request_t *request);
+static void        ngx_http_statshouse_send_preset(ngx_http_request_t *request);
+
+
+static ngx_conf_bitmask_t  ngx_http_statshouse_preset_mask[] = {
+    { ngx_string("off"), NGX_HTTP_STATSHOUSE_PRESET_OFF },
+    { ngx_string("http_requests"), NGX_HTTP_STATSHOUSE_PRESET_REQUESTS },
+    { ngx_null_string, 0 }
+};
 
 
 static ngx_command_t  ngx_http_statshouse_commands[] = {
@@ -70,6 +137,33 @@ static ngx_command_t  ngx_http_statshouse_commands[] = {
         NULL
     },
 
+    { ngx_string("statshouse_preset"),
+        NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF
+            |NGX_CONF_1MORE,
+        ngx_http_statshouse_preset_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_statshouse_loc_conf_t, presets),
+        &ngx_http_statshouse_preset_mask
+    },
+
+    { ngx_string("statshouse_metric_group"),
+        NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_BLOCK
+            |NGX_CONF_TAKE1,
+        ngx_http_statshouse_metric_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        (void *) 1
+    },
+
+    { ngx_string("metric"),
+        NGX_HTTP_STATSHOUSE_CONF
+            |NGX_CONF_TAKE3,
+        ngx_statshouse_conf_member_slot,
+        NGX_HTTP_STATSHOUSE_CONF_OFFSET,
+        0,
+        NULL
+    },
+
     { ngx_string("exists"),
         NGX_HTTP_STATSHOUSE_CONF
             |NGX_CONF_1MORE,
@@ -83,9 +177,9 @@ static ngx_command_t  ngx_http_statshouse_commands[] = {
     { ngx_string("condition"),
         NGX_HTTP_STATSHOUSE_CONF
             |NGX_CONF_1MORE,
-        ngx_conf_set_str_array_slot,
+        ngx_statshouse_conf_condition_slot,
         NGX_HTTP_STATSHOUSE_CONF_OFFSET,
-        offsetof(ngx_statshouse_conf_t, condition.strings),
+        0,
         NULL
     },
 
@@ -98,6 +192,24 @@ static ngx_command_t  ngx_http_statshouse_commands[] = {
         NULL
     },
 
+    { ngx_string("rate"),
+        NGX_HTTP_STATSHOUSE_CONF
+            |NGX_CONF_TAKE12,
+        ngx_statshouse_conf_rate_slot,
+        NGX_HTTP_STATSHOUSE_CONF_OFFSET,
+        0,
+        NULL
+    },
+
+    { ngx_string("cardinality"),
+        NGX_HTTP_STATSHOUSE_CONF
+            |NGX_CONF_TAKE12,
+        ngx_statshouse_conf_cardinality_slot,
+        NGX_HTTP_STATSHOUSE_CONF_OFFSET,
+        0,
+        NULL
+    },
+
     { ngx_string("count"),
         NGX_HTTP_STATSHOUSE_CONF
             |NGX_CONF_1MORE,
@@ -139,7 +251,7 @@ static ngx_command_t  ngx_http_statshouse_commands[] = {
             |NGX_CONF_1MORE,
         ngx_http_statshouse_key_slot,
         NGX_HTTP_STATSHOUSE_CONF_OFFSET,
-        offsetof(ngx_statshouse_conf_t, keys[0]),
+        0,
         (void *) "0"
     },
 
@@ -148,7 +260,7 @@ static ngx_command_t  ngx_http_statshouse_commands[] = {
             |NGX_CONF_1MORE,
         ngx_http_statshouse_key_slot,
         NGX_HTTP_STATSHOUSE_CONF_OFFSET,
-        offsetof(ngx_statshouse_conf_t, keys[1]),
+        1,
         (void *) "1"
     },
 
@@ -157,7 +269,7 @@ static ngx_command_t  ngx_http_statshouse_commands[] = {
             |NGX_CONF_1MORE,
         ngx_http_statshouse_key_slot,
         NGX_HTTP_STATSHOUSE_CONF_OFFSET,
-        offsetof(ngx_statshouse_conf_t, keys[2]),
+        2,
         (void *) "2"
     },
 
@@ -166,7 +278,7 @@ static ngx_command_t  ngx_http_statshouse_commands[] = {
             |NGX_CONF_1MORE,
         ngx_http_statshouse_key_slot,
         NGX_HTTP_STATSHOUSE_CONF_OFFSET,
-        offsetof(ngx_statshouse_conf_t, keys[3]),
+        3,
         (void *) "3"
     },
 
@@ -175,7 +287,7 @@ static ngx_command_t  ngx_http_statshouse_commands[] = {
             |NGX_CONF_1MORE,
         ngx_http_statshouse_key_slot,
         NGX_HTTP_STATSHOUSE_CONF_OFFSET,
-        offsetof(ngx_statshouse_conf_t, keys[4]),
+        4,
         (void *) "4"
     },
 
@@ -184,7 +296,7 @@ static ngx_command_t  ngx_http_statshouse_commands[] = {
             |NGX_CONF_1MORE,
         ngx_http_statshouse_key_slot,
         NGX_HTTP_STATSHOUSE_CONF_OFFSET,
-        offsetof(ngx_statshouse_conf_t, keys[5]),
+        5,
         (void *) "5"
     },
 
@@ -193,7 +305,7 @@ static ngx_command_t  ngx_http_statshouse_commands[] = {
             |NGX_CONF_1MORE,
         ngx_http_statshouse_key_slot,
         NGX_HTTP_STATSHOUSE_CONF_OFFSET,
-        offsetof(ngx_statshouse_conf_t, keys[6]),
+        6,
         (void *) "6"
     },
 
@@ -202,7 +314,7 @@ static ngx_command_t  ngx_http_statshouse_commands[] = {
             |NGX_CONF_1MORE,
         ngx_http_statshouse_key_slot,
         NGX_HTTP_STATSHOUSE_CONF_OFFSET,
-        offsetof(ngx_statshouse_conf_t, keys[7]),
+        7,
         (void *) "7"
     },
 
@@ -211,7 +323,7 @@ static ngx_command_t  ngx_http_statshouse_commands[] = {
             |NGX_CONF_1MORE,
         ngx_http_statshouse_key_slot,
         NGX_HTTP_STATSHOUSE_CONF_OFFSET,
-        offsetof(ngx_statshouse_conf_t, keys[8]),
+        8,
         (void *) "8"
     },
 
@@ -220,7 +332,7 @@ static ngx_command_t  ngx_http_statshouse_commands[] = {
             |NGX_CONF_1MORE,
         ngx_http_statshouse_key_slot,
         NGX_HTTP_STATSHOUSE_CONF_OFFSET,
-        offsetof(ngx_statshouse_conf_t, keys[9]),
+        9,
         (void *) "9"
     },
 
@@ -229,7 +341,7 @@ static ngx_command_t  ngx_http_statshouse_commands[] = {
             |NGX_CONF_1MORE,
         ngx_http_statshouse_key_slot,
         NGX_HTTP_STATSHOUSE_CONF_OFFSET,
-        offsetof(ngx_statshouse_conf_t, keys[10]),
+        10,
         (void *) "10"
     },
 
@@ -238,7 +350,7 @@ static ngx_command_t  ngx_http_statshouse_commands[] = {
             |NGX_CONF_1MORE,
         ngx_http_statshouse_key_slot,
         NGX_HTTP_STATSHOUSE_CONF_OFFSET,
-        offsetof(ngx_statshouse_conf_t, keys[11]),
+        11,
         (void *) "11"
     },
 
@@ -247,7 +359,7 @@ static ngx_command_t  ngx_http_statshouse_commands[] = {
             |NGX_CONF_1MORE,
         ngx_http_statshouse_key_slot,
         NGX_HTTP_STATSHOUSE_CONF_OFFSET,
-        offsetof(ngx_statshouse_conf_t, keys[12]),
+        12,
         (void *) "12"
     },
 
@@ -256,7 +368,7 @@ static ngx_command_t  ngx_http_statshouse_commands[] = {
             |NGX_CONF_1MORE,
         ngx_http_statshouse_key_slot,
         NGX_HTTP_STATSHOUSE_CONF_OFFSET,
-        offsetof(ngx_statshouse_conf_t, keys[13]),
+        13,
         (void *) "13"
     },
 
@@ -265,7 +377,7 @@ static ngx_command_t  ngx_http_statshouse_commands[] = {
             |NGX_CONF_1MORE,
         ngx_http_statshouse_key_slot,
         NGX_HTTP_STATSHOUSE_CONF_OFFSET,
-        offsetof(ngx_statshouse_conf_t, keys[14]),
+        14,
         (void *) "14"
     },
 
@@ -274,25 +386,313 @@ static ngx_command_t  ngx_http_statshouse_commands[] = {
             |NGX_CONF_1MORE,
         ngx_http_statshouse_key_slot,
         NGX_HTTP_STATSHOUSE_CONF_OFFSET,
-        offsetof(ngx_statshouse_conf_t, keys[15]),
+        15,
         (void *) "15"
     },
 
+    { ngx_string("key16"),
+        NGX_HTTP_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_http_statshouse_key_slot,
+        NGX_HTTP_STATSHOUSE_CONF_OFFSET,
+        16,
+        (void *) "16"
+    },
+
+    { ngx_string("key17"),
+        NGX_HTTP_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_http_statshouse_key_slot,
+        NGX_HTTP_STATSHOUSE_CONF_OFFSET,
+        17,
+        (void *) "17"
+    },
+
+    { ngx_string("key18"),
+        NGX_HTTP_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_http_statshouse_key_slot,
+        NGX_HTTP_STATSHOUSE_CONF_OFFSET,
+        18,
+        (void *) "18"
+    },
+
+    { ngx_string("key19"),
+        NGX_HTTP_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_http_statshouse_key_slot,
+        NGX_HTTP_STATSHOUSE_CONF_OFFSET,
+        19,
+        (void *) "19"
+    },
+
+    { ngx_string("key20"),
+        NGX_HTTP_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_http_statshouse_key_slot,
+        NGX_HTTP_STATSHOUSE_CONF_OFFSET,
+        20,
+        (void *) "20"
+    },
+
+    { ngx_string("key21"),
+        NGX_HTTP_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_http_statshouse_key_slot,
+        NGX_HTTP_STATSHOUSE_CONF_OFFSET,
+        21,
+        (void *) "21"
+    },
+
+    { ngx_string("key22"),
+        NGX_HTTP_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_http_statshouse_key_slot,
+        NGX_HTTP_STATSHOUSE_CONF_OFFSET,
+        22,
+        (void *) "22"
+    },
+
+    { ngx_string("key23"),
+        NGX_HTTP_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_http_statshouse_key_slot,
+        NGX_HTTP_STATSHOUSE_CONF_OFFSET,
+        23,
+        (void *) "23"
+    },
+
+    { ngx_string("key24"),
+        NGX_HTTP_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_http_statshouse_key_slot,
+        NGX_HTTP_STATSHOUSE_CONF_OFFSET,
+        24,
+        (void *) "24"
+    },
+
+    { ngx_string("key25"),
+        NGX_HTTP_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_http_statshouse_key_slot,
+        NGX_HTTP_STATSHOUSE_CONF_OFFSET,
+        25,
+        (void *) "25"
+    },
+
+    { ngx_string("key26"),
+        NGX_HTTP_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_http_statshouse_key_slot,
+        NGX_HTTP_STATSHOUSE_CONF_OFFSET,
+        26,
+        (void *) "26"
+    },
+
+    { ngx_string("key27"),
+        NGX_HTTP_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_http_statshouse_key_slot,
+        NGX_HTTP_STATSHOUSE_CONF_OFFSET,
+        27,
+        (void *) "27"
+    },
+
+    { ngx_string("key28"),
+        NGX_HTTP_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_http_statshouse_key_slot,
+        NGX_HTTP_STATSHOUSE_CONF_OFFSET,
+        28,
+        (void *) "28"
+    },
+
+    { ngx_string("key29"),
+        NGX_HTTP_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_http_statshouse_key_slot,
+        NGX_HTTP_STATSHOUSE_CONF_OFFSET,
+        29,
+        (void *) "29"
+    },
+
+    { ngx_string("key30"),
+        NGX_HTTP_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_http_statshouse_key_slot,
+        NGX_HTTP_STATSHOUSE_CONF_OFFSET,
+        30,
+        (void *) "30"
+    },
+
+    { ngx_string("key31"),
+        NGX_HTTP_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_http_statshouse_key_slot,
+        NGX_HTTP_STATSHOUSE_CONF_OFFSET,
+        31,
+        (void *) "31"
+    },
+
+    { ngx_string("key32"),
+        NGX_HTTP_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_http_statshouse_key_slot,
+        NGX_HTTP_STATSHOUSE_CONF_OFFSET,
+        32,
+        (void *) "32"
+    },
+
+    { ngx_string("key33"),
+        NGX_HTTP_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_http_statshouse_key_slot,
+        NGX_HTTP_STATSHOUSE_CONF_OFFSET,
+        33,
+        (void *) "33"
+    },
+
+    { ngx_string("key34"),
+        NGX_HTTP_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_http_statshouse_key_slot,
+        NGX_HTTP_STATSHOUSE_CONF_OFFSET,
+        34,
+        (void *) "34"
+    },
+
+    { ngx_string("key35"),
+        NGX_HTTP_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_http_statshouse_key_slot,
+        NGX_HTTP_STATSHOUSE_CONF_OFFSET,
+        35,
+        (void *) "35"
+    },
+
+    { ngx_string("key36"),
+        NGX_HTTP_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_http_statshouse_key_slot,
+        NGX_HTTP_STATSHOUSE_CONF_OFFSET,
+        36,
+        (void *) "36"
+    },
+
+    { ngx_string("key37"),
+        NGX_HTTP_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_http_statshouse_key_slot,
+        NGX_HTTP_STATSHOUSE_CONF_OFFSET,
+        37,
+        (void *) "37"
+    },
+
+    { ngx_string("key38"),
+        NGX_HTTP_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_http_statshouse_key_slot,
+        NGX_HTTP_STATSHOUSE_CONF_OFFSET,
+        38,
+        (void *) "38"
+    },
+
+    { ngx_string("key39"),
+        NGX_HTTP_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_http_statshouse_key_slot,
+        NGX_HTTP_STATSHOUSE_CONF_OFFSET,
+        39,
+        (void *) "39"
+    },
+
+    { ngx_string("key40"),
+        NGX_HTTP_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_http_statshouse_key_slot,
+        NGX_HTTP_STATSHOUSE_CONF_OFFSET,
+        40,
+        (void *) "40"
+    },
+
+    { ngx_string("key41"),
+        NGX_HTTP_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_http_statshouse_key_slot,
+        NGX_HTTP_STATSHOUSE_CONF_OFFSET,
+        41,
+        (void *) "41"
+    },
+
+    { ngx_string("key42"),
+        NGX_HTTP_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_http_statshouse_key_slot,
+        NGX_HTTP_STATSHOUSE_CONF_OFFSET,
+        42,
+        (void *) "42"
+    },
+
+    { ngx_string("key43"),
+        NGX_HTTP_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_http_statshouse_key_slot,
+        NGX_HTTP_STATSHOUSE_CONF_OFFSET,
+        43,
+        (void *) "43"
+    },
+
+    { ngx_string("key44"),
+        NGX_HTTP_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_http_statshouse_key_slot,
+        NGX_HTTP_STATSHOUSE_CONF_OFFSET,
+        44,
+        (void *) "44"
+    },
+
+    { ngx_string("key45"),
+        NGX_HTTP_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_http_statshouse_key_slot,
+        NGX_HTTP_STATSHOUSE_CONF_OFFSET,
+        45,
+        (void *) "45"
+    },
+
+    { ngx_string("key46"),
+        NGX_HTTP_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_http_statshouse_key_slot,
+        NGX_HTTP_STATSHOUSE_CONF_OFFSET,
+        46,
+        (void *) "46"
+    },
+
+    { ngx_string("key47"),
+        NGX_HTTP_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_http_statshouse_key_slot,
+        NGX_HTTP_STATSHOUSE_CONF_OFFSET,
+        47,
+        (void *) "47"
+    },
+
     { ngx_string("skey"),
         NGX_HTTP_STATSHOUSE_CONF
             |NGX_CONF_1MORE,
         ngx_http_statshouse_key_slot,
         NGX_HTTP_STATSHOUSE_CONF_OFFSET,
-        offsetof(ngx_statshouse_conf_t, keys[16]),
+        48,
         (void *) "_s"
     },
 
     { ngx_string("sample"),
         NGX_HTTP_STATSHOUSE_CONF
-            |NGX_CONF_TAKE1,
-        ngx_conf_set_num_slot,
+            |NGX_CONF_TAKE12,
+        ngx_statshouse_conf_sample_slot,
         NGX_HTTP_STATSHOUSE_CONF_OFFSET,
-        offsetof(ngx_statshouse_conf_t, sample),
+        0,
         NULL
     },
 
@@ -332,17 +732,41 @@ static ngx_http_variable_t  ngx_http_statshouse_variables[] = {
       ngx_http_null_variable
 };
 
+static ngx_http_statshouse_number_t  ngx_http_statshouse_numbers[] = {
+    { ngx_string("$request_time"), ngx_http_statshouse_request_time },
+    { ngx_string("$status"), ngx_http_statshouse_status },
+    { ngx_string("$bytes_sent"), ngx_http_statshouse_bytes_sent },
+    { ngx_string("$body_bytes_sent"), ngx_http_statshouse_body_bytes_sent },
+    { ngx_string("$request_length"), ngx_http_statshouse_request_length },
+    { ngx_string("$upstream_response_time"), ngx_http_statshouse_upstream_response_time },
+    { ngx_string("$upstream_connect_time"), ngx_http_statshouse_upstream_connect_time },
+    { ngx_string("$upstream_header_time"), ngx_http_statshouse_upstream_header_time },
+    { ngx_null_string, NULL }
+};
+
+/* keys: 1 hostname, 2 server name, 3 method, 4 protocol, 5 status */
+static ngx_uint_t  ngx_http_statshouse_preset_keys[] = { 1, 2, 3, 4, 5 };
+
+static ngx_http_statshouse_preset_t  ngx_http_statshouse_preset_requests[] = {
+    { ngx_string("nginx_http_requests"), ngx_statshouse_mt_counter, NULL },
+    { ngx_string("nginx_http_request_time"), ngx_statshouse_mt_value, ngx_http_statshouse_request_time },
+    { ngx_string("nginx_http_request_length"), ngx_statshouse_mt_value, ngx_http_statshouse_request_length },
+    { ngx_string("nginx_http_bytes_sent"), ngx_statshouse_mt_value, ngx_http_statshouse_bytes_sent },
+    { ngx_null_string, 0, NULL }
+};
+
 
 static ngx_int_t
 ngx_http_statshouse_init_complex(ngx_conf_t *cf)
 {
-    ngx_http_statshouse_main_conf_t    *smcf;
-    ngx_statshouse_conf_t             **confs, *conf;
-    ngx_statshouse_conf_key_t          *key;
-    ngx_http_compile_complex_value_t    ccv;
-    ngx_http_complex_value_t           *condition;
-    ngx_str_t                          *variables, *strings;
-    ngx_uint_t                          i, j, n;
+    ngx_http_statshouse_main_conf_t        *smcf;
+    ngx_statshouse_conf_t                 **confs, *conf;
+    ngx_statshouse_conf_member_t           *members;
+    ngx_statshouse_conf_value_t            *field;
+    ngx_statshouse_conf_key_def_t          *key;
+    ngx_http_statshouse_complex_value_t    *cv;
+    ngx_str_t                              *variables;
+    ngx_uint_t                              i, j, n;
 
     smcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_statshouse_module);
     if (smcf->confs == NULL) {
@@ -368,89 +792,417 @@ ngx_http_statshouse_init_complex(ngx_conf_t *cf)
             continue;
         }
 
-        ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+        cv = ngx_http_statshouse_intern_complex_value(cf, &conf->value.string);
+        if (cv == NULL) {
+            return NGX_ERROR;
+        }
+
+        conf->value.complex = cv;
+
+        if (cv->complex.lengths == NULL) {
+            conf->value.constant = 1;
+
+        } else if (!conf->value.split) {
+            conf->value.accessor = ngx_http_statshouse_number_accessor(&conf->value.string);
+        }
+
+        if (conf->members) {
+            members = conf->members->elts;
+
+            for (n = 0; n < conf->members->nelts; n++) {
+                field = &members[n].value;
+
+                cv = ngx_http_statshouse_intern_complex_value(cf, &field->string);
+                if (cv == NULL) {
+                    return NGX_ERROR;
+                }
+
+                field->complex = cv;
+
+                if (cv->complex.lengths == NULL) {
+                    field->constant = 1;
+
+                } else {
+                    field->accessor = ngx_http_statshouse_number_accessor(&field->string);
+                }
+            }
+        }
+
+        if (conf->condition.strings) {
+            conf->condition.predicate = ngx_statshouse_predicate_compile(cf, conf->condition.strings,
+                ngx_http_statshouse_predicate_operand);
+            if (conf->condition.predicate == NULL) {
+                return NGX_ERROR;
+            }
+        }
+
+        for (j = 0; j < NGX_STATSHOUSE_STAT_KEYS_MAX; j++) {
+            key = &conf->defs[j];
+
+            if (key->name.len == 0) {
+                continue;
+            }
+
+            if (key->exists) {
+                variables = key->exists->elts;
+
+                for (n = 0; n < key->exists->nelts; n++) {
+                    if (ngx_http_statshouse_variable_exists(cf, variables[n]) != NGX_OK) {
+                        key->disable = 1;
+                        break;
+                    }
+                }
+            }
+
+            if (key->disable) {
+                continue;
+            }
+
+            cv = ngx_http_statshouse_intern_complex_value(cf, &key->string);
+            if (cv == NULL) {
+                return NGX_ERROR;
+            }
+
+            key->complex = cv;
+
+            if (cv->complex.lengths == NULL) {
+                key->constant = 1;
+            }
+        }
+
+        conf->exprs = smcf->exprs;
+        conf->scratch = &smcf->scratch;
+
+        if (ngx_statshouse_conf_init(cf, conf) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_statshouse_compile_complex_value(ngx_conf_t *cf, ngx_str_t *value,
+    ngx_http_statshouse_complex_value_t *cv)
+{
+    ngx_http_compile_complex_value_t  ccv;
+    ngx_str_t                         name;
+
+    ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+    ccv.cf = cf;
+    ccv.value = value;
+    ccv.complex_value = &cv->complex;
+
+    if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    cv->index = NGX_ERROR;
+
+    if (cv->complex.lengths == NULL || ngx_statshouse_conf_variable(value, &name) != NGX_OK) {
+        return NGX_OK;
+    }
+
+    cv->index = ngx_http_get_variable_index(cf, &name);
+    if (cv->index == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_http_statshouse_complex_value_t *
+ngx_http_statshouse_intern_complex_value(ngx_conf_t *cf, ngx_str_t *value)
+{
+    ngx_http_statshouse_main_conf_t      *smcf;
+    ngx_http_statshouse_complex_value_t  *cv;
+    ngx_statshouse_expr_t                *expr;
+    ngx_int_t                             n;
+
+    smcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_statshouse_module);
+
+    n = ngx_statshouse_exprs_find(smcf->exprs, value);
+
+    if (n != NGX_DECLINED) {
+        expr = smcf->exprs->exprs.elts;
+        return expr[n].complex;
+    }
+
+    cv = ngx_pcalloc(cf->pool, sizeof(ngx_http_statshouse_complex_value_t));
+    if (cv == NULL) {
+        return NULL;
+    }
+
+    if (ngx_http_statshouse_compile_complex_value(cf, value, cv) != NGX_OK) {
+        return NULL;
+    }
+
+    if (ngx_statshouse_exprs_add(smcf->exprs, value, cv) == NGX_ERROR) {
+        return NULL;
+    }
+
+    return cv;
+}
+
+
+static ngx_int_t
+ngx_http_statshouse_complex_value(void *ctx, void *val, ngx_str_t *value)
+{
+    ngx_http_request_t                   *r = ctx;
+    ngx_http_statshouse_complex_value_t  *cv = val;
+    ngx_http_variable_value_t            *vv;
+
+    if (cv->index == NGX_ERROR) {
+        return ngx_http_statshouse_script_value(r, &cv->complex, value);
+    }
+
+    vv = ngx_http_get_indexed_variable(r, cv->index);
+
+    if (vv == NULL || vv->not_found) {
+        ngx_str_null(value);
+        return NGX_OK;
+    }
+
+    value->data = vv->data;
+    value->len = vv->len;
+
+    return NGX_OK;
+}
+
+
+/*
+ * ngx_http_complex_value() evaluating into the per worker scratch arena
+ * instead of the request pool
+ */
+
+static ngx_int_t
+ngx_http_statshouse_script_value(ngx_http_request_t *r, ngx_http_complex_value_t *val,
+    ngx_str_t *value)
+{
+    size_t                            len;
+    ngx_http_script_code_pt           code;
+    ngx_http_script_len_code_pt       lcode;
+    ngx_http_script_engine_t          e;
+    ngx_http_statshouse_main_conf_t  *smcf;
+
+    if (val->lengths == NULL) {
+        *value = val->value;
+        return NGX_OK;
+    }
+
+    ngx_http_script_flush_complex_value(r, val);
+
+    ngx_memzero(&e, sizeof(ngx_http_script_engine_t));
+
+    e.ip = val->lengths;
+    e.request = r;
+    e.flushed = 1;
+
+    len = 0;
+
+    while (*(uintptr_t *) e.ip) {
+        lcode = *(ngx_http_script_len_code_pt *) e.ip;
+        len += lcode(&e);
+    }
+
+    smcf = ngx_http_get_module_main_conf(r, ngx_http_statshouse_module);
+
+    value->len = len;
+    value->data = ngx_statshouse_scratch_alloc(&smcf->scratch, len);
+
+    if (value->data == NULL) {
+        value->data = ngx_pnalloc(r->pool, len);
+        if (value->data == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    e.ip = val->values;
+    e.pos = value->data;
+    e.buf = *value;
+
+    while (*(uintptr_t *) e.ip) {
+        code = *(ngx_http_script_code_pt *) e.ip;
+        code((ngx_http_script_engine_t *) &e);
+    }
+
+    *value = e.buf;
+
+    return NGX_OK;
+}
+
+
+static ngx_statshouse_number_value_pt
+ngx_http_statshouse_number_accessor(ngx_str_t *value)
+{
+    ngx_http_statshouse_number_t  *number;
+
+    for (number = ngx_http_statshouse_numbers; number->name.len; number++) {
+        if (number->name.len == value->len
+            && ngx_strncmp(number->name.data, value->data, value->len) == 0)
+        {
+            return number->handler;
+        }
+    }
+
+    return NULL;
+}
+
+
+static void *
+ngx_http_statshouse_predicate_operand(ngx_conf_t *cf, ngx_str_t *value,
+    ngx_statshouse_number_value_pt *accessor)
+{
+    ngx_http_statshouse_complex_value_t  *cv;
+
+    cv = ngx_http_statshouse_intern_complex_value(cf, value);
+    if (cv == NULL) {
+        return NULL;
+    }
+
+    if (cv->complex.lengths != NULL) {
+        *accessor = ngx_http_statshouse_number_accessor(value);
+    }
+
+    return cv;
+}
+
+
+static ngx_int_t
+ngx_http_statshouse_request_time(void *ctx, double *number)
+{
+    ngx_http_request_t  *r = ctx;
+    ngx_time_t          *tp;
+    ngx_msec_int_t       ms;
+
+    tp = ngx_timeofday();
+
+    ms = (ngx_msec_int_t)
+             ((tp->sec - r->start_sec) * 1000 + (tp->msec - r->start_msec));
+    ms = ngx_max(ms, 0);
+
+    *number = (double) ms / 1000;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_statshouse_status(void *ctx, double *number)
+{
+    ngx_http_request_t  *r = ctx;
+
+    if (r->err_status) {
+        *number = r->err_status;
+
+    } else if (r->headers_out.status) {
+        *number = r->headers_out.status;
+
+    } else if (r->http_version == NGX_HTTP_VERSION_9) {
+        *number = 9;
+
+    } else {
+        *number = 0;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_statshouse_bytes_sent(void *ctx, double *number)
+{
+    ngx_http_request_t  *r = ctx;
+
+    *number = r->connection->sent;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_statshouse_body_bytes_sent(void *ctx, double *number)
+{
+    ngx_http_request_t  *r = ctx;
+    off_t                sent;
+
+    sent = r->connection->sent - r->header_size;
+
+    *number = ngx_max(sent, 0);
 
-        conf->value.complex = ngx_pcalloc(cf->pool, sizeof(ngx_http_complex_value_t));
-        if (conf->value.complex == NULL) {
-            return NGX_ERROR;
-        }
+    return NGX_OK;
+}
 
-        ccv.cf = cf;
-        ccv.value = &conf->value.string;
-        ccv.complex_value = conf->value.complex;
 
-        if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
-            return NGX_ERROR;
-        }
+static ngx_int_t
+ngx_http_statshouse_request_length(void *ctx, double *number)
+{
+    ngx_http_request_t  *r = ctx;
 
-        if (conf->condition.strings) {
-            conf->condition.complex = ngx_array_create(cf->pool, conf->condition.strings->nelts,
-                sizeof(ngx_http_complex_value_t));
-            if (conf->condition.complex == NULL) {
-                return NGX_ERROR;
-            }
+    *number = r->request_length;
 
-            strings = conf->condition.strings->elts;
+    return NGX_OK;
+}
 
-            for (n = 0; n < conf->condition.strings->nelts; n++) {
-                condition = ngx_array_push(conf->condition.complex);
-                if (condition == NULL) {
-                    return NGX_ERROR;
-                }
 
-                ngx_memzero(condition, sizeof(ngx_http_complex_value_t));
-                ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+static ngx_int_t
+ngx_http_statshouse_upstream_response_time(void *ctx, double *number)
+{
+    return ngx_http_statshouse_upstream_time(ctx, number,
+        offsetof(ngx_http_upstream_state_t, response_time));
+}
 
-                ccv.cf = cf;
-                ccv.value = &strings[n];
-                ccv.complex_value = condition;
 
-                if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
-                    return NGX_ERROR;
-                }
-            }
-        }
+static ngx_int_t
+ngx_http_statshouse_upstream_connect_time(void *ctx, double *number)
+{
+    return ngx_http_statshouse_upstream_time(ctx, number,
+        offsetof(ngx_http_upstream_state_t, connect_time));
+}
 
 
-        for (j = 0; j < NGX_STATSHOUSE_STAT_KEYS_MAX; j++) {
-            key = &conf->keys[j];
+static ngx_int_t
+ngx_http_statshouse_upstream_header_time(void *ctx, double *number)
+{
+    return ngx_http_statshouse_upstream_time(ctx, number,
+        offsetof(ngx_http_upstream_state_t, header_time));
+}
 
-            if (key->name.len == 0) {
-                continue;
-            }
 
-            if (key->exists) {
-                variables = key->exists->elts;
+static ngx_int_t
+ngx_http_statshouse_upstream_time(ngx_http_request_t *r, double *number, size_t offset)
+{
+    ngx_http_upstream_state_t  *state;
+    ngx_msec_int_t              ms;
 
-                for (n = 0; n < key->exists->nelts; n++) {
-                    if (ngx_http_statshouse_variable_exists(cf, variables[n]) != NGX_OK) {
-                        key->disable = 1;
-                        break;
-                    }
-                }
-            }
+    if (r->upstream_states == NULL || r->upstream_states->nelts == 0) {
+        return NGX_DECLINED;
+    }
 
-            if (key->disable) {
-                continue;
-            }
+    /* lists of several upstreams and "-" are left to the variable */
 
-            ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+    if (r->upstream_states->nelts > 1) {
+        return NGX_AGAIN;
+    }
 
-            key->complex = ngx_pcalloc(cf->pool, sizeof(ngx_http_complex_value_t));
-            if (key->complex == NULL) {
-                return NGX_ERROR;
-            }
+    state = r->upstream_states->elts;
 
-            ccv.cf = cf;
-            ccv.value = &key->string;
-            ccv.complex_value = key->complex;
+    if (state->status == 0) {
+        return NGX_AGAIN;
+    }
 
-            if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
-                return NGX_ERROR;
-            }
-        }
+    ms = *(ngx_msec_int_t *) ((u_char *) state + offset);
+    if (ms == -1) {
+        return NGX_AGAIN;
     }
 
+    ms = ngx_max(ms, 0);
+
+    *number = (double) ms / 1000;
+
     return NGX_OK;
 }
 
@@ -458,9 +1210,10 @@ ngx_http_statshouse_init_complex(ngx_conf_t *cf)
 static ngx_int_t
 ngx_http_statshouse_variable_exists(ngx_conf_t *cf, ngx_str_t name)
 {
-    ngx_uint_t                  i;
+    ngx_uint_t                  i, k;
+    ngx_str_t                  *key;
     ngx_http_variable_t        *v, *pv;
-    ngx_hash_key_t             *key;
+    ngx_hash_keys_arrays_t     *keys;
     ngx_http_core_main_conf_t  *cmcf;
 
     cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
@@ -473,6 +1226,21 @@ ngx_http_statshouse_variable_exists(ngx_conf_t *cf, ngx_str_t name)
     name.data++;
     name.len--;
 
+    /* defined variables, keys_hash buckets of the keys array */
+
+    keys = cmcf->variables_keys;
+
+    k = ngx_hash_key_lc(name.data, name.len) % keys->hsize;
+
+    key = keys->keys_hash[k].elts;
+    for (i = 0; i < keys->keys_hash[k].nelts; i++) {
+        if (name.len == key[i].len
+            && ngx_strncmp(name.data, key[i].data, name.len) == 0)
+        {
+            return NGX_OK;
+        }
+    }
+
     pv = cmcf->prefix_variables.elts;
     for (i = 0; i < cmcf->prefix_variables.nelts; i++) {
         if (name.len >= pv[i].name.len
@@ -491,15 +1259,6 @@ ngx_http_statshouse_variable_exists(ngx_conf_t *cf, ngx_str_t name)
         }
     }
 
-    key = cmcf->variables_keys->keys.elts;
-    for (i = 0; i < cmcf->variables_keys->keys.nelts; i++) {
-        if (name.len == key[i].key.len
-            && ngx_strncmp(name.data, key[i].key.data, name.len) == 0)
-        {
-            return NGX_OK;
-        }
-    }
-
     return NGX_DECLINED;
 }
 
@@ -511,6 +1270,7 @@ ngx_http_statshouse_init(ngx_conf_t *cf)
     ngx_http_variable_t               *cv, *v;
     ngx_http_handler_pt               *h;
     ngx_http_statshouse_main_conf_t   *smcf;
+    ngx_http_statshouse_loc_conf_t    *slcf;
     ngx_statshouse_server_t          **servers;
     ngx_uint_t                         i;
 
@@ -523,12 +1283,24 @@ ngx_http_statshouse_init(ngx_conf_t *cf)
         *v = *cv;
     }
 
+    /* metrics of http level are sent outside of requests too */
+
+    slcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_statshouse_module);
+
+    if (ngx_http_statshouse_bind(cf, slcf) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
     if (ngx_http_statshouse_init_complex(cf) == NGX_ERROR) {
         return NGX_ERROR;
     }
 
+    if (ngx_http_statshouse_init_phases(cf, slcf) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
     smcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_statshouse_module);
-    if (smcf->servers == NULL || smcf->confs == NULL) {
+    if (smcf->servers == NULL) {
         return NGX_OK;
     }
 
@@ -562,6 +1334,15 @@ ngx_http_statshouse_create_main_conf(ngx_conf_t *cf)
         return NULL;
     }
 
+    conf->exprs = ngx_statshouse_exprs_create(cf->pool);
+    if (conf->exprs == NULL) {
+        return NULL;
+    }
+
+    if (ngx_statshouse_scratch_init(&conf->scratch, NGX_STATSHOUSE_SCRATCH_SIZE, cf->pool) != NGX_OK) {
+        return NULL;
+    }
+
     return conf;
 }
 
@@ -580,6 +1361,7 @@ ngx_http_statshouse_create_loc_conf(ngx_conf_t *cf)
      * set by ngx_pcalloc():
      * 
      * conf->confs
+     * conf->presets = 0
      */
 
     conf->enable = NGX_CONF_UNSET;
@@ -594,33 +1376,86 @@ ngx_http_statshouse_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 {
     ngx_http_statshouse_loc_conf_t   *prev = parent;
     ngx_http_statshouse_loc_conf_t   *conf = child;
-    ngx_statshouse_conf_t           **sconfs, **sconf;
-    ngx_uint_t                       i;
 
-    if (prev->confs) {
-        if (conf->confs == NULL) {
-            conf->confs = prev->confs;
-        } else {
-            sconfs = prev->confs->elts;
-
-            for (i = 0; i < prev->confs->nelts; i++) {
-                sconf = ngx_array_push(conf->confs);
-                if (sconf == NULL) {
-                    return NGX_CONF_ERROR;
-                }
+    conf->inherit = prev->confs ? prev : prev->inherit;
 
-                *sconf = sconfs[i];
-            }
-        }
+    if (ngx_http_statshouse_init_phases(cf, conf) != NGX_OK) {
+        return NGX_CONF_ERROR;
     }
 
     ngx_conf_merge_value(conf->enable, prev->enable, 0);
     ngx_conf_merge_ptr_value(conf->server, prev->server, NULL);
 
+    if (ngx_http_statshouse_bind(cf, conf) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_conf_merge_bitmask_value(conf->presets, prev->presets,
+        (NGX_CONF_BITMASK_SET|NGX_HTTP_STATSHOUSE_PRESET_OFF));
+
+    if (conf->presets & NGX_HTTP_STATSHOUSE_PRESET_OFF) {
+        conf->presets = NGX_CONF_BITMASK_SET|NGX_HTTP_STATSHOUSE_PRESET_OFF;
+    }
+
     return NGX_CONF_OK;
 }
 
 
+static ngx_int_t
+ngx_http_statshouse_init_phases(ngx_conf_t *cf, ngx_http_statshouse_loc_conf_t *slcf)
+{
+    ngx_statshouse_conf_t  **confs;
+    ngx_uint_t               i;
+
+    if (slcf->confs == NULL || slcf->phases) {
+        return NGX_OK;
+    }
+
+    confs = slcf->confs->elts;
+
+    for (i = 0; i < slcf->confs->nelts; i++) {
+        if (ngx_statshouse_phases_add(&slcf->phases, confs[i], cf->pool) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+/* own and inherited metrics are sent to the server of the configuration */
+
+static ngx_int_t
+ngx_http_statshouse_bind(ngx_conf_t *cf, ngx_http_statshouse_loc_conf_t *slcf)
+{
+    ngx_http_statshouse_loc_conf_t  *lcf;
+    ngx_statshouse_conf_t          **confs;
+    ngx_uint_t                       i;
+
+    /* http level conf is never merged, server may be unset */
+
+    if (slcf->server == NULL || slcf->server == NGX_CONF_UNSET_PTR || slcf->enable != 1) {
+        return NGX_OK;
+    }
+
+    for (lcf = slcf; lcf; lcf = lcf->inherit) {
+        if (lcf->confs == NULL) {
+            continue;
+        }
+
+        confs = lcf->confs->elts;
+
+        for (i = 0; i < lcf->confs->nelts; i++) {
+            if (ngx_statshouse_conf_bind(cf, confs[i], slcf->server) != NGX_OK) {
+                return NGX_ERROR;
+            }
+        }
+    }
+
+    return NGX_OK;
+}
+
+
 static char *
 ngx_http_statshouse_metric_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
@@ -661,13 +1496,24 @@ ngx_http_statshouse_metric_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    shc->defs = ngx_pcalloc(cf->pool, sizeof(ngx_statshouse_conf_key_def_t) * NGX_STATSHOUSE_STAT_KEYS_MAX);
+    if (shc->defs == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
     value = cf->args->elts;
     shc->name = value[1];
 
     shc->exists = NGX_CONF_UNSET_PTR;
     shc->condition.strings = NGX_CONF_UNSET_PTR;
     shc->timeout = NGX_CONF_UNSET;
-    shc->sample = NGX_CONF_UNSET;
+
+    if (cmd->post) {
+        shc->members = ngx_array_create(cf->pool, 4, sizeof(ngx_statshouse_conf_member_t));
+        if (shc->members == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
 
     ctx->statshouse_conf[ngx_http_statshouse_module.ctx_index] = shc;
 
@@ -683,7 +1529,19 @@ ngx_http_statshouse_metric_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return rv;
     }
 
-    if (shc->value.type == 0) {
+    if (shc->members) {
+        if (shc->value.type || shc->members->nelts == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "statshouse_metric_group requires metric params instead of count/unique/value");
+            return NGX_CONF_ERROR;
+        }
+
+        /* key tuples are counted, members are sent with their weight */
+
+        shc->value.type = ngx_statshouse_mt_counter;
+        ngx_str_set(&shc->value.string, "1");
+
+    } else if (shc->value.type == 0) {
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "missed count/unique/value param in statshouse_metric");
         return NGX_CONF_ERROR;
     }
@@ -691,7 +1549,6 @@ ngx_http_statshouse_metric_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     ngx_conf_init_ptr_value(shc->exists, NULL);
     ngx_conf_init_ptr_value(shc->condition.strings, NULL);
     ngx_conf_init_value(shc->timeout, 0);
-    ngx_conf_init_value(shc->sample, 0);
 
     shc_ptr = ngx_array_push(slcf->confs);
     if (shc_ptr == NULL) {
@@ -756,13 +1613,13 @@ ngx_http_statshouse_value_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 static char *
 ngx_http_statshouse_key_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    char  *p = conf;
-
-    ngx_statshouse_conf_key_t         *key;
+    ngx_statshouse_conf_t             *shc = conf;
+    ngx_statshouse_conf_key_def_t     *key;
     ngx_str_t                         *value, *variable, s;
     ngx_uint_t                         i;
+    ngx_int_t                          rc;
 
-    key = (ngx_statshouse_conf_key_t *) (p + cmd->offset);
+    key = &shc->defs[cmd->offset];
 
     if (key->name.len) {
         return "is duplicate";
@@ -781,6 +1638,16 @@ ngx_http_statshouse_key_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        rc = ngx_statshouse_conf_key_option(cf, key, &value[i]);
+
+        if (rc == NGX_ERROR) {
+            return NGX_CONF_ERROR;
+        }
+
+        if (rc == NGX_OK) {
+            continue;
+        }
+
         if (ngx_strncmp(value[i].data, "exists=", 7) == 0) {
             s.data = value[i].data + 7;
             s.len = value[i].len - 7;
@@ -819,10 +1686,10 @@ ngx_http_statshouse_server_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     ngx_url_t                          url;
     ngx_str_t                         *value, s;
     ngx_flag_t                         flush_after_request;
-    ngx_int_t                          splits_max, aggregate_values;
+    ngx_int_t                          splits_max, aggregate_values, adaptive;
     ngx_uint_t                         i;
     ssize_t                            buffer_size;
-    size_t                             aggregate_size;
+    size_t                             aggregate_size, aggregate_intern;
     ngx_msec_t                         flush;
 
     value = cf->args->elts;
@@ -842,9 +1709,11 @@ ngx_http_statshouse_server_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     buffer_size = 4 * 1024;
     aggregate_size = 0;
     aggregate_values = 24;
+    aggregate_intern = 16 * 1024;
     flush_after_request = 0;
     splits_max = 16;
     flush = 1000;
+    adaptive = 0;
 
     ngx_memzero(&url, sizeof(ngx_url_t));
     url.url = value[1];
@@ -904,6 +1773,33 @@ ngx_http_statshouse_server_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         }
 
 
+        if (ngx_strncmp(value[i].data, "aggregate_intern=", 17) == 0) {
+
+            s.data =  value[i].data + 17;
+            s.len = value[i].data + value[i].len - s.data;
+
+            aggregate_intern = ngx_parse_size(&s);
+
+            if (aggregate_intern == (size_t) NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid aggregate intern size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "adaptive=", 9) == 0) {
+
+            adaptive = ngx_atoi(value[i].data + 9, value[i].len - 9);
+
+            if (adaptive == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid adaptive budget \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
         if (ngx_strncmp(value[i].data, "flush=", 6) == 0) {
 
             s.data =  value[i].data + 6;
@@ -964,6 +1860,8 @@ ngx_http_statshouse_server_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             servers[i]->splits_max == splits_max &&
             servers[i]->aggregate_size == aggregate_size &&
             servers[i]->aggregate_values == aggregate_values &&
+            servers[i]->aggregate_intern == aggregate_intern &&
+            servers[i]->adaptive == (ngx_uint_t) adaptive &&
             servers[i]->buffer_size == buffer_size)
         {
             server = servers[i];
@@ -996,8 +1894,10 @@ ngx_http_statshouse_server_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     server->buffer_size = buffer_size;
     server->aggregate_size = aggregate_size;
     server->aggregate_values = aggregate_values;
+    server->aggregate_intern = aggregate_intern;
     server->splits_max = splits_max;
     server->flush = flush;
+    server->adaptive = adaptive;
 
     server->log = &cf->cycle->new_log;
 
@@ -1008,71 +1908,164 @@ ngx_http_statshouse_server_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 }
 
 
+static char *
+ngx_http_statshouse_preset_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_statshouse_main_conf_t  *smcf;
+    ngx_statshouse_handle_t         **handles;
+    ngx_uint_t                        i, n;
+    char                             *rv;
+
+    rv = ngx_conf_set_bitmask_slot(cf, cmd, conf);
+    if (rv != NGX_CONF_OK) {
+        return rv;
+    }
+
+    smcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_statshouse_module);
+    if (smcf->preset_requests) {
+        return NGX_CONF_OK;
+    }
+
+    n = sizeof(ngx_http_statshouse_preset_requests) / sizeof(ngx_http_statshouse_preset_t) - 1;
+
+    handles = ngx_palloc(cf->pool, sizeof(ngx_statshouse_handle_t *) * n);
+    if (handles == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    for (i = 0; i < n; i++) {
+        handles[i] = ngx_statshouse_handle_create(cf, &ngx_http_statshouse_preset_requests[i].name,
+            ngx_http_statshouse_preset_requests[i].type, ngx_http_statshouse_preset_keys,
+            sizeof(ngx_http_statshouse_preset_keys) / sizeof(ngx_uint_t));
+        if (handles[i] == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    smcf->preset_requests = handles;
+
+    return NGX_CONF_OK;
+}
+
+
 static ngx_int_t
 ngx_http_statshouse_handler(ngx_http_request_t *request)
 {
+    ngx_http_statshouse_send_preset(request);
+
     return ngx_http_statshouse_send(request, NULL);
 }
 
 
+/* preset metrics are read from the request, no variables are evaluated */
+
+static void
+ngx_http_statshouse_send_preset(ngx_http_request_t *request)
+{
+    ngx_http_statshouse_main_conf_t   *smcf;
+    ngx_http_statshouse_loc_conf_t    *slcf;
+    ngx_http_core_srv_conf_t          *cscf;
+    ngx_http_statshouse_preset_t      *preset;
+    ngx_str_t                          keys[5];
+    ngx_uint_t                         i, status;
+    u_char                             digits[3];
+    double                             number;
+
+    slcf = ngx_http_get_module_loc_conf(request, ngx_http_statshouse_module);
+    if (slcf->server == NULL || slcf->enable == 0
+        || !(slcf->presets & NGX_HTTP_STATSHOUSE_PRESET_REQUESTS))
+    {
+        return;
+    }
+
+    smcf = ngx_http_get_module_main_conf(request, ngx_http_statshouse_module);
+    cscf = ngx_http_get_module_srv_conf(request, ngx_http_core_module);
+
+    ngx_http_statshouse_status(request, &number);
+    status = (ngx_uint_t) number % 1000;
+
+    digits[0] = (u_char) ('0' + status / 100);
+    digits[1] = (u_char) ('0' + status / 10 % 10);
+    digits[2] = (u_char) ('0' + status % 10);
+
+    keys[0] = ngx_cycle->hostname;
+    keys[1] = cscf->server_name;
+    keys[2] = request->method_name;
+    keys[3] = request->http_protocol;
+    keys[4].data = digits;
+    keys[4].len = 3;
+
+    preset = ngx_http_statshouse_preset_requests;
+
+    for (i = 0; preset[i].name.len; i++) {
+        number = 1;
+
+        if (preset[i].handler) {
+            preset[i].handler(request, &number);
+        }
+
+        ngx_statshouse_handle_send(slcf->server, smcf->preset_requests[i], keys, number);
+    }
+}
+
+
 ngx_int_t
 ngx_http_statshouse_send(ngx_http_request_t *request, ngx_str_t *phase)
 {
+    ngx_http_statshouse_main_conf_t   *smcf;
     ngx_http_statshouse_loc_conf_t    *slcf;
 
+    ngx_http_statshouse_loc_conf_t    *lcf;
     ngx_statshouse_server_t           *server;
-    ngx_statshouse_conf_t            **confs, *conf;
-    ngx_statshouse_stat_t             *stats;
+    ngx_statshouse_phase_t            *bucket;
+    ngx_statshouse_conf_t            **confs;
     ngx_uint_t                         i;
-    ngx_int_t                          j, n;
+    ngx_int_t                          n;
 
     slcf = ngx_http_get_module_loc_conf(request, ngx_http_statshouse_module);
-    if (slcf->server == NULL || slcf->confs == NULL || slcf->enable == 0) {
+    if (slcf->server == NULL || slcf->enable == 0) {
         return NGX_OK;
     }
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, request->connection->log, 0,
         "statshouse handler");
 
-    confs = slcf->confs->elts;
-    server = slcf->server;
-    stats = server->splits;
+    smcf = ngx_http_get_module_main_conf(request, ngx_http_statshouse_module);
+    ngx_statshouse_exprs_next(smcf->exprs);
 
-    for (i = 0; i < slcf->confs->nelts; i++) {
-        conf = confs[i];
+    smcf->scratch.pool = request->pool;
 
-        if (phase == NULL && conf->phase.len != 0) {
-            continue;
-        }
+    server = slcf->server;
 
-        if (phase &&
-            (phase->len != conf->phase.len ||
-                ngx_strncmp(phase->data, conf->phase.data, phase->len) != 0))
-        {
+    for (lcf = slcf; lcf; lcf = lcf->inherit) {
+        if (lcf->phases == NULL) {
             continue;
         }
 
-        if ((conf->sample > 0) &&
-            (ngx_random() % 100 > conf->sample))
-        {
+        bucket = ngx_statshouse_phases_find(lcf->phases, phase);
+        if (bucket == NULL) {
             continue;
         }
 
-        n = ngx_statshouse_stat_compile(conf, stats, server->splits_max,
-            (ngx_statshouse_complex_value_pt) ngx_http_complex_value, request,
-            request->connection->log);
-        if (n <= 0) {
-            continue;
-        }
+        confs = bucket->confs.elts;
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, request->connection->log, 0,
-            "statshouse send %d stats", n);
+        for (i = 0; i < bucket->confs.nelts; i++) {
+            n = ngx_statshouse_stat_compile(server, confs[i],
+                ngx_http_statshouse_complex_value, request,
+                request->connection->log);
+            if (n <= 0) {
+                continue;
+            }
 
-        for (j = 0; j < n; j++) {
-            ngx_statshouse_send(server, &stats[j]);
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, request->connection->log, 0,
+                "statshouse send %d stats", n);
+
+            ngx_statshouse_send_batch(server, server->splits, n);
         }
     }
 
+    ngx_statshouse_scratch_reset(&smcf->scratch);
+
     ngx_statshouse_flush_after_request(server);
     return NGX_OK;
 }
@@ -1155,3 +2148,26 @@ ngx_http_statshouse_send_stat(ngx_http_request_t *request, ngx_statshouse_stat_t
     ngx_statshouse_send(server, stat);
     return NGX_OK;
 }
+
+
+ngx_statshouse_handle_t *
+ngx_http_statshouse_register(ngx_conf_t *cf, ngx_str_t *name, ngx_statshouse_stat_type_e type,
+    ngx_uint_t *keys, ngx_uint_t nkeys)
+{
+    return ngx_statshouse_handle_create(cf, name, type, keys, nkeys);
+}
+
+
+ngx_int_t
+ngx_http_statshouse_send_handle(ngx_http_request_t *request, ngx_statshouse_handle_t *handle,
+    ngx_str_t *keys, double number)
+{
+    ngx_http_statshouse_loc_conf_t  *slcf;
+
+    slcf = ngx_http_get_module_loc_conf(request, ngx_http_statshouse_module);
+    if (slcf->server == NULL || slcf->enable == 0) {
+        return NGX_OK;
+    }
+
+    return ngx_statshouse_handle_send(slcf->server, handle, keys, number);
+}
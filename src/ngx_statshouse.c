@@ -13,6 +13,7 @@
 
 #include "ngx_statshouse.h"
 #include "ngx_statshouse_tl.h"
+#include "ngx_statshouse_predicate.h"
 
 
 static void       ngx_statshouse_timer_init(ngx_statshouse_server_t *server);
@@ -24,6 +25,44 @@ static void       ngx_statshouse_timer_handler(ngx_event_t *ev);
 static void       ngx_statshouse_timer(ngx_statshouse_server_t *server);
 static ngx_int_t  ngx_statshouse_send_to_buffer(ngx_statshouse_server_t *server, ngx_statshouse_stat_t *stat);
 static ngx_int_t  ngx_statshouse_aggregate_handler(ngx_statshouse_stat_t *stat, void *ctx);
+static void       ngx_statshouse_window_init(ngx_statshouse_server_t *server);
+static void       ngx_statshouse_window_handler(ngx_event_t *ev);
+static void       ngx_statshouse_window_add(ngx_statshouse_server_t *server, ngx_statshouse_conf_t *conf);
+static void       ngx_statshouse_adaptive_init(ngx_statshouse_server_t *server);
+static void       ngx_statshouse_adaptive_handler(ngx_event_t *ev);
+static void       ngx_statshouse_adaptive_add(ngx_statshouse_server_t *server, ngx_statshouse_conf_t *conf,
+    ngx_uint_t n);
+static ngx_int_t  ngx_statshouse_conf_key_transform(ngx_statshouse_conf_transform_t *transform,
+    ngx_str_t *value, ngx_statshouse_scratch_t *scratch);
+static ngx_int_t  ngx_statshouse_stat_value_parse(ngx_statshouse_stat_type_e type, ngx_str_t *s,
+    ngx_statshouse_stat_value_t *value, ngx_log_t *log);
+static ngx_int_t  ngx_statshouse_expr_value(ngx_statshouse_conf_t *conf, ngx_uint_t index, void *val,
+    ngx_statshouse_complex_value_pt complex, void *complex_ctx, ngx_str_t *value);
+static ngx_int_t  ngx_statshouse_stat_compile_value(ngx_statshouse_conf_t *conf,
+    ngx_statshouse_conf_value_t *cv, ngx_statshouse_complex_value_pt complex, void *complex_ctx,
+    ngx_str_t *s, ngx_statshouse_stat_value_t *value, ngx_log_t *log);
+static ngx_int_t  ngx_statshouse_stat_compile_members(ngx_statshouse_server_t *server,
+    ngx_statshouse_conf_t *conf, ngx_int_t splits, ngx_statshouse_complex_value_pt complex,
+    void *complex_ctx, ngx_log_t *log);
+static ngx_int_t  ngx_statshouse_stat_compile_dense(ngx_statshouse_server_t *server, ngx_statshouse_conf_t *conf,
+    ngx_statshouse_complex_value_pt complex, void *complex_ctx, double weight, ngx_log_t *log);
+static ngx_int_t  ngx_statshouse_conf_key_buckets(ngx_conf_t *cf, ngx_statshouse_conf_transform_t *transform,
+    ngx_str_t *value);
+static ngx_int_t  ngx_statshouse_conf_init_keys(ngx_conf_t *cf, ngx_statshouse_conf_t *conf);
+static ngx_int_t  ngx_statshouse_conf_init_constant(ngx_conf_t *cf, ngx_statshouse_conf_t *conf);
+static ngx_int_t  ngx_statshouse_conf_init_exprs(ngx_conf_t *cf, ngx_statshouse_conf_t *conf);
+static ngx_int_t  ngx_statshouse_conf_init_dense(ngx_conf_t *cf, ngx_statshouse_conf_t *conf);
+static ngx_int_t  ngx_statshouse_conf_init_topk(ngx_conf_t *cf, ngx_statshouse_conf_t *conf);
+static ngx_int_t  ngx_statshouse_stat_collapse(ngx_statshouse_stat_t **stats, ngx_int_t n);
+static uint32_t   ngx_statshouse_stat_hash(ngx_statshouse_stat_t *stat);
+static uint32_t   ngx_statshouse_random(void);
+
+
+static uint64_t  ngx_statshouse_random_state;
+
+
+#define ngx_statshouse_server_split(server, n)                                \
+    ((ngx_statshouse_stat_t *) ((server)->splits_stats + (n) * (server)->splits_size))
 
 
 ngx_int_t
@@ -34,11 +73,32 @@ ngx_statshouse_server_init(ngx_statshouse_server_t *server, ngx_pool_t *pool)
         return NGX_ERROR;
     }
 
-    server->splits = ngx_pcalloc(pool, sizeof(ngx_statshouse_stat_t) * server->splits_max);
+    server->splits = ngx_pcalloc(pool, sizeof(ngx_statshouse_stat_t *) * server->splits_max);
     if (server->splits == NULL) {
         return NGX_ERROR;
     }
 
+    /* each split has room for values of all splits collapsed into it */
+
+    server->splits_size = ngx_align(sizeof(ngx_statshouse_stat_t)
+        + sizeof(ngx_statshouse_stat_value_t) * (server->splits_max - 1), NGX_ALIGNMENT);
+
+    server->splits_stats = ngx_pcalloc(pool, server->splits_size * server->splits_max);
+    if (server->splits_stats == NULL) {
+        return NGX_ERROR;
+    }
+
+    server->splits_keys = ngx_palloc(pool,
+        sizeof(ngx_str_t) * NGX_STATSHOUSE_STAT_KEYS_MAX * server->splits_max);
+    if (server->splits_keys == NULL) {
+        return NGX_ERROR;
+    }
+
+    server->splits_parts = ngx_palloc(pool, sizeof(ngx_str_t) * server->splits_max);
+    if (server->splits_parts == NULL) {
+        return NGX_ERROR;
+    }
+
     if (server->aggregate_size) {
         server->aggregate = ngx_pcalloc(pool, sizeof(ngx_statshouse_aggregate_t));
         if (server->aggregate == NULL) {
@@ -48,6 +108,7 @@ ngx_statshouse_server_init(ngx_statshouse_server_t *server, ngx_pool_t *pool)
         server->aggregate->interval = server->flush;
         server->aggregate->size = server->aggregate_size;
         server->aggregate->values = server->aggregate_values;
+        server->aggregate->intern_size = server->aggregate_intern;
 
         server->aggregate->handler = ngx_statshouse_aggregate_handler;
         server->aggregate->ctx = server;
@@ -59,6 +120,11 @@ ngx_statshouse_server_init(ngx_statshouse_server_t *server, ngx_pool_t *pool)
     }
 
     ngx_statshouse_timer_init(server);
+    ngx_statshouse_window_init(server);
+
+    if (server->adaptive) {
+        ngx_statshouse_adaptive_init(server);
+    }
 
     return NGX_OK;
 }
@@ -215,6 +281,266 @@ ngx_statshouse_timer(ngx_statshouse_server_t *server)
 }
 
 
+static void
+ngx_statshouse_window_init(ngx_statshouse_server_t *server)
+{
+    if (server->window_event.handler != NULL) {
+        return;
+    }
+
+    ngx_queue_init(&server->windows);
+
+    server->window_event.handler = ngx_statshouse_window_handler;
+    server->window_event.log = server->log;
+    server->window_event.data = &server->window_connection;
+
+    server->window_connection.fd = -1;
+    server->window_connection.data = server;
+}
+
+
+static void
+ngx_statshouse_window_handler(ngx_event_t *ev)
+{
+    ngx_connection_t         *connection = ev->data;
+    ngx_statshouse_server_t  *server = connection->data;
+    ngx_statshouse_conf_t    *conf;
+    ngx_queue_t              *queue, again;
+    double                    weight;
+
+    ngx_queue_init(&again);
+
+    while (!ngx_queue_empty(&server->windows)) {
+        queue = ngx_queue_head(&server->windows);
+        conf = ngx_queue_data(queue, ngx_statshouse_conf_t, window);
+
+        ngx_queue_remove(queue);
+        ngx_memzero(queue, sizeof(ngx_queue_t));
+
+        if (conf->dense) {
+            ngx_statshouse_dense_process(conf->dense, ngx_statshouse_aggregate_handler, server);
+        }
+
+        if (conf->topk) {
+            ngx_statshouse_topk_process(conf->topk, ngx_statshouse_aggregate_handler, server);
+        }
+
+        if (conf->card) {
+            ngx_statshouse_cardinality_process(conf->card, ngx_statshouse_aggregate_handler, server);
+        }
+
+        if (conf->limiter) {
+            weight = conf->sample ? conf->sample_weight : 1;
+
+            if (conf->adaptive_sample) {
+                weight *= conf->adaptive_weight;
+            }
+
+            if (ngx_statshouse_rate_process(conf->limiter, ngx_current_msec, weight,
+                    ngx_statshouse_aggregate_handler, server) == NGX_AGAIN)
+            {
+                /* suppressed events are still carried, look again next window */
+                ngx_queue_insert_tail(&again, &conf->window);
+            }
+        }
+    }
+
+    if (ngx_terminate || ngx_exiting) {
+        ngx_statshouse_flush(server);
+        return;
+    }
+
+    if (!ngx_queue_empty(&again)) {
+        ngx_queue_add(&server->windows, &again);
+        ngx_add_timer(&server->window_event, server->flush ? server->flush : 1000);
+    }
+}
+
+
+static void
+ngx_statshouse_window_add(ngx_statshouse_server_t *server, ngx_statshouse_conf_t *conf)
+{
+    if (conf->window.next != NULL) {
+        return;
+    }
+
+    ngx_queue_insert_tail(&server->windows, &conf->window);
+
+    if (server->window_event.timer_set) {
+        return;
+    }
+
+    /* not cancelable, so last window is sent on worker shutdown */
+
+    ngx_add_timer(&server->window_event, server->flush ? server->flush : 1000);
+}
+
+
+static void
+ngx_statshouse_adaptive_init(ngx_statshouse_server_t *server)
+{
+    if (server->adaptive_event.handler != NULL) {
+        return;
+    }
+
+    ngx_queue_init(&server->adaptives);
+
+    server->adaptive_budget = server->adaptive;
+
+    server->adaptive_event.handler = ngx_statshouse_adaptive_handler;
+    server->adaptive_event.log = server->log;
+    server->adaptive_event.data = &server->adaptive_connection;
+    server->adaptive_event.cancelable = 1;
+
+    server->adaptive_connection.fd = -1;
+    server->adaptive_connection.data = server;
+}
+
+
+/*
+ * Once a second the stats budget is shared between metrics seen during
+ * the second: metrics under the fair share are not sampled, the rest of
+ * the share goes to heavy metrics, which are sampled to fit it.  Timer
+ * lag means the worker is overloaded, the budget is halved then and
+ * doubled back when lag is gone.
+ */
+
+static void
+ngx_statshouse_adaptive_handler(ngx_event_t *ev)
+{
+    ngx_connection_t         *connection = ev->data;
+    ngx_statshouse_server_t  *server = connection->data;
+    ngx_statshouse_conf_t    *conf;
+    ngx_queue_t              *queue, *next;
+    ngx_msec_int_t            lag;
+    ngx_uint_t                n, heavy;
+    double                    share, spare, p;
+
+    lag = (ngx_msec_int_t) (ngx_current_msec - server->adaptive_expire);
+
+    if (lag > NGX_STATSHOUSE_ADAPTIVE_LAG) {
+        server->adaptive_budget /= 2;
+
+        if (server->adaptive_budget < 1) {
+            server->adaptive_budget = 1;
+        }
+
+    } else if (server->adaptive_budget < server->adaptive) {
+        server->adaptive_budget *= 2;
+
+        if (server->adaptive_budget > server->adaptive) {
+            server->adaptive_budget = server->adaptive;
+        }
+    }
+
+    n = 0;
+
+    for (queue = ngx_queue_head(&server->adaptives);
+         queue != ngx_queue_sentinel(&server->adaptives);
+         queue = ngx_queue_next(queue))
+    {
+        n++;
+    }
+
+    if (n == 0) {
+        return;
+    }
+
+    share = server->adaptive_budget / n;
+    spare = 0;
+    heavy = 0;
+
+    for (queue = ngx_queue_head(&server->adaptives);
+         queue != ngx_queue_sentinel(&server->adaptives);
+         queue = ngx_queue_next(queue))
+    {
+        conf = ngx_queue_data(queue, ngx_statshouse_conf_t, adaptive);
+
+        if (conf->adaptive_events <= share) {
+            spare += share - conf->adaptive_events;
+
+        } else {
+            heavy++;
+        }
+    }
+
+    if (heavy) {
+        share += spare / heavy;
+    }
+
+    for (queue = ngx_queue_head(&server->adaptives);
+         queue != ngx_queue_sentinel(&server->adaptives);
+         queue = next)
+    {
+        next = ngx_queue_next(queue);
+        conf = ngx_queue_data(queue, ngx_statshouse_conf_t, adaptive);
+
+        if (conf->adaptive_events <= share) {
+            conf->adaptive_sample = 0;
+            conf->adaptive_weight = 1;
+
+        } else {
+            p = share / conf->adaptive_events;
+
+            conf->adaptive_sample = (uint32_t) (p * 4294967296.0);
+            conf->adaptive_weight = 1 / p;
+
+            if (conf->adaptive_sample == 0) {
+                conf->adaptive_sample = 1;
+            }
+        }
+
+        ngx_log_debug4(NGX_LOG_DEBUG_CORE, server->log, 0,
+            "statshouse adaptive \"%V\", %.0f events, weight %.3f, lag %M",
+            &conf->name, conf->adaptive_events, conf->adaptive_weight, lag);
+
+        if (conf->adaptive_events == 0) {
+            ngx_queue_remove(queue);
+            ngx_memzero(queue, sizeof(ngx_queue_t));
+        }
+
+        conf->adaptive_events = 0;
+    }
+
+    if (ngx_queue_empty(&server->adaptives) || ngx_exiting || ngx_terminate) {
+        return;
+    }
+
+    server->adaptive_expire = ngx_current_msec + NGX_STATSHOUSE_ADAPTIVE_INTERVAL;
+    ngx_add_timer(&server->adaptive_event, NGX_STATSHOUSE_ADAPTIVE_INTERVAL);
+}
+
+
+/*
+ * Counts n produced stats. Stats passed adaptive sampling with probability
+ * 1 / adaptive_weight, so they are scaled back to the unsampled rate.
+ */
+
+static void
+ngx_statshouse_adaptive_add(ngx_statshouse_server_t *server, ngx_statshouse_conf_t *conf,
+    ngx_uint_t n)
+{
+    if (!server->adaptive) {
+        return;
+    }
+
+    conf->adaptive_events += conf->adaptive_sample ? n * conf->adaptive_weight : n;
+
+    if (conf->adaptive.next != NULL) {
+        return;
+    }
+
+    ngx_queue_insert_tail(&server->adaptives, &conf->adaptive);
+
+    if (server->adaptive_event.timer_set) {
+        return;
+    }
+
+    server->adaptive_expire = ngx_current_msec + NGX_STATSHOUSE_ADAPTIVE_INTERVAL;
+    ngx_add_timer(&server->adaptive_event, NGX_STATSHOUSE_ADAPTIVE_INTERVAL);
+}
+
+
 ngx_int_t
 ngx_statshouse_flush(ngx_statshouse_server_t *server)
 {
@@ -313,355 +639,2280 @@ ngx_statshouse_send(ngx_statshouse_server_t *server, ngx_statshouse_stat_t *stat
 }
 
 
-static ngx_int_t
-ngx_statshouse_stat_is_group_delimiter(u_char *p, u_char *end, u_char **next_ptr)
+ngx_statshouse_handle_t *
+ngx_statshouse_handle_create(ngx_conf_t *cf, ngx_str_t *name, ngx_statshouse_stat_type_e type,
+    ngx_uint_t *keys, ngx_uint_t nkeys)
 {
-    if (p + 3 < end) {
-        return 0;
+    ngx_statshouse_handle_t  *handle;
+    ngx_uint_t                i;
+
+    if (type != ngx_statshouse_mt_counter && type != ngx_statshouse_mt_value
+        && type != ngx_statshouse_mt_unique)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid type of statshouse metric \"%V\"", name);
+        return NULL;
     }
 
-    if (p[0] != ' ' || p[1] != ':' || p[2] != ' ') {
-        return 0;
+    handle = ngx_pcalloc(cf->pool, sizeof(ngx_statshouse_handle_t));
+    if (handle == NULL) {
+        return NULL;
     }
 
-    if (*next_ptr) {
-        *next_ptr = p + 3;
+    for (i = 0; i < nkeys; i++) {
+        if (keys[i] >= NGX_STATSHOUSE_STAT_KEYS_MAX || (i > 0 && keys[i] <= keys[i - 1])) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "invalid key %ui of statshouse metric \"%V\", keys must be ascending", keys[i], name);
+            return NULL;
+        }
+
+        handle->keys_mask |= (uint64_t) 1 << keys[i];
     }
 
-    return 1;
-}
+    handle->name = *name;
+    handle->type = type;
+    handle->hash = ngx_statshouse_aggregate_seed(&handle->name, handle->keys_mask);
 
+    return handle;
+}
 
-static ngx_str_t *
-ngx_statshouse_stat_part(ngx_str_t *postfix, ngx_str_t *item, u_char **next_ptr)
-{
-    u_char  *p, *end;
 
-    end = postfix->data + postfix->len;
+/* keys are values of registered keys in index order, nothing is copied */
 
-    if (item->data == NULL) {
-        p = postfix->data;
+ngx_int_t
+ngx_statshouse_handle_send(ngx_statshouse_server_t *server, ngx_statshouse_handle_t *handle,
+    ngx_str_t *keys, double number)
+{
+    ngx_statshouse_stat_t        stat;
+    ngx_statshouse_stat_value_t  value;
+    ngx_int_t                    rc;
+
+    if (handle->type == ngx_statshouse_mt_counter) {
+        value.counter = number;
+    } else if (handle->type == ngx_statshouse_mt_value) {
+        value.value = number;
     } else {
-        p = *next_ptr;
+        value.unique = (int64_t) number;
     }
 
-    while (p < end) {
-        if (ngx_statshouse_stat_is_group_delimiter(p, end, &p)) {
-            continue;
-        }
+    ngx_statshouse_stat_init(&stat, handle->name, handle->type, keys);
+    stat.keys_mask = handle->keys_mask;
 
-        if (p[0] == ' ') {
-            ++p;
+    ngx_statshouse_stat_value(&stat, value);
 
-            continue;
+    if (server->aggregate) {
+        rc = ngx_statshouse_aggregate_seeded(server->aggregate, &stat, handle->hash, ngx_current_msec);
+        if (rc == NGX_ERROR || rc == NGX_OK) {
+            return rc;
         }
-
-        break;
-    }
-
-    if (p == end) {
-        return NULL;
     }
 
-    item->data = p;
-    item->len = 0;
-
-    while (p < end) {
-        if (p[0] == ',') {
-            break;
-        }
-
-        if (ngx_statshouse_stat_is_group_delimiter(p, end, NULL)) {
-            break;
-        }
+    return ngx_statshouse_send_to_buffer(server, &stat);
+}
 
-        ++p;
-    }
 
-    item->len = p - item->data;
+/*
+ * Sends stats compiled for one request as one metrics batch: stats taken
+ * by aggregation are removed from the array, the rest is encoded at once.
+ */
 
-    if (p < end && p[0] == ',') {
-        ++p;
-    }
+ngx_int_t
+ngx_statshouse_send_batch(ngx_statshouse_server_t *server, ngx_statshouse_stat_t **stats, ngx_int_t n)
+{
+    ngx_int_t  i, m, rc;
+    size_t     size;
 
-    if (item->len > 0 && item->data[item->len - 1] == ' ') {
-        --item->len;
-    }
+    m = 0;
 
-    while (p < end) {
-        if (ngx_statshouse_stat_is_group_delimiter(p, end, &p)) {
-            continue;
-        }
+    for (i = 0; i < n; i++) {
+        if (server->aggregate) {
+            rc = ngx_statshouse_aggregate(server->aggregate, stats[i], ngx_current_msec);
 
-        if (p[0] == ' ') {
-            ++p;
+            if (rc == NGX_ERROR) {
+                return NGX_ERROR;
+            }
 
-            continue;
+            if (rc == NGX_OK) {
+                continue;
+            }
         }
 
-        break;
+        stats[m++] = stats[i];
     }
 
-    if (item->len == 0 && p == end) {
-        return NULL;
+    if (m == 0) {
+        return NGX_OK;
     }
 
-    if (item->len == 1 && item->data[0] == '-') {
-        item->len = 0;
-    }
+    size = ngx_statshouse_tl_metrics_list_len(stats, m);
 
-    *next_ptr = p;
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, server->log, 0,
+        "statshouse build %i stats %z", m, size);
 
-    return item;
-}
+    if (ngx_statshouse_server_buffer_left(server) < size) {
+        ngx_statshouse_flush(server);
 
+        if (ngx_statshouse_server_buffer_left(server) < size) {
 
-static ngx_int_t
-ngx_statshouse_is_empty(ngx_str_t *str)
-{
-    if (str->len == 0 || (str->len == 1 && (str->data[0] == '-' || str->data[0] == '0'))) {
-        return 1;
+            /* batch does not fit in one packet, send stats one by one */
+
+            for (i = 0; i < m; i++) {
+                rc = ngx_statshouse_send_to_buffer(server, stats[i]);
+                if (rc == NGX_ERROR) {
+                    return NGX_ERROR;
+                }
+            }
+
+            return NGX_OK;
+        }
     }
 
-    return 0;
-}
+    ngx_statshouse_tl_metrics_list(server->buffer, stats, m);
+    ngx_statshouse_timer(server);
 
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, server->log, 0,
+        "statshouse append %z bytes, left %z",
+        size, ngx_statshouse_server_buffer_left(server));
 
-static ngx_int_t
-ngx_statshouse_test_required_predicates(ngx_array_t *predicates,
-    ngx_statshouse_complex_value_pt complex, void *complex_ctx)
-{
-    ngx_str_t                  val;
-    ngx_uint_t                 i;
-    u_char                    *cv;
+    return NGX_OK;
+}
 
-    if (predicates == NULL) {
-        return NGX_OK;
-    }
 
-    cv = predicates->elts;
+static u_char *
+ngx_statshouse_stat_group(u_char *p, u_char *end)
+{
+    u_char  *c;
 
-    for (i = 0; i < predicates->nelts; i++) {
-        if (complex(complex_ctx, &cv[i * predicates->size], &val) != NGX_OK) {
-            return NGX_ERROR;
+    while (p < end) {
+        c = memchr(p, ':', end - p);
+        if (c == NULL) {
+            break;
         }
 
-        if (val.len == 0 || (val.len == 1 && val.data[0] == '0')) {
-            return NGX_DECLINED;
+        if (c > p && c + 1 < end && c[-1] == ' ' && c[1] == ' ') {
+            return c;
         }
+
+        p = c + 1;
     }
 
-    return NGX_OK;
+    return end;
 }
 
 
-ngx_int_t
-ngx_statshouse_stat_compile(ngx_statshouse_conf_t *conf, ngx_statshouse_stat_t *stats, ngx_int_t max,
-    ngx_statshouse_complex_value_pt complex, void *complex_ctx, ngx_log_t *log)
+/*
+ * splits "a, b : c" lists of upstream variables into trimmed parts,
+ * "-" parts are empty and trailing empty parts are dropped; only " : "
+ * separates groups, so that "127.0.0.1:80" stays whole
+ */
+
+static ngx_int_t
+ngx_statshouse_stat_parts(ngx_str_t *str, ngx_str_t *parts, ngx_int_t max)
 {
-    ngx_statshouse_stat_t      *stat;
-    ngx_str_t                   keys[NGX_STATSHOUSE_STAT_KEYS_MAX];
-    ngx_int_t                   i, j, n, rc, previ, minus;
-    u_char                     *next;
-    time_t                      now;
+    u_char     *p, *end, *comma, *group, *last, *start;
+    ngx_int_t   n, used;
 
-    ngx_str_t  s, split;
-    ngx_int_t  splits;
+    p = str->data;
+    end = p + str->len;
 
-    if (conf->disable) {
-        return NGX_DECLINED;
-    }
+    comma = NULL;
+    group = NULL;
 
-    if (conf->timeout) {
-        now = ngx_time();
+    used = 0;
 
-        if (conf->last != 0 && conf->last + conf->timeout > now) {
-            return NGX_DECLINED;
-        }
+    for (n = 0; n < max; n++) {
 
-        conf->last = now;
-    }
+        /* separators found earlier are reused until passed */
 
-    rc = ngx_statshouse_test_required_predicates(conf->condition.complex, complex, complex_ctx);
-    if (rc != NGX_OK) {
-        return rc;
-    }
+        if (comma == NULL || comma < p) {
+            comma = memchr(p, ',', end - p);
+            if (comma == NULL) {
+                comma = end;
+            }
+        }
 
-    if (complex(complex_ctx, conf->value.complex, &s) != NGX_OK) {
-        return NGX_ERROR;
-    }
+        if (group == NULL || group < p) {
+            group = ngx_statshouse_stat_group(p, end);
+        }
 
-    for (i = 0; i < NGX_STATSHOUSE_STAT_KEYS_MAX; i++) {
-        ngx_str_null(&keys[i]);
+        last = ngx_min(comma, group);
 
-        if (conf->keys[i].disable) {
-            continue;
-        }
+        start = p;
 
-        if (conf->keys[i].name.len == 0) {
-            continue;
+        while (start < last && *start == ' ') {
+            start++;
         }
 
-        if (complex(complex_ctx, conf->keys[i].complex, &keys[i]) != NGX_OK) {
-            return NGX_ERROR;
+        parts[n].data = start;
+        parts[n].len = last - start;
+
+        while (parts[n].len && start[parts[n].len - 1] == ' ') {
+            parts[n].len--;
         }
-    }
 
-    splits = 0;
-    ngx_str_null(&split);
+        if (parts[n].len) {
+            used = n + 1;
 
-    do {
-        if (conf->value.split) {
-            if (ngx_statshouse_stat_part(&s, &split, &next) == NULL) {
-                break;
+            if (parts[n].len == 1 && start[0] == '-') {
+                parts[n].len = 0;
             }
-        } else {
-            if (s.len == 0) {
+        }
+
+        if (last == end) {
+            break;
+        }
+
+        p = last + 1;
+    }
+
+    return used;
+}
+
+
+static ngx_int_t
+ngx_statshouse_is_empty(ngx_str_t *str)
+{
+    if (str->len == 0 || (str->len == 1 && (str->data[0] == '-' || str->data[0] == '0'))) {
+        return 1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Number with optional suffix: "ms" or "s" for seconds, "k", "m" or "g"
+ * for sizes, as in nginx.
+ */
+
+ngx_int_t
+ngx_statshouse_parse_number(u_char *data, size_t len, double *number)
+{
+    ngx_int_t  n, minus;
+    double     scale;
+
+    scale = 1;
+
+    if (len > 2 && data[len - 2] == 'm' && data[len - 1] == 's') {
+        scale = 0.001;
+        len -= 2;
+
+    } else if (len > 1) {
+        switch (data[len - 1]) {
+        case 's':
+            break;
+        case 'k':
+        case 'K':
+            scale = 1024;
+            break;
+        case 'm':
+        case 'M':
+            scale = 1024 * 1024;
+            break;
+        case 'g':
+        case 'G':
+            scale = 1024 * 1024 * 1024;
+            break;
+        default:
+            len++;
+        }
+
+        len--;
+    }
+
+    minus = 0;
+
+    if (len > 0 && data[0] == '-') {
+        minus = 1;
+    }
+
+    n = ngx_atofp(data + minus, len - minus, 6);
+    if (n == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    *number = (double) n / 1000000.0 * scale;
+
+    if (minus) {
+        *number = -*number;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_str_t  ngx_statshouse_status_classes[] = {
+    ngx_string("1xx"),
+    ngx_string("2xx"),
+    ngx_string("3xx"),
+    ngx_string("4xx"),
+    ngx_string("5xx"),
+};
+
+
+/* NGX_ERROR if there is no memory for lowercased value even in the pool */
+
+static ngx_int_t
+ngx_statshouse_conf_key_transform(ngx_statshouse_conf_transform_t *transform, ngx_str_t *value,
+    ngx_statshouse_scratch_t *scratch)
+{
+    u_char      *p;
+    ngx_uint_t   i, n;
+    double       number;
+
+    if (transform->status_class) {
+        if (value->len == 3 && value->data[0] >= '1' && value->data[0] <= '5') {
+            *value = ngx_statshouse_status_classes[value->data[0] - '1'];
+        }
+
+        return NGX_OK;
+    }
+
+    if (transform->buckets) {
+        if (ngx_statshouse_parse_number(value->data, value->len, &number) != NGX_OK) {
+            return NGX_OK;
+        }
+
+        for (i = 0; i < transform->nbuckets; i++) {
+            if (number <= transform->buckets[i]) {
+                break;
+            }
+        }
+
+        /* the last name is for values above all buckets */
+
+        *value = transform->bucket_names[i];
+
+        return NGX_OK;
+    }
+
+    if (transform->prefix) {
+        for (i = 0, n = 0; i < value->len; i++) {
+            if (value->data[i] == '?') {
+                break;
+            }
+
+            if (value->data[i] == '/' && i > 0 && ++n == transform->prefix) {
+                break;
+            }
+        }
+
+        value->len = i;
+    }
+
+    if (transform->lower) {
+        for (i = 0; i < value->len; i++) {
+            if (value->data[i] >= 'A' && value->data[i] <= 'Z') {
+                break;
+            }
+        }
+
+        if (i == value->len) {
+            return NGX_OK;
+        }
+
+        p = ngx_statshouse_scratch_palloc(scratch, value->len);
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_strlow(p, value->data, value->len);
+        value->data = p;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_statshouse_conf_key_value(ngx_statshouse_conf_key_t *key, ngx_str_t *value,
+    ngx_statshouse_scratch_t *scratch)
+{
+    ngx_str_t   *enums;
+    ngx_uint_t   i;
+
+    if (ngx_statshouse_is_empty(value)) {
+        return NGX_OK;
+    }
+
+    if (key->transform
+        && ngx_statshouse_conf_key_transform(key->transform, value, scratch) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (key->enums && key->other.len) {
+        enums = key->enums->elts;
+
+        for (i = 0; i < key->enums->nelts; i++) {
+            if (enums[i].len == value->len && ngx_memcmp(enums[i].data, value->data, value->len) == 0) {
                 break;
             }
+        }
+
+        if (i == key->enums->nelts) {
+            *value = key->other;
+        }
+    }
+
+    if (key->transform && key->transform->maxlen && value->len > key->transform->maxlen) {
+        value->len = key->transform->maxlen;
+
+        /* do not cut utf-8 sequence */
+
+        while (value->len && (value->data[value->len] & 0xc0) == 0x80) {
+            value->len--;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_statshouse_stat_value_parse(ngx_statshouse_stat_type_e type, ngx_str_t *s,
+    ngx_statshouse_stat_value_t *value, ngx_log_t *log)
+{
+    ngx_int_t  n, minus;
+
+    switch (type) {
+        case ngx_statshouse_mt_counter:
+            n = ngx_atoi(s->data, s->len);
+            if (n == NGX_ERROR) {
+                ngx_log_debug1(NGX_LOG_DEBUG_CORE, log, 0,
+                    "statshouse error parse counter: <%V>", s);
+                return NGX_ERROR;
+            }
+
+            value->counter = n;
+            break;
+
+        case ngx_statshouse_mt_value:
+            minus = 0;
+
+            if (s->len > 0 && s->data[0] == '-') {
+                minus = 1;
+            }
+
+            n = ngx_atofp(s->data + minus, s->len - minus, 8);
+            if (n == NGX_ERROR) {
+                ngx_log_debug1(NGX_LOG_DEBUG_CORE, log, 0,
+                    "statshouse error parse value: <%V>", s);
+                return NGX_ERROR;
+            }
+
+            value->value = ((double) n) / 100000000.0;
+
+            if (minus) {
+                value->value = -value->value;
+            }
+
+            break;
+
+        case ngx_statshouse_mt_unique:
+            n = ngx_atoi(s->data, s->len);
+            if (n == NGX_ERROR) {
+                ngx_log_debug1(NGX_LOG_DEBUG_CORE, log, 0,
+                    "statshouse error parse unique: <%V>", s);
+                return NGX_ERROR;
+            }
+
+            value->unique = n;
+            break;
+
+        default:
+            return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_statshouse_expr_value(ngx_statshouse_conf_t *conf, ngx_uint_t index, void *val,
+    ngx_statshouse_complex_value_pt complex, void *complex_ctx, ngx_str_t *value)
+{
+    ngx_statshouse_expr_t  *expr;
+
+    if (conf->exprs == NULL) {
+        return complex(complex_ctx, val, value);
+    }
+
+    expr = conf->exprs->exprs.elts;
+    expr += index;
+
+    if (expr->generation != conf->exprs->generation) {
+        if (complex(complex_ctx, expr->complex, &expr->value) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        expr->generation = conf->exprs->generation;
+    }
+
+    *value = expr->value;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_statshouse_stat_compile_dense(ngx_statshouse_server_t *server, ngx_statshouse_conf_t *conf,
+    ngx_statshouse_complex_value_pt complex, void *complex_ctx, double weight, ngx_log_t *log)
+{
+    ngx_statshouse_dense_t     *dense = conf->dense;
+    ngx_statshouse_conf_key_t  *key;
+    ngx_str_t                   s;
+    ngx_int_t                   n, cell, offset;
+    ngx_uint_t                  i;
+
+    if (ngx_terminate || ngx_exiting) {
+        return NGX_AGAIN;
+    }
+
+    if (conf->value.constant) {
+        n = conf->value.number.counter;
+
+    } else {
+        if (ngx_statshouse_expr_value(conf, conf->value.expr, conf->value.complex,
+                complex, complex_ctx, &s) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        if (s.len == 0) {
+            return NGX_DECLINED;
+        }
+
+        n = ngx_atoi(s.data, s.len);
+        if (n == NGX_ERROR) {
+            ngx_log_debug1(NGX_LOG_DEBUG_CORE, log, 0,
+                "statshouse error parse counter: <%V>", &s);
+            return NGX_ERROR;
+        }
+    }
+
+    cell = 0;
+
+    for (i = 0; i < dense->nkeys; i++) {
+        key = &conf->keys[i];
+
+        if (key->constant) {
+            s = key->string;
+
+        } else {
+            if (ngx_statshouse_expr_value(conf, key->expr, key->complex,
+                    complex, complex_ctx, &s) != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            if (key->transform
+                && ngx_statshouse_conf_key_transform(key->transform, &s, conf->scratch) != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+        }
+
+        offset = ngx_statshouse_dense_key(&dense->keys[i], &s);
+        if (offset == NGX_DECLINED) {
+            return NGX_AGAIN;
+        }
+
+        cell += offset;
+    }
+
+    dense->cells[cell] += n * weight;
+
+    ngx_statshouse_window_add(server, conf);
+
+    return NGX_DONE;
+}
+
+
+ngx_int_t
+ngx_statshouse_stat_compile(ngx_statshouse_server_t *server, ngx_statshouse_conf_t *conf,
+    ngx_statshouse_complex_value_pt complex, void *complex_ctx, ngx_log_t *log)
+{
+    ngx_statshouse_stat_t      *stat, **stats;
+    ngx_str_t                   keys[NGX_STATSHOUSE_STAT_KEYS_MAX];
+    ngx_statshouse_stat_value_t value, *direct;
+    ngx_statshouse_conf_key_t  *key;
+    ngx_int_t                   i, j, n, rc, max;
+    ngx_uint_t                  k, prevk;
+    time_t                      now;
+
+    ngx_str_t   s, *parts;
+    ngx_int_t   splits;
+    ngx_uint_t  limited;
+    uint32_t    hash;
+    double      weight;
+
+    if (conf->disable) {
+        return NGX_DECLINED;
+    }
+
+    stats = server->splits;
+    parts = server->splits_parts;
+    max = server->splits_max;
+
+    if (conf->timeout) {
+        now = ngx_time();
+
+        if (conf->last != 0 && conf->last + conf->timeout > now) {
+            return NGX_DECLINED;
+        }
+
+        conf->last = now;
+    }
+
+    weight = conf->sample ? conf->sample_weight : 1;
+
+    if (conf->sample && !conf->sample_keys && ngx_statshouse_random() >= conf->sample) {
+        return NGX_DECLINED;
+    }
+
+    if (conf->adaptive_sample) {
+        if (ngx_statshouse_random() >= conf->adaptive_sample) {
+            return NGX_DECLINED;
+        }
+
+        weight *= conf->adaptive_weight;
+    }
+
+    if (conf->condition.predicate) {
+        rc = ngx_statshouse_predicate_test(conf->condition.predicate, complex, complex_ctx);
+        if (rc != NGX_OK) {
+            return rc;
+        }
+    }
+
+    if (conf->dense) {
+        rc = ngx_statshouse_stat_compile_dense(server, conf, complex, complex_ctx, weight, log);
+        if (rc != NGX_AGAIN) {
+            if (rc == NGX_DONE) {
+                ngx_statshouse_adaptive_add(server, conf, 1);
+            }
+
+            return rc;
+        }
+    }
+
+    rc = ngx_statshouse_stat_compile_value(conf, &conf->value, complex, complex_ctx, &s, &value, log);
+    if (rc == NGX_ERROR || rc == NGX_DECLINED) {
+        return rc;
+    }
+
+    direct = (rc == NGX_OK) ? &value : NULL;
+
+    for (k = 0; k < conf->nactive; k++) {
+        key = &conf->keys[k];
+
+        if (key->constant) {
+            keys[k] = key->string;
+            continue;
+        }
+
+        if (ngx_statshouse_expr_value(conf, key->expr, key->complex,
+                complex, complex_ctx, &keys[k]) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        /* parts of split keys are transformed one by one */
+
+        if (!key->split && ngx_statshouse_conf_key_value(key, &keys[k], conf->scratch) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (conf->value.split) {
+        n = ngx_statshouse_stat_parts(&s, parts, max);
+
+    } else {
+        parts[0] = s;
+        n = s.len ? 1 : 0;
+    }
+
+    for (splits = 0; splits < n; splits++) {
+        stat = ngx_statshouse_server_split(server, splits);
+        stats[splits] = stat;
+
+        ngx_statshouse_stat_init(stat, conf->name, conf->value.type,
+            &server->splits_keys[splits * NGX_STATSHOUSE_STAT_KEYS_MAX]);
+
+        if (direct) {
+            ngx_statshouse_stat_value(stat, *direct);
+
+        } else if (parts[splits].len > 0) {
+            if (ngx_statshouse_stat_value_parse(conf->value.type, &parts[splits], &value, log)
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            ngx_statshouse_stat_value(stat, value);
+
+        } else {
+            ngx_statshouse_stat_value_zero(stat);
+        }
+    }
+
+    if (splits == 0) {
+        ngx_log_debug1(NGX_LOG_DEBUG_CORE, log, 0,
+            "statshouse empty splits: <%V>", &s);
+
+        return NGX_DECLINED;
+    }
+
+    for (k = 0; k < conf->nactive; k++) {
+        if (ngx_statshouse_is_empty(&keys[k])) {
+            continue;
+        }
+
+        key = &conf->keys[k];
+        i = key->index;
+
+        if (key->split) {
+            n = ngx_statshouse_stat_parts(&keys[k], parts, max);
+
+            for (j = 0; j < n; j++) {
+                if (j >= splits) {
+                    // init new splits
+
+                    stat = ngx_statshouse_server_split(server, j);
+                    stats[j] = stat;
+
+                    ngx_statshouse_stat_init(stat, conf->name, conf->value.type,
+                        &server->splits_keys[j * NGX_STATSHOUSE_STAT_KEYS_MAX]);
+
+                    if (conf->value.split) {
+                        ngx_statshouse_stat_value_zero(stat);
+                    } else {
+                        ngx_statshouse_stat_value(stat, stats[0]->values[0]);
+                    }
+
+                    for (prevk = 0; prevk < k; prevk++) {
+                        if (conf->keys[prevk].split) {
+                            continue;
+                        }
+
+                        if (ngx_statshouse_is_empty(&keys[prevk])) {
+                            continue;
+                        }
+
+                        ngx_statshouse_stat_key(stat, conf->keys[prevk].index, keys[prevk]);
+                    }
+                }
+
+                if (ngx_statshouse_conf_key_value(key, &parts[j], conf->scratch) != NGX_OK) {
+                    return NGX_ERROR;
+                }
+
+                ngx_statshouse_stat_key(stats[j], i, parts[j]);
+            }
+
+            if (n > splits) {
+                splits = n;
+            }
+        } else {
+            for (j = 0; j < splits; j++) {
+                ngx_statshouse_stat_key(stats[j], i, keys[k]);
+            }
+        }
+    }
+
+    if (splits > 1) {
+        splits = ngx_statshouse_stat_collapse(stats, splits);
+    }
+
+    if (conf->card || conf->limiter || weight != 1) {
+        n = 0;
+
+        for (j = 0; j < splits; j++) {
+            stat = stats[j];
+            hash = ngx_statshouse_stat_hash(stat);
+
+            if (conf->sample_keys && hash >= conf->sample) {
+                continue;
+            }
+
+            if (conf->card && ngx_statshouse_cardinality_add(conf->card, hash) != NGX_OK) {
+                for (i = 0; i < (ngx_int_t) ngx_statshouse_stat_keys_count(stat); i++) {
+                    stat->keys[i] = conf->overflow;
+                }
+
+                hash = ngx_statshouse_stat_hash(stat);
+            }
+
+            if (conf->limiter) {
+                if (ngx_statshouse_rate(conf->limiter, hash, ngx_current_msec, &limited) != NGX_OK) {
+                    continue;
+                }
+
+                if (limited > 1) {
+                    ngx_statshouse_stat_weight(stat, limited);
+                }
+            }
+
+            if (weight != 1) {
+                ngx_statshouse_stat_weight(stat, weight);
+            }
+
+            stats[n++] = stat;
+        }
+
+        if (conf->card || conf->limiter) {
+            ngx_statshouse_window_add(server, conf);
+        }
+
+        if (n == 0) {
+            ngx_log_debug1(NGX_LOG_DEBUG_CORE, log, 0,
+                "statshouse sampled or rate limited: <%V>", &conf->name);
+
+            return NGX_DECLINED;
+        }
+
+        splits = n;
+    }
+
+    if (conf->members) {
+        n = ngx_statshouse_stat_compile_members(server, conf, splits, complex, complex_ctx, log);
+
+        if (n > 0) {
+            ngx_statshouse_adaptive_add(server, conf, n);
+        }
+
+        return n;
+    }
+
+    ngx_statshouse_adaptive_add(server, conf, splits);
+
+    if (conf->topk) {
+        n = 0;
+
+        for (j = 0; j < splits; j++) {
+            if (ngx_statshouse_topk_add(conf->topk, stats[j]) == NGX_OK) {
+                continue;
+            }
+
+            /* key values do not fit top entry, send as is */
+
+            stats[n++] = stats[j];
+        }
+
+        ngx_statshouse_window_add(server, conf);
+
+        if (n == 0) {
+            return NGX_DONE;
+        }
+
+        splits = n;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, log, 0,
+            "statshouse return %d splits: <%V>", splits, &s);
+
+    return splits;
+}
+
+
+/*
+ * NGX_OK if value is a number, NGX_AGAIN if the string in s is
+ * to be parsed, NGX_DECLINED if there is no value
+ */
+
+static ngx_int_t
+ngx_statshouse_stat_compile_value(ngx_statshouse_conf_t *conf, ngx_statshouse_conf_value_t *cv,
+    ngx_statshouse_complex_value_pt complex, void *complex_ctx, ngx_str_t *s,
+    ngx_statshouse_stat_value_t *value, ngx_log_t *log)
+{
+    ngx_int_t  rc;
+    double     number;
+
+    *s = cv->string;
+
+    if (cv->constant) {
+        *value = cv->number;
+        return NGX_OK;
+    }
+
+    if (cv->accessor) {
+        rc = cv->accessor(complex_ctx, &number);
+
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        if (rc == NGX_DECLINED) {
+            ngx_log_debug1(NGX_LOG_DEBUG_CORE, log, 0,
+                "statshouse empty value: <%V>", &cv->string);
+
+            return NGX_DECLINED;
+        }
+
+        if (rc == NGX_OK) {
+            if (cv->type == ngx_statshouse_mt_counter) {
+                value->counter = number;
+            } else if (cv->type == ngx_statshouse_mt_value) {
+                value->value = number;
+            } else {
+                value->unique = (int64_t) number;
+            }
+
+            return NGX_OK;
+        }
+    }
+
+    if (ngx_statshouse_expr_value(conf, cv->expr, cv->complex, complex, complex_ctx, s) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return NGX_AGAIN;
+}
+
+
+/*
+ * stats of a metric group count events of key tuples, each tuple is
+ * sent as a stat of every metric of the group sharing its keys
+ */
+
+static ngx_int_t
+ngx_statshouse_stat_compile_members(ngx_statshouse_server_t *server, ngx_statshouse_conf_t *conf,
+    ngx_int_t splits, ngx_statshouse_complex_value_pt complex, void *complex_ctx, ngx_log_t *log)
+{
+    ngx_statshouse_conf_member_t   *members, **used;
+    ngx_statshouse_stat_value_t    *values;
+    ngx_statshouse_stat_t          *tuple, *stat, **stats;
+    ngx_str_t                       s;
+    ngx_uint_t                      i;
+    ngx_int_t                       j, m, n, rc;
+    u_char                         *p;
+    double                          weight;
+
+    members = conf->members->elts;
+
+    values = (ngx_statshouse_stat_value_t *) ngx_statshouse_scratch_palloc(conf->scratch,
+        sizeof(ngx_statshouse_stat_value_t) * conf->members->nelts);
+    used = (ngx_statshouse_conf_member_t **) ngx_statshouse_scratch_palloc(conf->scratch,
+        sizeof(ngx_statshouse_conf_member_t *) * conf->members->nelts);
+
+    if (values == NULL || used == NULL) {
+        return NGX_ERROR;
+    }
+
+    n = 0;
+
+    for (i = 0; i < conf->members->nelts && n < server->splits_max; i++) {
+        rc = ngx_statshouse_stat_compile_value(conf, &members[i].value, complex, complex_ctx,
+            &s, &values[n], log);
+
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        if (rc == NGX_DECLINED || s.len == 0) {
+            continue;
+        }
+
+        if (rc == NGX_AGAIN
+            && ngx_statshouse_stat_value_parse(members[i].value.type, &s, &values[n], log) != NGX_OK)
+        {
+            continue;
+        }
+
+        used[n++] = &members[i];
+    }
+
+    if (n == 0) {
+        ngx_log_debug1(NGX_LOG_DEBUG_CORE, log, 0,
+            "statshouse empty group: <%V>", &conf->name);
+
+        return NGX_DECLINED;
+    }
+
+    if (splits * n > server->splits_max) {
+        ngx_log_debug2(NGX_LOG_DEBUG_CORE, log, 0,
+            "statshouse group %d tuples truncated: <%V>", splits, &conf->name);
+
+        splits = server->splits_max / n;
+    }
+
+    p = ngx_statshouse_scratch_palloc(conf->scratch, sizeof(ngx_statshouse_stat_t) * splits * n);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    stats = server->splits;
+
+    /* stats of tuple j are placed at j * n and after, tuples before j stay intact */
+
+    for (j = splits - 1; j >= 0; j--) {
+        tuple = stats[j];
+        weight = tuple->values[0].counter;
+
+        for (m = 0; m < n; m++) {
+            stat = (ngx_statshouse_stat_t *) (p + sizeof(ngx_statshouse_stat_t) * (j * n + m));
+
+            ngx_statshouse_stat_init(stat, used[m]->name, used[m]->value.type, tuple->keys);
+            stat->keys_mask = tuple->keys_mask;
+
+            ngx_statshouse_stat_value(stat, values[m]);
+
+            if (weight != 1) {
+                ngx_statshouse_stat_weight(stat, weight);
+            }
+
+            stats[j * n + m] = stat;
+        }
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, log, 0,
+            "statshouse return %d group stats: <%V>", splits * n, &conf->name);
+
+    return splits * n;
+}
+
+
+/*
+ * Splits with equal keys, e.g. value split with keys not split, are sent
+ * as one stat: values are appended, counters are summed.  Splits are few,
+ * so tuples are compared pairwise.
+ */
+
+static ngx_int_t
+ngx_statshouse_stat_collapse(ngx_statshouse_stat_t **stats, ngx_int_t n)
+{
+    ngx_statshouse_stat_t  *stat, *to;
+    ngx_int_t               i, j, m;
+    ngx_uint_t              k, nkeys;
+
+    m = 0;
+
+    for (j = 0; j < n; j++) {
+        stat = stats[j];
+        nkeys = ngx_statshouse_stat_keys_count(stat);
+
+        for (i = 0; i < m; i++) {
+            to = stats[i];
+
+            if (to->keys_mask != stat->keys_mask) {
+                continue;
+            }
+
+            for (k = 0; k < nkeys; k++) {
+                if (to->keys[k].len != stat->keys[k].len) {
+                    break;
+                }
+
+                if (to->keys[k].data != stat->keys[k].data
+                    && ngx_memcmp(to->keys[k].data, stat->keys[k].data, stat->keys[k].len) != 0)
+                {
+                    break;
+                }
+            }
+
+            if (k == nkeys) {
+                break;
+            }
+        }
+
+        if (i == m) {
+            stats[m++] = stat;
+            continue;
+        }
+
+        if (stat->type == ngx_statshouse_mt_counter) {
+            to->values[0].counter += stat->values[0].counter;
+            continue;
+        }
+
+        if (to->count || stat->count) {
+            to->count = ngx_statshouse_stat_count(to) + ngx_statshouse_stat_count(stat);
+        }
+
+        ngx_memcpy(&to->values[to->values_count], stat->values,
+            sizeof(ngx_statshouse_stat_value_t) * stat->values_count);
+
+        to->values_count += stat->values_count;
+    }
+
+    return m;
+}
+
+
+static uint32_t
+ngx_statshouse_stat_hash(ngx_statshouse_stat_t *stat)
+{
+    ngx_uint_t  i, n;
+    uint32_t    hash;
+
+    ngx_crc32_init(hash);
+    ngx_crc32_update(&hash, (u_char *) &stat->keys_mask, sizeof(uint64_t));
+
+    n = ngx_statshouse_stat_keys_count(stat);
+
+    for (i = 0; i < n; i++) {
+        ngx_crc32_update(&hash, stat->keys[i].data, stat->keys[i].len);
+        ngx_crc32_update(&hash, (u_char *) "", 1);
+    }
+
+    ngx_crc32_final(hash);
+
+    /* crc32 bits are not uniform enough for hyperloglog */
+
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+
+    return hash;
+}
+
+
+/*
+ * xorshift64*, seeded in worker on first call
+ */
+
+static uint32_t
+ngx_statshouse_random(void)
+{
+    uint64_t  x;
+
+    x = ngx_statshouse_random_state;
+
+    if (x == 0) {
+        x = ((uint64_t) ngx_random() << 32) ^ (uint64_t) ngx_random() ^ (uint64_t) ngx_pid;
+        x |= 1;
+    }
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+
+    ngx_statshouse_random_state = x;
+
+    return (uint32_t) ((x * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
+
+static ngx_int_t
+ngx_statshouse_aggregate_handler(ngx_statshouse_stat_t *stat, void *ctx)
+{
+    ngx_statshouse_server_t  *server = ctx;
+
+    if (stat == NULL) {
+        return ngx_statshouse_flush(server);
+    }
+
+    return ngx_statshouse_send_to_buffer(server, stat);
+}
+
+
+ngx_statshouse_exprs_t *
+ngx_statshouse_exprs_create(ngx_pool_t *pool)
+{
+    ngx_statshouse_exprs_t  *exprs;
+
+    exprs = ngx_pcalloc(pool, sizeof(ngx_statshouse_exprs_t));
+    if (exprs == NULL) {
+        return NULL;
+    }
+
+    if (ngx_array_init(&exprs->exprs, pool, 16, sizeof(ngx_statshouse_expr_t)) != NGX_OK) {
+        return NULL;
+    }
+
+    exprs->buckets = ngx_pcalloc(pool, NGX_STATSHOUSE_EXPRS_BUCKETS * sizeof(ngx_uint_t));
+    if (exprs->buckets == NULL) {
+        return NULL;
+    }
+
+    /* entries are evaluated when generation differs */
+
+    exprs->generation = 1;
+
+    return exprs;
+}
+
+
+/*
+ * Identical expression strings compile to the same complex value,
+ * so the first compiled one is shared by all metrics.
+ */
+
+ngx_int_t
+ngx_statshouse_exprs_find(ngx_statshouse_exprs_t *exprs, ngx_str_t *string)
+{
+    ngx_statshouse_expr_t  *expr;
+    ngx_uint_t              i, hash;
+
+    expr = exprs->exprs.elts;
+    hash = ngx_hash_key(string->data, string->len);
+
+    /* bucket heads and links are index + 1, 0 ends a chain */
+
+    for (i = exprs->buckets[hash % NGX_STATSHOUSE_EXPRS_BUCKETS]; i; i = expr[i - 1].next) {
+        if (expr[i - 1].hash == hash
+            && expr[i - 1].string.len == string->len
+            && ngx_strncmp(expr[i - 1].string.data, string->data, string->len) == 0)
+        {
+            return i - 1;
+        }
+    }
+
+    return NGX_DECLINED;
+}
+
+
+ngx_int_t
+ngx_statshouse_exprs_add(ngx_statshouse_exprs_t *exprs, ngx_str_t *string, void *complex)
+{
+    ngx_statshouse_expr_t  *expr;
+    ngx_uint_t             *bucket;
+    ngx_int_t               n;
+
+    n = ngx_statshouse_exprs_find(exprs, string);
+    if (n != NGX_DECLINED) {
+        return n;
+    }
+
+    expr = ngx_array_push(&exprs->exprs);
+    if (expr == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(expr, sizeof(ngx_statshouse_expr_t));
+
+    expr->string = *string;
+    expr->complex = complex;
+    expr->hash = ngx_hash_key(string->data, string->len);
+
+    bucket = &exprs->buckets[expr->hash % NGX_STATSHOUSE_EXPRS_BUCKETS];
+
+    expr->next = *bucket;
+    *bucket = exprs->exprs.nelts;
+
+    return exprs->exprs.nelts - 1;
+}
+
+
+ngx_int_t
+ngx_statshouse_scratch_init(ngx_statshouse_scratch_t *scratch, size_t size, ngx_pool_t *pool)
+{
+    size = ngx_align(size, NGX_ALIGNMENT);
+
+    scratch->start = ngx_palloc(pool, size);
+    if (scratch->start == NULL) {
+        return NGX_ERROR;
+    }
+
+    scratch->pos = scratch->start;
+    scratch->end = scratch->start + size;
+    scratch->pool = NULL;
+
+    return NGX_OK;
+}
+
+
+/*
+ * NULL if the arena is exhausted, the caller allocates elsewhere;
+ * memory is aligned, so that stats may be placed there too
+ */
+
+u_char *
+ngx_statshouse_scratch_alloc(ngx_statshouse_scratch_t *scratch, size_t size)
+{
+    u_char  *p;
+
+    size = ngx_align(size, NGX_ALIGNMENT);
+
+    if ((size_t) (scratch->end - scratch->pos) < size) {
+        return NULL;
+    }
+
+    p = scratch->pos;
+    scratch->pos += size;
+
+    return p;
+}
+
+
+/* falls back to the pool of the current send, NULL if there is none */
+
+u_char *
+ngx_statshouse_scratch_palloc(ngx_statshouse_scratch_t *scratch, size_t size)
+{
+    u_char  *p;
+
+    p = ngx_statshouse_scratch_alloc(scratch, size);
+
+    if (p == NULL && scratch->pool != NULL) {
+        p = ngx_palloc(scratch->pool, size);
+    }
+
+    return p;
+}
+
+
+ngx_int_t
+ngx_statshouse_phases_add(ngx_array_t **phases, ngx_statshouse_conf_t *conf, ngx_pool_t *pool)
+{
+    ngx_statshouse_phase_t   *phase;
+    ngx_statshouse_conf_t   **confp;
+
+    if (*phases == NULL) {
+        *phases = ngx_array_create(pool, 1, sizeof(ngx_statshouse_phase_t));
+        if (*phases == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    phase = ngx_statshouse_phases_find(*phases, &conf->phase);
+
+    if (phase == NULL) {
+        phase = ngx_array_push(*phases);
+        if (phase == NULL) {
+            return NGX_ERROR;
+        }
+
+        phase->name = conf->phase;
+
+        if (ngx_array_init(&phase->confs, pool, 4, sizeof(ngx_statshouse_conf_t *)) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    confp = ngx_array_push(&phase->confs);
+    if (confp == NULL) {
+        return NGX_ERROR;
+    }
+
+    *confp = conf;
+
+    return NGX_OK;
+}
+
+
+ngx_statshouse_phase_t *
+ngx_statshouse_phases_find(ngx_array_t *phases, ngx_str_t *name)
+{
+    ngx_statshouse_phase_t  *phase;
+    ngx_uint_t               i, len;
+
+    len = name ? name->len : 0;
+
+    phase = phases->elts;
+
+    for (i = 0; i < phases->nelts; i++) {
+        if (phase[i].name.len == len
+            && (len == 0 || ngx_strncmp(phase[i].name.data, name->data, len) == 0))
+        {
+            return &phase[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+char *
+ngx_statshouse_conf_cardinality_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_statshouse_conf_t  *shc = conf;
+
+    ngx_str_t   *value;
+    ngx_int_t    n;
+    ngx_uint_t   i;
+
+    if (shc->cardinality) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    n = ngx_atoi(value[1].data, value[1].len);
+    if (n == NGX_ERROR || n == 0 || n > NGX_STATSHOUSE_CARDINALITY_MAX) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid cardinality \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    shc->cardinality = n;
+    ngx_str_set(&shc->overflow, "overflow");
+
+    for (i = 2; i < cf->args->nelts; i++) {
+        if (value[i].len > 9 && ngx_strncmp(value[i].data, "overflow=", 9) == 0) {
+            shc->overflow.data = value[i].data + 9;
+            shc->overflow.len = value[i].len - 9;
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid property \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+/* "metric name count|value|unique expression" in statshouse_metric_group */
+
+char *
+ngx_statshouse_conf_member_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_statshouse_conf_t  *shc = conf;
+
+    ngx_statshouse_conf_member_t  *member;
+    ngx_statshouse_stat_type_e     type;
+    ngx_str_t                     *value;
+
+    if (shc->members == NULL) {
+        return "is allowed only in statshouse_metric_group";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[2].data, "count") == 0) {
+        type = ngx_statshouse_mt_counter;
+
+    } else if (ngx_strcmp(value[2].data, "value") == 0) {
+        type = ngx_statshouse_mt_value;
+
+    } else if (ngx_strcmp(value[2].data, "unique") == 0) {
+        type = ngx_statshouse_mt_unique;
+
+    } else {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid metric type \"%V\"", &value[2]);
+        return NGX_CONF_ERROR;
+    }
+
+    member = ngx_array_push(shc->members);
+    if (member == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memzero(member, sizeof(ngx_statshouse_conf_member_t));
+
+    member->name = value[1];
+    member->value.type = type;
+    member->value.string = value[3];
+
+    return NGX_CONF_OK;
+}
+
+
+/* arguments of each directive are grouped, so that "or" stays inside */
+
+char *
+ngx_statshouse_conf_condition_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_statshouse_conf_t  *shc = conf;
+
+    ngx_str_t   *value, *s;
+    ngx_uint_t   i;
+
+    if (shc->condition.strings == NGX_CONF_UNSET_PTR || shc->condition.strings == NULL) {
+        shc->condition.strings = ngx_array_create(cf->pool, cf->args->nelts + 1, sizeof(ngx_str_t));
+        if (shc->condition.strings == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    s = ngx_array_push_n(shc->condition.strings, cf->args->nelts + 1);
+    if (s == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    value = cf->args->elts;
+
+    ngx_str_set(&s[0], "(");
+
+    for (i = 1; i < cf->args->nelts; i++) {
+        s[i] = value[i];
+    }
+
+    ngx_str_set(&s[i], ")");
+
+    return NGX_CONF_OK;
+}
+
+
+char *
+ngx_statshouse_conf_sample_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_statshouse_conf_t  *shc = conf;
+
+    ngx_str_t   *value, s;
+    ngx_int_t    n;
+    ngx_uint_t   i;
+
+    if (shc->sample || shc->sample_weight) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    /* percent of events, up to 0.0001% */
+
+    s = value[1];
+
+    if (s.len > 1 && s.data[s.len - 1] == '%') {
+        s.len--;
+    }
+
+    n = ngx_atofp(s.data, s.len, 4);
+    if (n == NGX_ERROR || n > 1000000) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid sample \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    for (i = 2; i < cf->args->nelts; i++) {
+        if (value[i].len == 4 && ngx_strncmp(value[i].data, "keys", 4) == 0) {
+            shc->sample_keys = 1;
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid property \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    /* 0 and 100% are not sampled */
+
+    shc->sample_weight = 1;
+
+    if (n == 0 || n == 1000000) {
+        return NGX_CONF_OK;
+    }
+
+    shc->sample = (uint32_t) (((uint64_t) n << 32) / 1000000);
+    shc->sample_weight = 1000000.0 / n;
+
+    return NGX_CONF_OK;
+}
+
+
+char *
+ngx_statshouse_conf_rate_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_statshouse_conf_t  *shc = conf;
+
+    ngx_str_t   *value, s;
+    ngx_int_t    rate, scale, n;
+    ngx_uint_t   i;
+    u_char      *p;
+
+    if (shc->rate) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    /* 10r/s or 60r/m, as in limit_req */
+
+    s = value[1];
+    scale = 1;
+
+    if (s.len > 3 && ngx_strncmp(s.data + s.len - 3, "r/s", 3) == 0) {
+        s.len -= 3;
+
+    } else if (s.len > 3 && ngx_strncmp(s.data + s.len - 3, "r/m", 3) == 0) {
+        s.len -= 3;
+        scale = 60;
+
+    } else {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid rate \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    rate = ngx_atoi(s.data, s.len);
+    if (rate == NGX_ERROR || rate == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid rate \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    shc->rate = rate * 1000 / scale;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+        p = value[i].data;
+
+        if (value[i].len > 6 && ngx_strncmp(p, "burst=", 6) == 0) {
+            n = ngx_atoi(p + 6, value[i].len - 6);
+            if (n == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid burst \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            shc->rate_burst = n * 1000;
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid property \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+/*
+ * NGX_OK if value is exactly one variable, "$name" or "${name}",
+ * captures like "$1" are not variables
+ */
+
+ngx_int_t
+ngx_statshouse_conf_variable(ngx_str_t *value, ngx_str_t *name)
+{
+    u_char      ch;
+    ngx_uint_t  i;
+
+    if (value->len < 2 || value->data[0] != '$') {
+        return NGX_DECLINED;
+    }
+
+    name->data = value->data + 1;
+    name->len = value->len - 1;
+
+    if (name->data[0] == '{') {
+        if (name->len < 3 || name->data[name->len - 1] != '}') {
+            return NGX_DECLINED;
+        }
+
+        name->data++;
+        name->len -= 2;
+    }
+
+    if (name->data[0] >= '0' && name->data[0] <= '9') {
+        return NGX_DECLINED;
+    }
+
+    for (i = 0; i < name->len; i++) {
+        ch = name->data[i];
+
+        if ((ch >= 'A' && ch <= 'Z')
+            || (ch >= 'a' && ch <= 'z')
+            || (ch >= '0' && ch <= '9')
+            || ch == '_')
+        {
+            continue;
+        }
+
+        return NGX_DECLINED;
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_statshouse_conf_key_option(ngx_conf_t *cf, ngx_statshouse_conf_key_def_t *key, ngx_str_t *value)
+{
+    ngx_str_t  *s;
+    ngx_int_t   n;
+    u_char     *p, *last, *comma;
+
+    if (value->len > 5 && ngx_strncmp(value->data, "enum=", 5) == 0) {
+        if (key->enums == NULL) {
+            key->enums = ngx_array_create(cf->pool, 4, sizeof(ngx_str_t));
+            if (key->enums == NULL) {
+                return NGX_ERROR;
+            }
+        }
+
+        p = value->data + 5;
+        last = value->data + value->len;
+
+        while (p < last) {
+            comma = ngx_strlchr(p, last, ',');
+            if (comma == NULL) {
+                comma = last;
+            }
+
+            if (comma == p) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "empty value in \"%V\"", value);
+                return NGX_ERROR;
+            }
+
+            s = ngx_array_push(key->enums);
+            if (s == NULL) {
+                return NGX_ERROR;
+            }
+
+            s->data = p;
+            s->len = comma - p;
+
+            p = comma + 1;
+        }
+
+        return NGX_OK;
+    }
+
+    if (value->len > 6 && ngx_strncmp(value->data, "other=", 6) == 0) {
+        key->other.data = value->data + 6;
+        key->other.len = value->len - 6;
+
+        return NGX_OK;
+    }
+
+    if (value->len > 4 && ngx_strncmp(value->data, "top=", 4) == 0) {
+        n = ngx_atoi(value->data + 4, value->len - 4);
+
+        if (n == NGX_ERROR || n == 0 || n > NGX_STATSHOUSE_TOPK_MAX) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid top size \"%V\"", value);
+            return NGX_ERROR;
+        }
+
+        key->top = n;
+
+        return NGX_OK;
+    }
+
+    if (value->len == 12 && ngx_strncmp(value->data, "class=status", 12) == 0) {
+        key->transform.status_class = 1;
+        return NGX_OK;
+    }
+
+    if (value->len > 8 && ngx_strncmp(value->data, "buckets=", 8) == 0) {
+        return ngx_statshouse_conf_key_buckets(cf, &key->transform, value);
+    }
+
+    if (value->len == 5 && ngx_strncmp(value->data, "lower", 5) == 0) {
+        key->transform.lower = 1;
+        return NGX_OK;
+    }
+
+    if (value->len > 7 && ngx_strncmp(value->data, "prefix=", 7) == 0) {
+        n = ngx_atoi(value->data + 7, value->len - 7);
+
+        if (n == NGX_ERROR || n == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid prefix \"%V\"", value);
+            return NGX_ERROR;
+        }
+
+        key->transform.prefix = n;
+
+        return NGX_OK;
+    }
+
+    if (value->len > 7 && ngx_strncmp(value->data, "maxlen=", 7) == 0) {
+        n = ngx_atoi(value->data + 7, value->len - 7);
+
+        if (n == NGX_ERROR || n == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid maxlen \"%V\"", value);
+            return NGX_ERROR;
+        }
+
+        key->transform.maxlen = n;
+
+        return NGX_OK;
+    }
+
+    return NGX_DECLINED;
+}
+
+
+/* "buckets=1k,10k,100k": values up to 1k are sent as "1k", above 100k as "100k+" */
+
+static ngx_int_t
+ngx_statshouse_conf_key_buckets(ngx_conf_t *cf, ngx_statshouse_conf_transform_t *transform,
+    ngx_str_t *value)
+{
+    ngx_str_t  *name;
+    ngx_uint_t  n;
+    u_char     *p, *last, *comma;
+
+    if (transform->buckets) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "duplicate \"%V\"", value);
+        return NGX_ERROR;
+    }
 
-            split = s;
+    p = value->data + 8;
+    last = value->data + value->len;
+
+    for (n = 1, comma = p; comma < last; comma++) {
+        if (*comma == ',') {
+            n++;
         }
+    }
 
-        stat = &stats[splits];
-        ngx_statshouse_stat_init(stat, conf->name, conf->value.type);
+    transform->buckets = ngx_palloc(cf->pool, sizeof(double) * n);
+    if (transform->buckets == NULL) {
+        return NGX_ERROR;
+    }
 
-        if (split.len > 0) {
-            switch (conf->value.type) {
-                case ngx_statshouse_mt_counter:
-                    n = ngx_atoi(split.data, split.len);
-                    if (n == NGX_ERROR) {
-                        ngx_log_debug1(NGX_LOG_DEBUG_CORE, log, 0,
-                            "statshouse error parse counter: <%V>", &split);
-                        return NGX_ERROR;
-                    }
+    transform->bucket_names = ngx_palloc(cf->pool, sizeof(ngx_str_t) * (n + 1));
+    if (transform->bucket_names == NULL) {
+        return NGX_ERROR;
+    }
 
-                    ngx_statshouse_stat_value_counter(stat, n);
-                    break;
+    for (n = 0; p <= last; p = comma + 1, n++) {
+        comma = ngx_strlchr(p, last, ',');
+        if (comma == NULL) {
+            comma = last;
+        }
 
-                case ngx_statshouse_mt_value:
-                    minus = 0;
+        name = &transform->bucket_names[n];
 
-                    if (split.len > 0 && split.data[0] == '-') {
-                        split.data++;
-                        split.len--;
+        name->data = p;
+        name->len = comma - p;
 
-                        minus = 1;
-                    }
+        if (ngx_statshouse_parse_number(p, comma - p, &transform->buckets[n]) != NGX_OK
+            || (n > 0 && transform->buckets[n] <= transform->buckets[n - 1]))
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid bucket \"%V\" in \"%V\"", name, value);
+            return NGX_ERROR;
+        }
+    }
 
-                    n = ngx_atofp(split.data, split.len, 8);
-                    if (n == NGX_ERROR) {
-                        ngx_log_debug1(NGX_LOG_DEBUG_CORE, log, 0,
-                            "statshouse error parse value: <%V>", &split);
-                        return NGX_ERROR;
-                    }
+    transform->nbuckets = n;
 
-                    if (minus) {
-                        ngx_statshouse_stat_value_nvalue(stat, ((double) n) / 100000000.0);
-                    } else {
-                        ngx_statshouse_stat_value_value(stat, ((double) n) / 100000000.0);
-                    }
+    name = &transform->bucket_names[n];
 
-                    break;
+    name->len = transform->bucket_names[n - 1].len + 1;
+    name->data = ngx_pnalloc(cf->pool, name->len);
+    if (name->data == NULL) {
+        return NGX_ERROR;
+    }
 
-                case ngx_statshouse_mt_unique:
-                    n = ngx_atoi(split.data, split.len);
-                    if (n == NGX_ERROR) {
-                        ngx_log_debug1(NGX_LOG_DEBUG_CORE, log, 0,
-                            "statshouse error parse unique: <%V>", &split);
-                        return NGX_ERROR;
-                    }
+    ngx_memcpy(name->data, transform->bucket_names[n - 1].data, name->len - 1);
+    name->data[name->len - 1] = '+';
 
-                    ngx_statshouse_stat_value_unique(stat, n);
-                    break;
+    return NGX_OK;
+}
 
-                default:
-                    return NGX_ERROR;
-            }
-        } else {
-            ngx_statshouse_stat_value_zero(stat);
+
+/*
+ * Records a server the metric is sent to, called by modules on merge for
+ * own and inherited metrics. Dense, top, cardinality, rate and adaptive
+ * state is kept in the metric and queued to one server, so a metric sent
+ * to several servers cannot have it; dense counters are just disabled.
+ */
+
+ngx_int_t
+ngx_statshouse_conf_bind(ngx_conf_t *cf, ngx_statshouse_conf_t *conf,
+    ngx_statshouse_server_t *server)
+{
+    ngx_statshouse_server_t  **servers, **s;
+    ngx_uint_t                 i, adaptive;
+
+    if (conf->servers == NULL) {
+        conf->servers = ngx_array_create(cf->pool, 1, sizeof(ngx_statshouse_server_t *));
+        if (conf->servers == NULL) {
+            return NGX_ERROR;
         }
+    }
 
-        splits++;
+    servers = conf->servers->elts;
+    adaptive = 0;
 
-    } while (conf->value.split && splits < max);
+    for (i = 0; i < conf->servers->nelts; i++) {
+        if (servers[i] == server) {
+            return NGX_OK;
+        }
 
-    if (splits == 0) {
-        ngx_log_debug1(NGX_LOG_DEBUG_CORE, log, 0,
-            "statshouse empty splits: <%V>", &s);
+        if (servers[i]->adaptive) {
+            adaptive++;
+        }
+    }
 
-        return NGX_DECLINED;
+    if (conf->servers->nelts) {
+        if (conf->rate || conf->cardinality || conf->defs[NGX_STATSHOUSE_STAT_SKEY].top) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "statshouse_metric \"%V\" with rate, cardinality or top is sent to more than one "
+                "statshouse_server", &conf->name);
+            return NGX_ERROR;
+        }
+
+        if (server->adaptive && adaptive) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "statshouse_metric \"%V\" is sent to more than one statshouse_server with adaptive",
+                &conf->name);
+            return NGX_ERROR;
+        }
+
+        conf->dense = NULL;
+    }
+
+    s = ngx_array_push(conf->servers);
+    if (s == NULL) {
+        return NGX_ERROR;
+    }
+
+    *s = server;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_statshouse_conf_init(ngx_conf_t *cf, ngx_statshouse_conf_t *conf)
+{
+    ngx_statshouse_conf_transform_t  *t;
+    ngx_uint_t                        i;
+
+    for (i = 0; i < NGX_STATSHOUSE_STAT_SKEY; i++) {
+        if (conf->defs[i].top) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "\"top\" is allowed only for skey in statshouse_metric \"%V\"", &conf->name);
+            return NGX_ERROR;
+        }
+    }
+
+    for (i = 0; i < NGX_STATSHOUSE_STAT_KEYS_MAX; i++) {
+        t = &conf->defs[i].transform;
+
+        if ((t->status_class != 0) + (t->buckets != NULL) + (t->prefix || t->lower) > 1) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "only one of \"class\", \"buckets\" or \"prefix\" and \"lower\" is allowed "
+                "for key%V in statshouse_metric \"%V\"", &conf->defs[i].name, &conf->name);
+            return NGX_ERROR;
+        }
+    }
+
+    if (conf->disable) {
+        return NGX_OK;
+    }
+
+    if (ngx_statshouse_conf_init_keys(cf, conf) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_statshouse_conf_init_constant(cf, conf) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_statshouse_conf_init_exprs(cf, conf) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (conf->rate) {
+        conf->limiter = ngx_pcalloc(cf->pool, sizeof(ngx_statshouse_rate_t));
+        if (conf->limiter == NULL) {
+            return NGX_ERROR;
+        }
+
+        conf->limiter->name = conf->name;
+        conf->limiter->rate = conf->rate;
+        conf->limiter->burst = conf->rate_burst;
+
+        if (ngx_statshouse_rate_init(conf->limiter, cf->pool) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (conf->cardinality) {
+        conf->card = ngx_pcalloc(cf->pool, sizeof(ngx_statshouse_cardinality_t));
+        if (conf->card == NULL) {
+            return NGX_ERROR;
+        }
+
+        conf->card->name = conf->name;
+        conf->card->limit = conf->cardinality;
+
+        if (ngx_statshouse_cardinality_init(conf->card, cf->pool) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (ngx_statshouse_conf_init_dense(cf, conf) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (conf->dense == NULL && conf->defs[NGX_STATSHOUSE_STAT_SKEY].top) {
+        return ngx_statshouse_conf_init_topk(cf, conf);
+    }
+
+    return NGX_OK;
+}
+
+
+/* set and enabled keys are packed for send, only transforms are read from definitions then */
+
+static ngx_int_t
+ngx_statshouse_conf_init_keys(ngx_conf_t *cf, ngx_statshouse_conf_t *conf)
+{
+    ngx_statshouse_conf_key_def_t  *def;
+    ngx_statshouse_conf_key_t      *keys, *key;
+    ngx_uint_t                      i, n;
+
+    n = 0;
+
+    for (i = 0; i < NGX_STATSHOUSE_STAT_KEYS_MAX; i++) {
+        if (conf->defs[i].name.len && !conf->defs[i].disable) {
+            n++;
+        }
     }
 
+    if (n == 0) {
+        return NGX_OK;
+    }
+
+    keys = ngx_pcalloc(cf->pool, sizeof(ngx_statshouse_conf_key_t) * n);
+    if (keys == NULL) {
+        return NGX_ERROR;
+    }
+
+    n = 0;
+
     for (i = 0; i < NGX_STATSHOUSE_STAT_KEYS_MAX; i++) {
-        if (ngx_statshouse_is_empty(&keys[i])) {
+        def = &conf->defs[i];
+
+        if (def->name.len == 0 || def->disable) {
             continue;
         }
 
-        if (conf->keys[i].split) {
-            ngx_str_null(&split);
-            j = 0;
+        key = &keys[n++];
 
-            while (j < max && ngx_statshouse_stat_part(&keys[i], &split, &next)) {
-                stat = &stats[j];
+        key->string = def->string;
+        key->complex = def->complex;
+        key->enums = def->enums;
+        key->other = def->other;
+        key->index = i;
+        key->constant = def->constant;
+        key->split = def->split;
 
-                if (j >= splits) {
-                    // init new splits
+        if (def->transform.status_class || def->transform.buckets || def->transform.prefix
+            || def->transform.lower || def->transform.maxlen)
+        {
+            key->transform = &def->transform;
+        }
+    }
 
-                    ngx_statshouse_stat_init(stat, conf->name, conf->value.type);
+    conf->keys = keys;
+    conf->nactive = n;
 
-                    if (conf->value.split) {
-                        ngx_statshouse_stat_value_zero(stat);
-                    } else {
-                        ngx_statshouse_stat_value(stat, stats[0].values[0]);
-                    }
+    return NGX_OK;
+}
 
-                    for (previ = 0; previ < i; previ++) {
-                        if (conf->keys[previ].name.len == 0) {
-                            continue;
-                        }
 
-                        if (conf->keys[previ].split) {
-                            continue;
-                        }
+static ngx_int_t
+ngx_statshouse_conf_init_constant(ngx_conf_t *cf, ngx_statshouse_conf_t *conf)
+{
+    ngx_statshouse_conf_member_t  *members;
+    ngx_statshouse_conf_key_t     *key;
+    ngx_statshouse_scratch_t       scratch;
+    ngx_uint_t                     i;
+
+    /* empty and split literals keep the generic path */
+
+    if (conf->value.constant) {
+        if (conf->value.split || conf->value.string.len == 0) {
+            conf->value.constant = 0;
+
+        } else if (ngx_statshouse_stat_value_parse(conf->value.type, &conf->value.string,
+                       &conf->value.number, cf->log) != NGX_OK)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "invalid value \"%V\" in statshouse_metric \"%V\"", &conf->value.string, &conf->name);
+            return NGX_ERROR;
+        }
+    }
 
-                        if (ngx_statshouse_is_empty(&keys[previ])) {
-                            continue;
-                        }
+    if (conf->members) {
+        members = conf->members->elts;
 
-                        ngx_statshouse_stat_key(stat, conf->keys[previ].name, keys[previ]);
-                    }
-                }
+        for (i = 0; i < conf->members->nelts; i++) {
+            if (!members[i].value.constant) {
+                continue;
+            }
 
-                ngx_statshouse_stat_key(stat, conf->keys[i].name, split);
-                ++j;
+            if (members[i].value.string.len == 0) {
+                members[i].value.constant = 0;
+
+            } else if (ngx_statshouse_stat_value_parse(members[i].value.type, &members[i].value.string,
+                           &members[i].value.number, cf->log) != NGX_OK)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                    "invalid value \"%V\" in metric \"%V\"", &members[i].value.string, &members[i].name);
+                return NGX_ERROR;
             }
+        }
+    }
+
+    for (i = 0; i < conf->nactive; i++) {
+        key = &conf->keys[i];
+
+        if (!key->constant) {
+            continue;
+        }
+
+        if (key->split) {
+            key->constant = 0;
+            continue;
+        }
+
+        if (ngx_statshouse_scratch_init(&scratch, key->string.len, cf->pool) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        if (ngx_statshouse_conf_key_value(key, &key->string, &scratch) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_statshouse_conf_init_exprs(ngx_conf_t *cf, ngx_statshouse_conf_t *conf)
+{
+    ngx_statshouse_conf_member_t  *members;
+    ngx_statshouse_conf_key_t     *key;
+    ngx_int_t                      n;
+    ngx_uint_t                     i;
 
-            if (j > splits) {
-                splits = j;
+    if (conf->exprs == NULL) {
+        return NGX_OK;
+    }
+
+    if (!conf->value.constant) {
+        n = ngx_statshouse_exprs_add(conf->exprs, &conf->value.string, conf->value.complex);
+        if (n == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        conf->value.expr = n;
+    }
+
+    if (conf->members) {
+        members = conf->members->elts;
+
+        for (i = 0; i < conf->members->nelts; i++) {
+            if (members[i].value.constant) {
+                continue;
             }
-        } else {
-            for (j = 0; j < splits; j++) {
-                ngx_statshouse_stat_key(&stats[j], conf->keys[i].name, keys[i]);
+
+            n = ngx_statshouse_exprs_add(conf->exprs, &members[i].value.string, members[i].value.complex);
+            if (n == NGX_ERROR) {
+                return NGX_ERROR;
             }
+
+            members[i].value.expr = n;
         }
     }
 
-    ngx_log_debug2(NGX_LOG_DEBUG_CORE, log, 0,
-            "statshouse return %d splits: <%V>", splits, &s);
+    for (i = 0; i < conf->nactive; i++) {
+        key = &conf->keys[i];
 
-    return splits;
+        if (key->constant) {
+            continue;
+        }
+
+        n = ngx_statshouse_exprs_add(conf->exprs, &key->string, key->complex);
+        if (n == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        key->expr = n;
+    }
+
+    return NGX_OK;
 }
 
 
 static ngx_int_t
-ngx_statshouse_aggregate_handler(ngx_statshouse_stat_t *stat, void *ctx)
+ngx_statshouse_conf_init_dense(ngx_conf_t *cf, ngx_statshouse_conf_t *conf)
 {
-    ngx_statshouse_server_t  *server = ctx;
+    ngx_statshouse_dense_t      *dense;
+    ngx_statshouse_dense_key_t  *dkey;
+    ngx_statshouse_conf_key_t   *key;
+    ngx_uint_t                   i, n;
+    ngx_int_t                    rc;
+
+    /* dense path bypasses rate limiting and cardinality accounting */
+
+    if (conf->value.type != ngx_statshouse_mt_counter || conf->value.split || conf->sample_keys
+        || conf->members || conf->limiter || conf->card
+        || (conf->servers && conf->servers->nelts > 1))
+    {
+        return NGX_OK;
+    }
 
-    if (stat == NULL) {
-        return ngx_statshouse_flush(server);
+    /* dense counters, all keys are enumerated */
+
+    n = conf->nactive;
+
+    if (n == 0) {
+        return NGX_OK;
     }
 
-    return ngx_statshouse_send_to_buffer(server, stat);
+    for (i = 0; i < n; i++) {
+        if (conf->keys[i].enums == NULL || conf->keys[i].split) {
+            return NGX_OK;
+        }
+    }
+
+    dense = ngx_pcalloc(cf->pool, sizeof(ngx_statshouse_dense_t));
+    if (dense == NULL) {
+        return NGX_ERROR;
+    }
+
+    dense->keys = ngx_pcalloc(cf->pool, sizeof(ngx_statshouse_dense_key_t) * n);
+    if (dense->keys == NULL) {
+        return NGX_ERROR;
+    }
+
+    dense->name = conf->name;
+
+    for (i = 0; i < n; i++) {
+        key = &conf->keys[i];
+        dkey = &dense->keys[dense->nkeys++];
+
+        dkey->index = key->index;
+        dkey->values = key->enums->elts;
+        dkey->nvalues = key->enums->nelts;
+        dkey->other = key->other;
+    }
+
+    rc = ngx_statshouse_dense_init(dense, cf->pool);
+
+    if (rc == NGX_DECLINED) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+            "too many enumerated keys combinations in statshouse_metric \"%V\", dense counters disabled",
+            &conf->name);
+
+        return NGX_OK;
+    }
+
+    if (rc != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    conf->dense = dense;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_statshouse_conf_init_topk(ngx_conf_t *cf, ngx_statshouse_conf_t *conf)
+{
+    ngx_statshouse_topk_t  *topk;
+
+    if (conf->value.type != ngx_statshouse_mt_counter) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "\"top\" requires count in statshouse_metric \"%V\"", &conf->name);
+        return NGX_ERROR;
+    }
+
+    if (conf->members) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "\"top\" is not allowed in statshouse_metric_group \"%V\"", &conf->name);
+        return NGX_ERROR;
+    }
+
+    topk = ngx_pcalloc(cf->pool, sizeof(ngx_statshouse_topk_t));
+    if (topk == NULL) {
+        return NGX_ERROR;
+    }
+
+    topk->name = conf->name;
+    topk->size = conf->defs[NGX_STATSHOUSE_STAT_SKEY].top;
+
+    if (ngx_statshouse_topk_init(topk, cf->pool) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    conf->topk = topk;
+
+    return NGX_OK;
 }
@@ -13,35 +13,134 @@
 #include <ngx_statshouse_stat.h>
 
 #include "ngx_statshouse_aggregate.h"
+#include "ngx_statshouse_dense.h"
+#include "ngx_statshouse_topk.h"
+#include "ngx_statshouse_cardinality.h"
+#include "ngx_statshouse_rate.h"
+
+
+#define NGX_STATSHOUSE_ADAPTIVE_INTERVAL  1000
+#define NGX_STATSHOUSE_ADAPTIVE_LAG       100
+
+#define NGX_STATSHOUSE_EXPRS_BUCKETS      1024
+#define NGX_STATSHOUSE_SCRATCH_SIZE       16384
 
 
 typedef ngx_int_t (*ngx_statshouse_complex_value_pt)(void *ctx, void *val, ngx_str_t *value);
 
+/*
+ * NGX_OK if number is set, NGX_DECLINED if there is no value,
+ * NGX_AGAIN to evaluate the complex value instead
+ */
+typedef ngx_int_t (*ngx_statshouse_number_value_pt)(void *ctx, double *number);
+
+
+/* expression shared by metrics, evaluated at most once per send */
+typedef struct {
+    ngx_str_t                            string;
+    void                                *complex;
+
+    ngx_str_t                            value;
+    ngx_uint_t                           generation;
+
+    ngx_uint_t                           hash;
+    ngx_uint_t                           next;
+} ngx_statshouse_expr_t;
+
+typedef struct {
+    ngx_array_t                          exprs;
+    ngx_uint_t                          *buckets;
+    ngx_uint_t                           generation;
+} ngx_statshouse_exprs_t;
+
+/* per worker memory for values evaluated by one send, reset after it */
+typedef struct {
+    u_char                              *start;
+    u_char                              *pos;
+    u_char                              *end;
+
+    /* pool of the current send, used once the arena is exhausted */
+    ngx_pool_t                          *pool;
+} ngx_statshouse_scratch_t;
 
 typedef struct {
     ngx_str_t                            string;
 
     void                                *complex;
+    ngx_uint_t                           expr;
     ngx_statshouse_stat_type_e           type;
 
+    /* literal value, parsed once at configuration */
+    ngx_flag_t                           constant;
+    ngx_statshouse_stat_value_t          number;
+
+    /* native getter of a well-known variable, NULL if none */
+    ngx_statshouse_number_value_pt       accessor;
+
     ngx_flag_t                           split;
 } ngx_statshouse_conf_value_t;
 
+/* transforms, applied before enums, maxlen after them */
+typedef struct {
+    ngx_flag_t                           status_class;
+    double                              *buckets;
+    ngx_str_t                           *bucket_names;
+    ngx_uint_t                           nbuckets;
+    ngx_uint_t                           prefix;
+    ngx_flag_t                           lower;
+    size_t                               maxlen;
+} ngx_statshouse_conf_transform_t;
+
+/* key as configured by keyN directive, only transform is read on send */
 typedef struct {
+    ngx_str_t                            name;
     ngx_str_t                            string;
-
     void                                *complex;
-    ngx_str_t                            name;
 
     ngx_array_t                         *exists;
+    ngx_array_t                         *enums;
+    ngx_str_t                            other;
 
+    ngx_statshouse_conf_transform_t      transform;
+
+    ngx_uint_t                           top;
+    ngx_flag_t                           constant;
     ngx_flag_t                           split;
     ngx_flag_t                           disable;
+} ngx_statshouse_conf_key_def_t;
+
+/* set and enabled key, read on every send */
+typedef struct {
+    ngx_str_t                            string;
+
+    void                                *complex;
+    ngx_uint_t                           expr;
+
+    ngx_array_t                         *enums;
+    ngx_str_t                            other;
+
+    /* NULL if none, points into definition */
+    ngx_statshouse_conf_transform_t     *transform;
+
+    /* index in stat */
+    ngx_uint_t                           index;
+
+    /* literal value in string, transforms and enums applied at configuration */
+    unsigned                             constant:1;
+    unsigned                             split:1;
 } ngx_statshouse_conf_key_t;
 
+/* metric of statshouse_metric_group, sent with keys of the group */
+typedef struct {
+    ngx_str_t                            name;
+    ngx_statshouse_conf_value_t          value;
+} ngx_statshouse_conf_member_t;
+
+typedef struct ngx_statshouse_predicate_s  ngx_statshouse_predicate_t;
+
 typedef struct {
     ngx_array_t                         *strings;
-    ngx_array_t                         *complex;
+    ngx_statshouse_predicate_t          *predicate;
 } ngx_statshouse_conf_condition_t;
 
 typedef struct {
@@ -58,10 +157,67 @@ typedef struct {
     ngx_flag_t                           disable;
 
     ngx_statshouse_conf_value_t          value;
-    ngx_statshouse_conf_key_t            keys[NGX_STATSHOUSE_STAT_KEYS_MAX];
-    ngx_int_t                            sample;
+
+    /* all keys as configured, NGX_STATSHOUSE_STAT_KEYS_MAX entries */
+    ngx_statshouse_conf_key_def_t       *defs;
+
+    /* metrics of statshouse_metric_group, value counts key tuples then */
+    ngx_array_t                         *members;
+
+    /* set and enabled keys, ascending by index */
+    ngx_statshouse_conf_key_t           *keys;
+    ngx_uint_t                           nactive;
+
+    /* table of value and keys expressions, NULL if not shared */
+    ngx_statshouse_exprs_t              *exprs;
+
+    /* memory for transformed keys, reset by module after send */
+    ngx_statshouse_scratch_t            *scratch;
+
+    /* probability * 2^32, 0 if not sampled */
+    uint32_t                             sample;
+    double                               sample_weight;
+    ngx_flag_t                           sample_keys;
+
+    ngx_statshouse_dense_t              *dense;
+    ngx_statshouse_topk_t               *topk;
+
+    ngx_uint_t                           rate;
+    ngx_uint_t                           rate_burst;
+    ngx_statshouse_rate_t               *limiter;
+
+    ngx_uint_t                           cardinality;
+    ngx_str_t                            overflow;
+    ngx_statshouse_cardinality_t        *card;
+
+    /* distinct servers the metric is sent to, window state is flushed to one */
+    ngx_array_t                         *servers;
+    ngx_queue_t                          window;
+
+    /* adaptive sampling, probability * 2^32, 0 if not sampled */
+    double                               adaptive_events;
+    uint32_t                             adaptive_sample;
+    double                               adaptive_weight;
+    ngx_queue_t                          adaptive;
 } ngx_statshouse_conf_t;
 
+struct ngx_statshouse_handle_s {
+    ngx_str_t                            name;
+    ngx_statshouse_stat_type_e           type;
+
+    /* indexes of keys whose values are passed on send */
+    uint64_t                             keys_mask;
+
+    /* hash of name and keys_mask for aggregation */
+    uint32_t                             hash;
+};
+
+/* metrics sent by one ngx_*_statshouse_send() phase, "" for log phase */
+typedef struct {
+    ngx_str_t                            name;
+    ngx_array_t                          confs;
+} ngx_statshouse_phase_t;
+
 typedef struct {
     ngx_url_t                            addr;
     ngx_connection_t                    *connection;
@@ -71,16 +227,35 @@ typedef struct {
 
     ngx_flag_t                           flush_after_request;
 
-    ngx_statshouse_stat_t               *splits;
+    /* stats compiled by the last ngx_statshouse_stat_compile() */
+    ngx_statshouse_stat_t              **splits;
+
+    u_char                              *splits_stats;
+    size_t                               splits_size;
+    ngx_str_t                           *splits_keys;
+    ngx_str_t                           *splits_parts;
     ngx_int_t                            splits_max;
 
     ngx_msec_t                           flush;
     ngx_event_t                          flush_event;
     ngx_connection_t                     flush_connection;
 
+    ngx_queue_t                          windows;
+    ngx_event_t                          window_event;
+    ngx_connection_t                     window_connection;
+
+    /* stats per second budget of adaptive sampling, 0 if disabled */
+    ngx_uint_t                           adaptive;
+    double                               adaptive_budget;
+    ngx_msec_t                           adaptive_expire;
+    ngx_queue_t                          adaptives;
+    ngx_event_t                          adaptive_event;
+    ngx_connection_t                     adaptive_connection;
+
     ngx_statshouse_aggregate_t          *aggregate;
     size_t                               aggregate_size;
     ngx_int_t                            aggregate_values;
+    size_t                               aggregate_intern;
 
     ngx_log_t                           *log;
 } ngx_statshouse_server_t;
@@ -89,11 +264,46 @@ typedef struct {
 ngx_int_t  ngx_statshouse_server_init(ngx_statshouse_server_t *server, ngx_pool_t *pool);
 
 ngx_int_t  ngx_statshouse_send(ngx_statshouse_server_t *server, ngx_statshouse_stat_t *stat);
+ngx_int_t  ngx_statshouse_send_batch(ngx_statshouse_server_t *server, ngx_statshouse_stat_t **stats, ngx_int_t n);
 ngx_int_t  ngx_statshouse_flush(ngx_statshouse_server_t *server);
 ngx_int_t  ngx_statshouse_flush_after_request(ngx_statshouse_server_t *server);
 
-ngx_int_t  ngx_statshouse_stat_compile(ngx_statshouse_conf_t *conf, ngx_statshouse_stat_t *stats, ngx_int_t max,
+ngx_statshouse_handle_t  *ngx_statshouse_handle_create(ngx_conf_t *cf, ngx_str_t *name,
+    ngx_statshouse_stat_type_e type, ngx_uint_t *keys, ngx_uint_t nkeys);
+ngx_int_t  ngx_statshouse_handle_send(ngx_statshouse_server_t *server, ngx_statshouse_handle_t *handle,
+    ngx_str_t *keys, double number);
+
+ngx_int_t  ngx_statshouse_stat_compile(ngx_statshouse_server_t *server, ngx_statshouse_conf_t *conf,
     ngx_statshouse_complex_value_pt complex, void *complex_ctx, ngx_log_t *log);
 
+ngx_int_t  ngx_statshouse_parse_number(u_char *data, size_t len, double *number);
+
+ngx_statshouse_exprs_t  *ngx_statshouse_exprs_create(ngx_pool_t *pool);
+ngx_int_t  ngx_statshouse_exprs_find(ngx_statshouse_exprs_t *exprs, ngx_str_t *string);
+ngx_int_t  ngx_statshouse_exprs_add(ngx_statshouse_exprs_t *exprs, ngx_str_t *string, void *complex);
+
+#define ngx_statshouse_exprs_next(exprs)  (exprs)->generation++
+
+ngx_int_t  ngx_statshouse_scratch_init(ngx_statshouse_scratch_t *scratch, size_t size, ngx_pool_t *pool);
+u_char    *ngx_statshouse_scratch_alloc(ngx_statshouse_scratch_t *scratch, size_t size);
+u_char    *ngx_statshouse_scratch_palloc(ngx_statshouse_scratch_t *scratch, size_t size);
+
+#define ngx_statshouse_scratch_reset(scratch)                                 \
+    (scratch)->pos = (scratch)->start, (scratch)->pool = NULL
+
+ngx_int_t  ngx_statshouse_phases_add(ngx_array_t **phases, ngx_statshouse_conf_t *conf, ngx_pool_t *pool);
+ngx_statshouse_phase_t  *ngx_statshouse_phases_find(ngx_array_t *phases, ngx_str_t *name);
+
+char      *ngx_statshouse_conf_member_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+char      *ngx_statshouse_conf_condition_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+char      *ngx_statshouse_conf_sample_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+char      *ngx_statshouse_conf_rate_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+char      *ngx_statshouse_conf_cardinality_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+ngx_int_t  ngx_statshouse_conf_variable(ngx_str_t *value, ngx_str_t *name);
+ngx_int_t  ngx_statshouse_conf_key_option(ngx_conf_t *cf, ngx_statshouse_conf_key_def_t *key, ngx_str_t *value);
+ngx_int_t  ngx_statshouse_conf_init(ngx_conf_t *cf, ngx_statshouse_conf_t *conf);
+ngx_int_t  ngx_statshouse_conf_bind(ngx_conf_t *cf, ngx_statshouse_conf_t *conf,
+    ngx_statshouse_server_t *server);
+
 
 #endif
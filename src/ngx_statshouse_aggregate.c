@@ -11,6 +11,10 @@
 #include "ngx_statshouse_aggregate.h"
 
 
+/* marks ids of the second dictionary, so ids of both generations never match */
+#define NGX_STATSHOUSE_AGGREGATE_GENERATION  0x80000000
+
+
 typedef struct {
     ngx_rbtree_node_t                    node;
     size_t                               size;
@@ -18,16 +22,22 @@ typedef struct {
     ngx_msec_t                           time;
     ngx_queue_t                          queue;
 
+    uint32_t                            *ids;
+    ngx_uint_t                           generation;
+
     ngx_statshouse_stat_t                stat;
 } ngx_statshouse_aggregate_stat_t;
 
 
 static void  ngx_statshouse_aggregate_timer_handler(ngx_event_t *ev);
 static void  ngx_statshouse_aggregate_timer(ngx_statshouse_aggregate_t *aggregate, ngx_msec_t now);
+static void  ngx_statshouse_aggregate_generation(ngx_statshouse_aggregate_t *aggregate, ngx_msec_t now);
 
 static void  ngx_statshouse_aggregate_insert_value(ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static ngx_int_t  ngx_statshouse_aggregate_cmp(ngx_statshouse_aggregate_stat_t *astat,
+    ngx_statshouse_stat_t *stat, uint32_t *ids);
 static ngx_statshouse_aggregate_stat_t  *ngx_statshouse_aggregate_lookup(ngx_statshouse_aggregate_t *server,
-    uint32_t hash, size_t size, ngx_int_t type);
+    uint32_t hash, ngx_statshouse_stat_t *stat, uint32_t *ids);
 static void  *ngx_statshouse_aggregate_alloc(ngx_statshouse_aggregate_t *aggregate, size_t size);
 static void  ngx_statshouse_aggregate_free(ngx_statshouse_aggregate_t *aggregate, void *ptr, size_t size);
 
@@ -44,6 +54,15 @@ ngx_statshouse_aggregate_init(ngx_statshouse_aggregate_t *aggregate, ngx_pool_t
     aggregate->alloc.pos = aggregate->alloc.start;
     aggregate->alloc.last = aggregate->alloc.start;
 
+    aggregate->intern[0].size = aggregate->intern_size / 2;
+    aggregate->intern[1].size = aggregate->intern_size / 2;
+
+    if (ngx_statshouse_intern_init(&aggregate->intern[0], pool) != NGX_OK
+        || ngx_statshouse_intern_init(&aggregate->intern[1], pool) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
     ngx_rbtree_init(&aggregate->rbtree, &aggregate->sentinel, ngx_statshouse_aggregate_insert_value);
     ngx_queue_init(&aggregate->queue);
 
@@ -59,16 +78,43 @@ ngx_statshouse_aggregate_init(ngx_statshouse_aggregate_t *aggregate, ngx_pool_t
 }
 
 
+/* crc32 of name and keys layout, not finalized; stats of a metric handle share it */
+
+uint32_t
+ngx_statshouse_aggregate_seed(ngx_str_t *name, uint64_t keys_mask)
+{
+    uint32_t  hash;
+
+    ngx_crc32_init(hash);
+
+    ngx_crc32_update(&hash, name->data, name->len);
+    ngx_crc32_update(&hash, (u_char *) &keys_mask, sizeof(uint64_t));
+
+    return hash;
+}
+
+
 ngx_int_t
 ngx_statshouse_aggregate(ngx_statshouse_aggregate_t *aggregate, ngx_statshouse_stat_t *stat, ngx_msec_t now)
+{
+    return ngx_statshouse_aggregate_seeded(aggregate, stat,
+        ngx_statshouse_aggregate_seed(&stat->name, stat->keys_mask), now);
+}
+
+
+ngx_int_t
+ngx_statshouse_aggregate_seeded(ngx_statshouse_aggregate_t *aggregate, ngx_statshouse_stat_t *stat,
+    uint32_t hash, ngx_msec_t now)
 {
     ngx_statshouse_aggregate_stat_t  *astat;
-    ngx_int_t                         i, rc;
-    uint32_t                          hash;
+    ngx_str_t                         values[NGX_STATSHOUSE_STAT_KEYS_MAX];
+    uint32_t                          ids[NGX_STATSHOUSE_STAT_KEYS_MAX];
+    ngx_int_t                         rc;
+    ngx_uint_t                        i, n;
     size_t                            size;
     u_char                           *p;
 
-    if (stat->type != ngx_statshouse_mt_counter && aggregate->values == 0) {
+    if (stat->type != ngx_statshouse_mt_counter && stat->values_count > aggregate->values) {
         return NGX_DECLINED;
     }
 
@@ -79,41 +125,61 @@ ngx_statshouse_aggregate(ngx_statshouse_aggregate_t *aggregate, ngx_statshouse_s
         return NGX_DECLINED;
     }
 
-    ngx_crc32_init(hash);
+    ngx_statshouse_aggregate_generation(aggregate, now);
+
     size = sizeof(ngx_statshouse_aggregate_stat_t);
 
-    ngx_crc32_update(&hash, stat->name.data, stat->name.len);
+    if (stat->type != ngx_statshouse_mt_counter) {
+        size += sizeof(ngx_statshouse_stat_value_t) * (aggregate->values - 1);
+    }
+
+    n = ngx_statshouse_stat_keys_count(stat);
+    size += (sizeof(ngx_str_t) + sizeof(uint32_t)) * n;
+
+    for (i = 0; i < n; i++) {
+        ids[i] = ngx_statshouse_intern(&aggregate->intern[aggregate->generation], &stat->keys[i], &values[i]);
+
+        if (ids[i] != NGX_STATSHOUSE_INTERN_NONE) {
+            if (aggregate->generation) {
+                ids[i] |= NGX_STATSHOUSE_AGGREGATE_GENERATION;
+            }
+
+            ngx_crc32_update(&hash, (u_char *) &ids[i], sizeof(uint32_t));
+            continue;
+        }
 
-    for (i = 0; i < stat->keys_count; i++) {
-        ngx_crc32_update(&hash, stat->keys[i].name.data, stat->keys[i].name.len);
-        ngx_crc32_update(&hash, stat->keys[i].value.data, stat->keys[i].value.len);
+        ngx_crc32_update(&hash, stat->keys[i].data, stat->keys[i].len);
 
-        size += stat->keys[i].value.len;
+        size += stat->keys[i].len;
     }
 
     ngx_crc32_final(hash);
 
-    if (stat->type != ngx_statshouse_mt_counter) {
-        size += sizeof(ngx_statshouse_stat_value_t) * (aggregate->values - 1);
-    }
+    size = ngx_align(size, NGX_ALIGNMENT);
 
-    astat = ngx_statshouse_aggregate_lookup(aggregate, hash, size, stat->type);
+    astat = ngx_statshouse_aggregate_lookup(aggregate, hash, stat, ids);
     if (astat != NULL) {
         if (stat->type == ngx_statshouse_mt_counter) {
             astat->stat.values[0].counter += stat->values[0].counter;
 
             ngx_log_debug1(NGX_LOG_DEBUG_CORE, aggregate->log, 0,
-                "statshouse success aggregate counter, found exists node (%v)", &stat->name);
+                "statshouse success aggregate counter, found exists node (%V)", &stat->name);
 
             return NGX_OK;
         }
 
-        if (astat->stat.values_count < aggregate->values) {
-            astat->stat.values[astat->stat.values_count] = stat->values[0];
-            astat->stat.values_count++;
+        if (astat->stat.values_count + stat->values_count <= aggregate->values) {
+            if (astat->stat.count || stat->count) {
+                astat->stat.count = ngx_statshouse_stat_count(&astat->stat) + ngx_statshouse_stat_count(stat);
+            }
+
+            ngx_memcpy(&astat->stat.values[astat->stat.values_count], stat->values,
+                sizeof(ngx_statshouse_stat_value_t) * stat->values_count);
+
+            astat->stat.values_count += stat->values_count;
 
             ngx_log_debug1(NGX_LOG_DEBUG_CORE, aggregate->log, 0,
-                "statshouse success aggregate value, found exists node (%v)", &stat->name);
+                "statshouse success aggregate value, found exists node (%V)", &stat->name);
 
             return NGX_OK;
         }
@@ -150,31 +216,47 @@ ngx_statshouse_aggregate(ngx_statshouse_aggregate_t *aggregate, ngx_statshouse_s
     astat->node.key = hash;
     astat->size = size;
     astat->time = now;
+    astat->generation = aggregate->generation;
 
     astat->stat.name = stat->name;
-    astat->stat.values_count = 1;
-    astat->stat.values[0] = stat->values[0];
+    astat->stat.values_count = stat->values_count;
+    astat->stat.count = stat->count;
+
+    ngx_memcpy(astat->stat.values, stat->values,
+        sizeof(ngx_statshouse_stat_value_t) * stat->values_count);
     astat->stat.type = stat->type;
-    astat->stat.keys_count = stat->keys_count;
+    astat->stat.keys_mask = stat->keys_mask;
 
     p = (u_char *) astat + sizeof(ngx_statshouse_aggregate_stat_t);
     if (stat->type != ngx_statshouse_mt_counter) {
         p += sizeof(ngx_statshouse_stat_value_t) * (aggregate->values - 1);
     }
 
-    for (i = 0; i < stat->keys_count; i++) {
-        astat->stat.keys[i].name = stat->keys[i].name;
+    astat->stat.keys = (ngx_str_t *) p;
+    p += sizeof(ngx_str_t) * n;
+
+    astat->ids = (uint32_t *) p;
+    p += sizeof(uint32_t) * n;
+
+    for (i = 0; i < n; i++) {
+        astat->ids[i] = ids[i];
+
+        if (ids[i] != NGX_STATSHOUSE_INTERN_NONE) {
+            astat->stat.keys[i] = values[i];
+            continue;
+        }
 
-        astat->stat.keys[i].value.data = p;
-        astat->stat.keys[i].value.len = stat->keys[i].value.len;
+        astat->stat.keys[i].data = p;
+        astat->stat.keys[i].len = stat->keys[i].len;
 
-        ngx_memcpy(p, stat->keys[i].value.data, stat->keys[i].value.len);
-        p += stat->keys[i].value.len;
+        p = ngx_cpymem(p, stat->keys[i].data, stat->keys[i].len);
     }
 
     ngx_rbtree_insert(&aggregate->rbtree, &astat->node);
     ngx_queue_insert_tail(&aggregate->queue, &astat->queue);
 
+    aggregate->refs[astat->generation]++;
+
     ngx_statshouse_aggregate_timer(aggregate, now);
 
     return NGX_OK;
@@ -223,6 +305,8 @@ ngx_statshouse_aggregate_process(ngx_statshouse_aggregate_t *aggregate, ngx_msec
             ngx_rbtree_delete(&aggregate->rbtree, &astat->node);
         }
 
+        aggregate->refs[astat->generation]--;
+
         ngx_statshouse_aggregate_free(aggregate, astat, astat->size);
 
     } while (!ngx_queue_empty(&aggregate->queue));
@@ -238,6 +322,42 @@ ngx_statshouse_aggregate_process(ngx_statshouse_aggregate_t *aggregate, ngx_msec
 }
 
 
+/*
+ * Nodes keep interned values of the dictionary they were created with.
+ * Under steady traffic the queue never empties, so the dictionaries are
+ * rotated instead: once the current one has lived for a flush interval and
+ * no node references the other one, the other is cleared and becomes current.
+ * A dictionary nobody references is cleared in place.
+ */
+
+static void
+ngx_statshouse_aggregate_generation(ngx_statshouse_aggregate_t *aggregate, ngx_msec_t now)
+{
+    ngx_uint_t  current, other;
+
+    current = aggregate->generation;
+    other = current ^ 1;
+
+    if (aggregate->refs[current] == 0) {
+        ngx_statshouse_intern_reset(&aggregate->intern[current]);
+        aggregate->generation_time = now;
+        return;
+    }
+
+    if (aggregate->refs[other] != 0 || now - aggregate->generation_time < aggregate->interval) {
+        return;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_CORE, aggregate->log, 0,
+        "statshouse aggregate, switch to intern generation %ui", other);
+
+    ngx_statshouse_intern_reset(&aggregate->intern[other]);
+
+    aggregate->generation = other;
+    aggregate->generation_time = now;
+}
+
+
 static void
 ngx_statshouse_aggregate_timer_handler(ngx_event_t *ev)
 {
@@ -308,7 +428,8 @@ ngx_statshouse_aggregate_insert_value(ngx_rbtree_node_t *temp,
             sn = ngx_rbtree_data(node, ngx_statshouse_aggregate_stat_t, node);
             sn_temp = ngx_rbtree_data(temp, ngx_statshouse_aggregate_stat_t, node);
 
-            p = (sn->size < sn_temp->size) ? &temp->left : &temp->right;
+            p = (ngx_statshouse_aggregate_cmp(sn_temp, &sn->stat, sn->ids) > 0)
+                ? &temp->left : &temp->right;
         }
 
         if (*p == sentinel) {
@@ -326,11 +447,65 @@ ngx_statshouse_aggregate_insert_value(ngx_rbtree_node_t *temp,
 }
 
 
+static ngx_int_t
+ngx_statshouse_aggregate_cmp(ngx_statshouse_aggregate_stat_t *astat, ngx_statshouse_stat_t *stat, uint32_t *ids)
+{
+    ngx_str_t   *akey, *key;
+    ngx_uint_t   i, n;
+    ngx_int_t    rc;
+
+    if (astat->stat.type != stat->type) {
+        return (astat->stat.type < stat->type) ? -1 : 1;
+    }
+
+    if (astat->stat.keys_mask != stat->keys_mask) {
+        return (astat->stat.keys_mask < stat->keys_mask) ? -1 : 1;
+    }
+
+    if (astat->stat.name.len != stat->name.len) {
+        return (astat->stat.name.len < stat->name.len) ? -1 : 1;
+    }
+
+    rc = ngx_memcmp(astat->stat.name.data, stat->name.data, stat->name.len);
+    if (rc != 0) {
+        return rc;
+    }
+
+    n = ngx_statshouse_stat_keys_count(stat);
+
+    for (i = 0; i < n; i++) {
+        if (astat->ids[i] != ids[i]) {
+            return (astat->ids[i] < ids[i]) ? -1 : 1;
+        }
+
+        if (ids[i] != NGX_STATSHOUSE_INTERN_NONE) {
+            continue;
+        }
+
+        akey = &astat->stat.keys[i];
+        key = &stat->keys[i];
+
+        if (akey->len != key->len) {
+            return (akey->len < key->len) ? -1 : 1;
+        }
+
+        rc = ngx_memcmp(akey->data, key->data, key->len);
+        if (rc != 0) {
+            return rc;
+        }
+    }
+
+    return 0;
+}
+
+
 static ngx_statshouse_aggregate_stat_t *
-ngx_statshouse_aggregate_lookup(ngx_statshouse_aggregate_t *aggregate, uint32_t hash, size_t size, ngx_int_t type)
+ngx_statshouse_aggregate_lookup(ngx_statshouse_aggregate_t *aggregate, uint32_t hash,
+    ngx_statshouse_stat_t *stat, uint32_t *ids)
 {
     ngx_rbtree_node_t                *node, *sentinel;
     ngx_statshouse_aggregate_stat_t  *astat;
+    ngx_int_t                         rc;
 
     node = aggregate->rbtree.root;
     sentinel = aggregate->rbtree.sentinel;
@@ -351,21 +526,12 @@ ngx_statshouse_aggregate_lookup(ngx_statshouse_aggregate_t *aggregate, uint32_t
 
         astat = ngx_rbtree_data(node, ngx_statshouse_aggregate_stat_t, node);
 
-        if (size < astat->size) {
-            node = node->left;
-            continue;
-        }
-
-        if (size > astat->size) {
-            node = node->right;
-            continue;
-        }
-
-        if (astat->stat.type == type) {
+        rc = ngx_statshouse_aggregate_cmp(astat, stat, ids);
+        if (rc == 0) {
             return astat;
         }
 
-        node = (astat->stat.type < type) ? node->left : node->right;
+        node = (rc > 0) ? node->left : node->right;
     }
 
     /* not found */
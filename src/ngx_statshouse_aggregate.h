@@ -12,6 +12,8 @@
 #include <ngx_event.h>
 #include <ngx_statshouse_stat.h>
 
+#include "ngx_statshouse_intern.h"
+
 
 typedef ngx_int_t (*ngx_statshouse_aggregate_pt)(ngx_statshouse_stat_t *stat, void *ctx);
 
@@ -27,12 +29,19 @@ typedef struct {
 
     ngx_queue_t                   queue;
 
+    /* two dictionaries, swapped once the older one is no longer referenced */
+    ngx_statshouse_intern_t       intern[2];
+    ngx_uint_t                    refs[2];
+    ngx_uint_t                    generation;
+    ngx_msec_t                    generation_time;
+
     ngx_event_t                   timer_event;
     ngx_connection_t              timer_connection;
 
     ngx_msec_t                    interval;
     ngx_int_t                     values;
     size_t                        size;
+    size_t                        intern_size;
 
     ngx_log_t                    *log;
 } ngx_statshouse_aggregate_t;
@@ -40,6 +49,9 @@ typedef struct {
 
 ngx_int_t  ngx_statshouse_aggregate_init(ngx_statshouse_aggregate_t *aggregate, ngx_pool_t *pool);
 ngx_int_t  ngx_statshouse_aggregate(ngx_statshouse_aggregate_t *aggregate, ngx_statshouse_stat_t *stat, ngx_msec_t now);
+ngx_int_t  ngx_statshouse_aggregate_seeded(ngx_statshouse_aggregate_t *aggregate, ngx_statshouse_stat_t *stat,
+    uint32_t hash, ngx_msec_t now);
+uint32_t   ngx_statshouse_aggregate_seed(ngx_str_t *name, uint64_t keys_mask);
 ngx_int_t  ngx_statshouse_aggregate_process(ngx_statshouse_aggregate_t *aggregate, ngx_msec_t now);
 
 #endif
@@ -0,0 +1,163 @@
+/* Copyright 2022 V Kontakte LLC
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include <ngx_core.h>
+#include <ngx_statshouse_stat.h>
+#include <math.h>
+
+#include "ngx_statshouse_cardinality.h"
+
+
+/*
+ * Key tuples of a metric are counted per window twice: hyperloglog
+ * estimates all distinct tuples, while the first "limit" tuples are
+ * remembered exactly and only they pass.  Hash 0 marks an empty slot.
+ */
+
+
+ngx_int_t
+ngx_statshouse_cardinality_init(ngx_statshouse_cardinality_t *card, ngx_pool_t *pool)
+{
+    ngx_uint_t  size;
+
+    size = 2;
+
+    while (size < card->limit * 2) {
+        size <<= 1;
+    }
+
+    card->seen = ngx_pcalloc(pool, sizeof(uint32_t) * size);
+    if (card->seen == NULL) {
+        return NGX_ERROR;
+    }
+
+    card->mask = size - 1;
+
+    return NGX_OK;
+}
+
+
+/*
+ * Returns NGX_DECLINED if tuple is over the limit.
+ */
+
+ngx_int_t
+ngx_statshouse_cardinality_add(ngx_statshouse_cardinality_t *card, uint32_t hash)
+{
+    ngx_uint_t  i, rank;
+    uint32_t    w;
+
+    i = hash >> (32 - NGX_STATSHOUSE_CARDINALITY_BITS);
+    w = hash << NGX_STATSHOUSE_CARDINALITY_BITS;
+
+    for (rank = 1; rank <= 32 - NGX_STATSHOUSE_CARDINALITY_BITS; rank++) {
+        if (w & 0x80000000) {
+            break;
+        }
+
+        w <<= 1;
+    }
+
+    if (card->registers[i] < rank) {
+        card->registers[i] = (u_char) rank;
+    }
+
+    if (hash == 0) {
+        hash = 1;
+    }
+
+    for (i = hash & card->mask; card->seen[i]; i = (i + 1) & card->mask) {
+        if (card->seen[i] == hash) {
+            return NGX_OK;
+        }
+    }
+
+    if (card->nseen < card->limit) {
+        card->seen[i] = hash;
+        card->nseen++;
+
+        return NGX_OK;
+    }
+
+    card->overflow++;
+
+    return NGX_DECLINED;
+}
+
+
+double
+ngx_statshouse_cardinality_estimate(ngx_statshouse_cardinality_t *card)
+{
+    double      m, sum, estimate;
+    ngx_uint_t  i, zeros;
+
+    m = NGX_STATSHOUSE_CARDINALITY_REGISTERS;
+    sum = 0;
+    zeros = 0;
+
+    for (i = 0; i < NGX_STATSHOUSE_CARDINALITY_REGISTERS; i++) {
+        sum += 1.0 / (double) ((uint64_t) 1 << card->registers[i]);
+
+        if (card->registers[i] == 0) {
+            zeros++;
+        }
+    }
+
+    estimate = (0.7213 / (1 + 1.079 / m)) * m * m / sum;
+
+    if (estimate <= 2.5 * m && zeros) {
+        /* linear counting for small cardinalities */
+        estimate = m * log(m / zeros);
+    }
+
+    return estimate;
+}
+
+
+ngx_int_t
+ngx_statshouse_cardinality_process(ngx_statshouse_cardinality_t *card,
+    ngx_statshouse_aggregate_pt handler, void *ctx)
+{
+    ngx_statshouse_stat_t  stat;
+    ngx_str_t              keys[1];
+    ngx_str_t              name;
+    double                 estimate;
+
+    estimate = ngx_statshouse_cardinality_estimate(card);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_CORE, ngx_cycle->log, 0,
+        "statshouse cardinality \"%V\", estimate %.0f, overflow %.0f",
+        &card->name, estimate, card->overflow);
+
+    ngx_str_set(&name, NGX_STATSHOUSE_CARDINALITY_METRIC);
+
+    ngx_statshouse_stat_init(&stat, name, ngx_statshouse_mt_value, keys);
+    ngx_statshouse_stat_value_value(&stat, estimate);
+    ngx_statshouse_stat_key(&stat, 1, card->name);
+
+    handler(&stat, ctx);
+
+    if (card->overflow) {
+        ngx_str_set(&name, NGX_STATSHOUSE_OVERFLOW_METRIC);
+
+        ngx_statshouse_stat_init(&stat, name, ngx_statshouse_mt_counter, keys);
+        ngx_statshouse_stat_value_counter(&stat, 0);
+        ngx_statshouse_stat_key(&stat, 1, card->name);
+
+        stat.values[0].counter = card->overflow;
+
+        handler(&stat, ctx);
+    }
+
+    ngx_memzero(card->registers, sizeof(card->registers));
+    ngx_memzero(card->seen, sizeof(uint32_t) * (card->mask + 1));
+
+    card->nseen = 0;
+    card->overflow = 0;
+
+    return NGX_OK;
+}
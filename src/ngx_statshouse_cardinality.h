@@ -0,0 +1,47 @@
+/* Copyright 2022 V Kontakte LLC
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef _NGX_STATSHOUSE_CARDINALITY_H_INCLUDED_
+#define _NGX_STATSHOUSE_CARDINALITY_H_INCLUDED_
+
+#include <ngx_core.h>
+#include <ngx_statshouse_stat.h>
+
+#include "ngx_statshouse_aggregate.h"
+
+
+#define NGX_STATSHOUSE_CARDINALITY_BITS       10
+#define NGX_STATSHOUSE_CARDINALITY_REGISTERS  (1 << NGX_STATSHOUSE_CARDINALITY_BITS)
+#define NGX_STATSHOUSE_CARDINALITY_MAX        65536
+
+#define NGX_STATSHOUSE_CARDINALITY_METRIC     "nginx_statshouse_cardinality"
+#define NGX_STATSHOUSE_OVERFLOW_METRIC        "nginx_statshouse_cardinality_overflow"
+
+
+typedef struct {
+    ngx_str_t                  name;
+
+    /* hyperloglog of all key tuples */
+    u_char                     registers[NGX_STATSHOUSE_CARDINALITY_REGISTERS];
+
+    /* hashes of passed key tuples, at most limit */
+    uint32_t                  *seen;
+    ngx_uint_t                 nseen;
+    ngx_uint_t                 mask;
+
+    ngx_uint_t                 limit;
+    double                     overflow;
+} ngx_statshouse_cardinality_t;
+
+
+ngx_int_t  ngx_statshouse_cardinality_init(ngx_statshouse_cardinality_t *card, ngx_pool_t *pool);
+ngx_int_t  ngx_statshouse_cardinality_add(ngx_statshouse_cardinality_t *card, uint32_t hash);
+double     ngx_statshouse_cardinality_estimate(ngx_statshouse_cardinality_t *card);
+ngx_int_t  ngx_statshouse_cardinality_process(ngx_statshouse_cardinality_t *card,
+    ngx_statshouse_aggregate_pt handler, void *ctx);
+
+#endif
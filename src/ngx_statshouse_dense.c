@@ -0,0 +1,126 @@
+/* Copyright 2022 V Kontakte LLC
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include <ngx_core.h>
+#include <ngx_statshouse_stat.h>
+
+#include "ngx_statshouse_dense.h"
+
+
+/*
+ * Every key has nvalues + 2 positions: enum values, "other" value
+ * and empty value (key is not sent).
+ */
+
+#define ngx_statshouse_dense_key_other(key)  ((key)->nvalues)
+#define ngx_statshouse_dense_key_empty(key)  ((key)->nvalues + 1)
+
+
+ngx_int_t
+ngx_statshouse_dense_init(ngx_statshouse_dense_t *dense, ngx_pool_t *pool)
+{
+    ngx_uint_t  i, ncells;
+
+    ncells = 1;
+
+    for (i = 0; i < dense->nkeys; i++) {
+        dense->keys[i].stride = ncells;
+        ncells *= dense->keys[i].nvalues + 2;
+
+        if (ncells > NGX_STATSHOUSE_DENSE_CELLS_MAX) {
+            return NGX_DECLINED;
+        }
+    }
+
+    dense->cells = ngx_pcalloc(pool, sizeof(double) * ncells);
+    if (dense->cells == NULL) {
+        return NGX_ERROR;
+    }
+
+    dense->ncells = ncells;
+
+    return NGX_OK;
+}
+
+
+/*
+ * Returns cell offset of the key value, NGX_DECLINED if value is not
+ * enumerated and key has no "other" value.
+ */
+
+ngx_int_t
+ngx_statshouse_dense_key(ngx_statshouse_dense_key_t *key, ngx_str_t *value)
+{
+    ngx_uint_t  i;
+
+    for (i = 0; i < key->nvalues; i++) {
+        if (key->values[i].len == value->len
+            && ngx_memcmp(key->values[i].data, value->data, value->len) == 0)
+        {
+            return i * key->stride;
+        }
+    }
+
+    if (value->len == 0 || (value->len == 1 && (value->data[0] == '-' || value->data[0] == '0'))) {
+        return ngx_statshouse_dense_key_empty(key) * key->stride;
+    }
+
+    if (key->other.len) {
+        return ngx_statshouse_dense_key_other(key) * key->stride;
+    }
+
+    return NGX_DECLINED;
+}
+
+
+ngx_int_t
+ngx_statshouse_dense_process(ngx_statshouse_dense_t *dense,
+    ngx_statshouse_aggregate_pt handler, void *ctx)
+{
+    ngx_statshouse_dense_key_t  *key;
+    ngx_statshouse_stat_t        stat;
+    ngx_str_t                    keys[NGX_STATSHOUSE_STAT_KEYS_MAX];
+    ngx_uint_t                   i, j, n;
+    ngx_int_t                    count = 0;
+
+    for (i = 0; i < dense->ncells; i++) {
+        if (dense->cells[i] == 0) {
+            continue;
+        }
+
+        ngx_statshouse_stat_init(&stat, dense->name, ngx_statshouse_mt_counter, keys);
+        ngx_statshouse_stat_value_counter(&stat, 0);
+
+        stat.values[0].counter = dense->cells[i];
+        dense->cells[i] = 0;
+
+        for (j = 0; j < dense->nkeys; j++) {
+            key = &dense->keys[j];
+            n = (i / key->stride) % (key->nvalues + 2);
+
+            if (n == ngx_statshouse_dense_key_empty(key)) {
+                continue;
+            }
+
+            if (n == ngx_statshouse_dense_key_other(key)) {
+                ngx_statshouse_stat_key(&stat, key->index, key->other);
+                continue;
+            }
+
+            ngx_statshouse_stat_key(&stat, key->index, key->values[n]);
+        }
+
+        if (handler(&stat, ctx) == NGX_OK) {
+            count++;
+        }
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, ngx_cycle->log, 0,
+        "statshouse dense \"%V\", flush %i stats", &dense->name, count);
+
+    return count ? NGX_OK : NGX_DECLINED;
+}
@@ -0,0 +1,46 @@
+/* Copyright 2022 V Kontakte LLC
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef _NGX_STATSHOUSE_DENSE_H_INCLUDED_
+#define _NGX_STATSHOUSE_DENSE_H_INCLUDED_
+
+#include <ngx_core.h>
+#include <ngx_statshouse_stat.h>
+
+#include "ngx_statshouse_aggregate.h"
+
+
+#define NGX_STATSHOUSE_DENSE_CELLS_MAX   16384
+
+
+typedef struct {
+    ngx_uint_t                    index;
+
+    ngx_str_t                    *values;
+    ngx_uint_t                    nvalues;
+    ngx_str_t                     other;
+
+    ngx_uint_t                    stride;
+} ngx_statshouse_dense_key_t;
+
+typedef struct {
+    ngx_str_t                     name;
+
+    ngx_statshouse_dense_key_t   *keys;
+    ngx_uint_t                    nkeys;
+
+    double                       *cells;
+    ngx_uint_t                    ncells;
+} ngx_statshouse_dense_t;
+
+
+ngx_int_t  ngx_statshouse_dense_init(ngx_statshouse_dense_t *dense, ngx_pool_t *pool);
+ngx_int_t  ngx_statshouse_dense_key(ngx_statshouse_dense_key_t *key, ngx_str_t *value);
+ngx_int_t  ngx_statshouse_dense_process(ngx_statshouse_dense_t *dense,
+    ngx_statshouse_aggregate_pt handler, void *ctx);
+
+#endif
@@ -0,0 +1,129 @@
+/* Copyright 2022 V Kontakte LLC
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include <ngx_core.h>
+
+#include "ngx_statshouse_intern.h"
+
+
+#define NGX_STATSHOUSE_INTERN_VALUE_AVG  16
+
+
+ngx_int_t
+ngx_statshouse_intern_init(ngx_statshouse_intern_t *intern, ngx_pool_t *pool)
+{
+    ngx_uint_t  slots;
+
+    if (intern->size == 0) {
+        return NGX_OK;
+    }
+
+    intern->max = intern->size / NGX_STATSHOUSE_INTERN_VALUE_AVG;
+
+    /* keep load factor under 1/2 */
+
+    for (slots = 2; slots < intern->max * 2; slots <<= 1) { /* void */ }
+
+    intern->slots = ngx_pcalloc(pool, sizeof(ngx_statshouse_intern_slot_t) * slots);
+    if (intern->slots == NULL) {
+        return NGX_ERROR;
+    }
+
+    intern->mask = slots - 1;
+
+    intern->values = ngx_palloc(pool, sizeof(ngx_str_t) * intern->max);
+    if (intern->values == NULL) {
+        return NGX_ERROR;
+    }
+
+    intern->alloc.start = ngx_palloc(pool, intern->size);
+    if (intern->alloc.start == NULL) {
+        return NGX_ERROR;
+    }
+
+    intern->alloc.end = intern->alloc.start + intern->size;
+    intern->alloc.pos = intern->alloc.start;
+    intern->alloc.last = intern->alloc.start;
+
+    intern->nelts = 0;
+
+    return NGX_OK;
+}
+
+
+/*
+ * Returns small id (starting from 1) of the value and sets interned to the stored copy,
+ * NGX_STATSHOUSE_INTERN_NONE if the value could not be interned (too long or table is full).
+ */
+
+uint32_t
+ngx_statshouse_intern(ngx_statshouse_intern_t *intern, ngx_str_t *value, ngx_str_t *interned)
+{
+    ngx_statshouse_intern_slot_t  *slot;
+    ngx_str_t                     *v;
+    ngx_uint_t                     i;
+    uint32_t                       hash;
+
+    if (intern->slots == NULL || value->len > NGX_STATSHOUSE_INTERN_VALUE_MAX) {
+        return NGX_STATSHOUSE_INTERN_NONE;
+    }
+
+    hash = ngx_crc32_short(value->data, value->len);
+
+    for (i = hash & intern->mask; /* void */ ; i = (i + 1) & intern->mask) {
+        slot = &intern->slots[i];
+
+        if (slot->id == NGX_STATSHOUSE_INTERN_NONE) {
+            break;
+        }
+
+        if (slot->hash != hash) {
+            continue;
+        }
+
+        v = &intern->values[slot->id - 1];
+
+        if (v->len == value->len && ngx_memcmp(v->data, value->data, value->len) == 0) {
+            *interned = *v;
+            return slot->id;
+        }
+    }
+
+    if (intern->nelts == intern->max
+        || (size_t) (intern->alloc.end - intern->alloc.last) < value->len)
+    {
+        return NGX_STATSHOUSE_INTERN_NONE;
+    }
+
+    v = &intern->values[intern->nelts++];
+
+    v->data = intern->alloc.last;
+    v->len = value->len;
+
+    intern->alloc.last = ngx_cpymem(intern->alloc.last, value->data, value->len);
+
+    slot->hash = hash;
+    slot->id = intern->nelts;
+
+    *interned = *v;
+
+    return slot->id;
+}
+
+
+void
+ngx_statshouse_intern_reset(ngx_statshouse_intern_t *intern)
+{
+    if (intern->slots == NULL || intern->nelts == 0) {
+        return;
+    }
+
+    ngx_memzero(intern->slots, sizeof(ngx_statshouse_intern_slot_t) * (intern->mask + 1));
+
+    intern->alloc.last = intern->alloc.start;
+    intern->nelts = 0;
+}
@@ -0,0 +1,40 @@
+/* Copyright 2022 V Kontakte LLC
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef _NGX_STATSHOUSE_INTERN_H_INCLUDED_
+#define _NGX_STATSHOUSE_INTERN_H_INCLUDED_
+
+#include <ngx_core.h>
+
+
+#define NGX_STATSHOUSE_INTERN_NONE       0
+#define NGX_STATSHOUSE_INTERN_VALUE_MAX  128
+
+
+typedef struct {
+    uint32_t                      hash;
+    uint32_t                      id;
+} ngx_statshouse_intern_slot_t;
+
+typedef struct {
+    ngx_statshouse_intern_slot_t *slots;
+    ngx_uint_t                    mask;
+
+    ngx_str_t                    *values;
+    ngx_uint_t                    nelts;
+    ngx_uint_t                    max;
+
+    ngx_buf_t                     alloc;
+    size_t                        size;
+} ngx_statshouse_intern_t;
+
+
+ngx_int_t  ngx_statshouse_intern_init(ngx_statshouse_intern_t *intern, ngx_pool_t *pool);
+uint32_t  ngx_statshouse_intern(ngx_statshouse_intern_t *intern, ngx_str_t *value, ngx_str_t *interned);
+void  ngx_statshouse_intern_reset(ngx_statshouse_intern_t *intern);
+
+#endif
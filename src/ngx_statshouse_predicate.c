@@ -0,0 +1,632 @@
+/* Copyright 2022 V Kontakte LLC
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include <ngx_core.h>
+
+#include "ngx_statshouse_predicate.h"
+
+
+/*
+ * Condition is a list of terms, all of them must be true:
+ *
+ *     condition $ssl_protocol;
+ *     condition $status >= 500 or $request_time > 1s;
+ *     condition $request_method in GET,HEAD and not ($status in 300..399);
+ *
+ * A term is an operand, true unless empty or "0", or an operand compared
+ * with a literal: = != < <= > >= or "in" list of numbers, ranges "a..b"
+ * or strings, numbers are parsed by ngx_statshouse_parse_number().  Terms
+ * are combined with "not", "and", "or" and parentheses, adjacent terms are
+ * joined with "and".  Evaluation stops as soon as the result is known.
+ */
+
+
+typedef struct {
+    ngx_conf_t                           *cf;
+    ngx_str_t                            *tokens;
+    ngx_uint_t                            ntokens;
+    ngx_uint_t                            pos;
+    ngx_statshouse_predicate_operand_pt   operand;
+} ngx_statshouse_predicate_parser_t;
+
+
+static ngx_array_t  *ngx_statshouse_predicate_tokens(ngx_conf_t *cf, ngx_array_t *strings);
+static ngx_statshouse_predicate_t  *ngx_statshouse_predicate_or(ngx_statshouse_predicate_parser_t *p);
+static ngx_statshouse_predicate_t  *ngx_statshouse_predicate_and(ngx_statshouse_predicate_parser_t *p);
+static ngx_statshouse_predicate_t  *ngx_statshouse_predicate_unary(ngx_statshouse_predicate_parser_t *p);
+static ngx_statshouse_predicate_t  *ngx_statshouse_predicate_term(ngx_statshouse_predicate_parser_t *p);
+static ngx_int_t  ngx_statshouse_predicate_list(ngx_statshouse_predicate_parser_t *p,
+    ngx_statshouse_predicate_t *pr, ngx_str_t *list);
+static ngx_statshouse_predicate_t  *ngx_statshouse_predicate_node(ngx_statshouse_predicate_parser_t *p,
+    ngx_statshouse_predicate_op_e op, ngx_statshouse_predicate_t *left, ngx_statshouse_predicate_t *right);
+static u_char    *ngx_statshouse_predicate_range(u_char *s, u_char *end);
+static ngx_int_t  ngx_statshouse_predicate_is(ngx_statshouse_predicate_parser_t *p, char *word);
+static ngx_int_t  ngx_statshouse_predicate_operand(ngx_statshouse_predicate_t *pr,
+    ngx_statshouse_complex_value_pt complex, void *complex_ctx, ngx_str_t *value, double *number);
+
+
+static ngx_str_t  ngx_statshouse_predicate_ops[] = {
+    ngx_null_string,
+    ngx_string("="),
+    ngx_string("!="),
+    ngx_string("<"),
+    ngx_string("<="),
+    ngx_string(">"),
+    ngx_string(">="),
+    ngx_string("in"),
+};
+
+
+ngx_statshouse_predicate_t *
+ngx_statshouse_predicate_compile(ngx_conf_t *cf, ngx_array_t *strings,
+    ngx_statshouse_predicate_operand_pt operand)
+{
+    ngx_statshouse_predicate_parser_t   p;
+    ngx_statshouse_predicate_t         *pr;
+    ngx_array_t                        *tokens;
+
+    tokens = ngx_statshouse_predicate_tokens(cf, strings);
+    if (tokens == NULL) {
+        return NULL;
+    }
+
+    p.cf = cf;
+    p.tokens = tokens->elts;
+    p.ntokens = tokens->nelts;
+    p.pos = 0;
+    p.operand = operand;
+
+    pr = ngx_statshouse_predicate_or(&p);
+    if (pr == NULL) {
+        return NULL;
+    }
+
+    if (p.pos != p.ntokens) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "unexpected \"%V\" in condition", &p.tokens[p.pos]);
+        return NULL;
+    }
+
+    return pr;
+}
+
+
+/* "(", ")" and "!" may be written without spaces */
+
+static ngx_array_t *
+ngx_statshouse_predicate_tokens(ngx_conf_t *cf, ngx_array_t *strings)
+{
+    ngx_array_t  *tokens;
+    ngx_str_t    *s, *t, v;
+    ngx_uint_t    i, close;
+
+    tokens = ngx_array_create(cf->pool, strings->nelts * 2, sizeof(ngx_str_t));
+    if (tokens == NULL) {
+        return NULL;
+    }
+
+    s = strings->elts;
+
+    for (i = 0; i < strings->nelts; i++) {
+        v = s[i];
+
+        while (v.len > 1
+               && (v.data[0] == '(' || (v.data[0] == '!' && v.data[1] != '=')))
+        {
+            t = ngx_array_push(tokens);
+            if (t == NULL) {
+                return NULL;
+            }
+
+            t->data = v.data;
+            t->len = 1;
+
+            v.data++;
+            v.len--;
+        }
+
+        for (close = 0; v.len > 1 && v.data[v.len - 1] == ')'; close++) {
+            v.len--;
+        }
+
+        t = ngx_array_push(tokens);
+        if (t == NULL) {
+            return NULL;
+        }
+
+        *t = v;
+
+        while (close--) {
+            t = ngx_array_push(tokens);
+            if (t == NULL) {
+                return NULL;
+            }
+
+            t->data = v.data + v.len + close;
+            t->len = 1;
+        }
+    }
+
+    return tokens;
+}
+
+
+static ngx_statshouse_predicate_t *
+ngx_statshouse_predicate_or(ngx_statshouse_predicate_parser_t *p)
+{
+    ngx_statshouse_predicate_t  *pr, *right;
+
+    pr = ngx_statshouse_predicate_and(p);
+    if (pr == NULL) {
+        return NULL;
+    }
+
+    while (ngx_statshouse_predicate_is(p, "or") || ngx_statshouse_predicate_is(p, "||")) {
+        p->pos++;
+
+        right = ngx_statshouse_predicate_and(p);
+        if (right == NULL) {
+            return NULL;
+        }
+
+        pr = ngx_statshouse_predicate_node(p, ngx_statshouse_pr_or, pr, right);
+        if (pr == NULL) {
+            return NULL;
+        }
+    }
+
+    return pr;
+}
+
+
+static ngx_statshouse_predicate_t *
+ngx_statshouse_predicate_and(ngx_statshouse_predicate_parser_t *p)
+{
+    ngx_statshouse_predicate_t  *pr, *right;
+
+    pr = ngx_statshouse_predicate_unary(p);
+    if (pr == NULL) {
+        return NULL;
+    }
+
+    while (p->pos < p->ntokens) {
+        if (ngx_statshouse_predicate_is(p, "or") || ngx_statshouse_predicate_is(p, "||")
+            || ngx_statshouse_predicate_is(p, ")"))
+        {
+            break;
+        }
+
+        if (ngx_statshouse_predicate_is(p, "and") || ngx_statshouse_predicate_is(p, "&&")) {
+            p->pos++;
+        }
+
+        right = ngx_statshouse_predicate_unary(p);
+        if (right == NULL) {
+            return NULL;
+        }
+
+        pr = ngx_statshouse_predicate_node(p, ngx_statshouse_pr_and, pr, right);
+        if (pr == NULL) {
+            return NULL;
+        }
+    }
+
+    return pr;
+}
+
+
+static ngx_statshouse_predicate_t *
+ngx_statshouse_predicate_unary(ngx_statshouse_predicate_parser_t *p)
+{
+    ngx_statshouse_predicate_t  *pr;
+
+    if (p->pos == p->ntokens) {
+        ngx_conf_log_error(NGX_LOG_EMERG, p->cf, 0, "unexpected end of condition");
+        return NULL;
+    }
+
+    if (ngx_statshouse_predicate_is(p, "not") || ngx_statshouse_predicate_is(p, "!")) {
+        p->pos++;
+
+        pr = ngx_statshouse_predicate_unary(p);
+        if (pr == NULL) {
+            return NULL;
+        }
+
+        return ngx_statshouse_predicate_node(p, ngx_statshouse_pr_not, pr, NULL);
+    }
+
+    if (ngx_statshouse_predicate_is(p, "(")) {
+        p->pos++;
+
+        pr = ngx_statshouse_predicate_or(p);
+        if (pr == NULL) {
+            return NULL;
+        }
+
+        if (!ngx_statshouse_predicate_is(p, ")")) {
+            ngx_conf_log_error(NGX_LOG_EMERG, p->cf, 0, "missing \")\" in condition");
+            return NULL;
+        }
+
+        p->pos++;
+
+        return pr;
+    }
+
+    return ngx_statshouse_predicate_term(p);
+}
+
+
+static ngx_statshouse_predicate_t *
+ngx_statshouse_predicate_term(ngx_statshouse_predicate_parser_t *p)
+{
+    ngx_statshouse_predicate_t     *pr;
+    ngx_statshouse_predicate_op_e   op;
+    ngx_str_t                      *value, *literal;
+
+    pr = ngx_statshouse_predicate_node(p, ngx_statshouse_pr_true, NULL, NULL);
+    if (pr == NULL) {
+        return NULL;
+    }
+
+    value = &p->tokens[p->pos++];
+
+    if (value->len == 1 && value->data[0] == ')') {
+        ngx_conf_log_error(NGX_LOG_EMERG, p->cf, 0, "unexpected \")\" in condition");
+        return NULL;
+    }
+
+    pr->complex = p->operand(p->cf, value, &pr->accessor);
+    if (pr->complex == NULL) {
+        return NULL;
+    }
+
+    if (p->pos == p->ntokens) {
+        return pr;
+    }
+
+    for (op = ngx_statshouse_pr_eq; op <= ngx_statshouse_pr_in; op++) {
+        if (ngx_statshouse_predicate_ops[op].len == p->tokens[p->pos].len
+            && ngx_strncmp(ngx_statshouse_predicate_ops[op].data, p->tokens[p->pos].data,
+                           p->tokens[p->pos].len) == 0)
+        {
+            break;
+        }
+    }
+
+    if (op > ngx_statshouse_pr_in) {
+        if (ngx_statshouse_predicate_is(p, "==")) {
+            op = ngx_statshouse_pr_eq;
+
+        } else {
+            return pr;
+        }
+    }
+
+    p->pos++;
+
+    if (p->pos == p->ntokens) {
+        ngx_conf_log_error(NGX_LOG_EMERG, p->cf, 0,
+            "missing value after \"%V\" in condition", &p->tokens[p->pos - 1]);
+        return NULL;
+    }
+
+    literal = &p->tokens[p->pos++];
+
+    if (ngx_strlchr(literal->data, literal->data + literal->len, '$') != NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, p->cf, 0,
+            "variable \"%V\" is not supported after \"%V\" in condition",
+            literal, &p->tokens[p->pos - 2]);
+        return NULL;
+    }
+
+    pr->op = op;
+
+    if (op == ngx_statshouse_pr_in) {
+        if (ngx_statshouse_predicate_list(p, pr, literal) != NGX_OK) {
+            return NULL;
+        }
+
+        return pr;
+    }
+
+    pr->string = *literal;
+
+    if (ngx_statshouse_parse_number(literal->data, literal->len, &pr->number) == NGX_OK) {
+        pr->numeric = 1;
+
+    } else if (op != ngx_statshouse_pr_eq && op != ngx_statshouse_pr_ne) {
+        ngx_conf_log_error(NGX_LOG_EMERG, p->cf, 0,
+            "invalid number \"%V\" in condition", literal);
+        return NULL;
+    }
+
+    return pr;
+}
+
+
+/* "500..599,404" or "GET,HEAD" */
+
+static ngx_int_t
+ngx_statshouse_predicate_list(ngx_statshouse_predicate_parser_t *p,
+    ngx_statshouse_predicate_t *pr, ngx_str_t *list)
+{
+    ngx_statshouse_predicate_item_t  *item;
+    u_char                           *s, *end, *comma, *dots;
+    ngx_uint_t                        n;
+
+    end = list->data + list->len;
+
+    for (n = 1, s = list->data; s < end; s++) {
+        if (*s == ',') {
+            n++;
+        }
+    }
+
+    pr->items = ngx_pcalloc(p->cf->pool, sizeof(ngx_statshouse_predicate_item_t) * n);
+    if (pr->items == NULL) {
+        return NGX_ERROR;
+    }
+
+    pr->numeric = 1;
+
+    for (s = list->data; s <= end; s = comma + 1) {
+        comma = ngx_strlchr(s, end, ',');
+        if (comma == NULL) {
+            comma = end;
+        }
+
+        item = &pr->items[pr->nitems++];
+
+        item->string.data = s;
+        item->string.len = comma - s;
+
+        if (item->string.len == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, p->cf, 0,
+                "empty item in list \"%V\" in condition", list);
+            return NGX_ERROR;
+        }
+
+        dots = ngx_statshouse_predicate_range(s, comma);
+
+        if (dots != NULL) {
+            if (ngx_statshouse_parse_number(s, dots - s, &item->min) != NGX_OK
+                || ngx_statshouse_parse_number(dots + 2, comma - dots - 2, &item->max) != NGX_OK
+                || item->min > item->max)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, p->cf, 0,
+                    "invalid range \"%V\" in condition", &item->string);
+                return NGX_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_statshouse_parse_number(s, comma - s, &item->min) == NGX_OK) {
+            item->max = item->min;
+            continue;
+        }
+
+        pr->numeric = 0;
+    }
+
+    if (pr->numeric) {
+        return NGX_OK;
+    }
+
+    for (n = 0; n < pr->nitems; n++) {
+        if (ngx_statshouse_predicate_range(pr->items[n].string.data,
+                                           pr->items[n].string.data + pr->items[n].string.len)
+            != NULL)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, p->cf, 0,
+                "range \"%V\" in list of strings in condition", &pr->items[n].string);
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_statshouse_predicate_t *
+ngx_statshouse_predicate_node(ngx_statshouse_predicate_parser_t *p,
+    ngx_statshouse_predicate_op_e op, ngx_statshouse_predicate_t *left, ngx_statshouse_predicate_t *right)
+{
+    ngx_statshouse_predicate_t  *pr;
+
+    pr = ngx_pcalloc(p->cf->pool, sizeof(ngx_statshouse_predicate_t));
+    if (pr == NULL) {
+        return NULL;
+    }
+
+    pr->op = op;
+    pr->left = left;
+    pr->right = right;
+
+    return pr;
+}
+
+
+static u_char *
+ngx_statshouse_predicate_range(u_char *s, u_char *end)
+{
+    for ( ;; ) {
+        s = ngx_strlchr(s, end, '.');
+        if (s == NULL || s + 1 == end) {
+            return NULL;
+        }
+
+        if (s[1] == '.') {
+            return s;
+        }
+
+        s++;
+    }
+}
+
+
+static ngx_int_t
+ngx_statshouse_predicate_is(ngx_statshouse_predicate_parser_t *p, char *word)
+{
+    size_t  len;
+
+    if (p->pos == p->ntokens) {
+        return 0;
+    }
+
+    len = ngx_strlen(word);
+
+    return p->tokens[p->pos].len == len
+           && ngx_strncmp(p->tokens[p->pos].data, word, len) == 0;
+}
+
+
+ngx_int_t
+ngx_statshouse_predicate_test(ngx_statshouse_predicate_t *pr,
+    ngx_statshouse_complex_value_pt complex, void *complex_ctx)
+{
+    ngx_statshouse_predicate_item_t  *item;
+    ngx_int_t                         rc;
+    ngx_uint_t                        i;
+    ngx_str_t                         value;
+    double                            number;
+
+    switch (pr->op) {
+
+    case ngx_statshouse_pr_and:
+        rc = ngx_statshouse_predicate_test(pr->left, complex, complex_ctx);
+        if (rc != NGX_OK) {
+            return rc;
+        }
+
+        return ngx_statshouse_predicate_test(pr->right, complex, complex_ctx);
+
+    case ngx_statshouse_pr_or:
+        rc = ngx_statshouse_predicate_test(pr->left, complex, complex_ctx);
+        if (rc != NGX_DECLINED) {
+            return rc;
+        }
+
+        return ngx_statshouse_predicate_test(pr->right, complex, complex_ctx);
+
+    case ngx_statshouse_pr_not:
+        rc = ngx_statshouse_predicate_test(pr->left, complex, complex_ctx);
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        return rc == NGX_OK ? NGX_DECLINED : NGX_OK;
+
+    case ngx_statshouse_pr_true:
+        if (complex(complex_ctx, pr->complex, &value) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        if (value.len == 0 || (value.len == 1 && value.data[0] == '0')) {
+            return NGX_DECLINED;
+        }
+
+        return NGX_OK;
+
+    default:
+        break;
+    }
+
+    rc = ngx_statshouse_predicate_operand(pr, complex, complex_ctx, &value, &number);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    switch (pr->op) {
+
+    case ngx_statshouse_pr_eq:
+        if (pr->numeric) {
+            rc = (number == pr->number);
+        } else {
+            rc = (value.len == pr->string.len && ngx_memcmp(value.data, pr->string.data, value.len) == 0);
+        }
+        break;
+
+    case ngx_statshouse_pr_ne:
+        if (pr->numeric) {
+            rc = (number != pr->number);
+        } else {
+            rc = (value.len != pr->string.len || ngx_memcmp(value.data, pr->string.data, value.len) != 0);
+        }
+        break;
+
+    case ngx_statshouse_pr_lt:
+        rc = (number < pr->number);
+        break;
+
+    case ngx_statshouse_pr_le:
+        rc = (number <= pr->number);
+        break;
+
+    case ngx_statshouse_pr_gt:
+        rc = (number > pr->number);
+        break;
+
+    case ngx_statshouse_pr_ge:
+        rc = (number >= pr->number);
+        break;
+
+    default: /* ngx_statshouse_pr_in */
+        rc = 0;
+
+        for (i = 0; i < pr->nitems; i++) {
+            item = &pr->items[i];
+
+            if (pr->numeric) {
+                rc = (number >= item->min && number <= item->max);
+
+            } else {
+                rc = (value.len == item->string.len
+                      && ngx_memcmp(value.data, item->string.data, value.len) == 0);
+            }
+
+            if (rc) {
+                break;
+            }
+        }
+    }
+
+    return rc ? NGX_OK : NGX_DECLINED;
+}
+
+
+/* NGX_DECLINED if there is no value or it is not a number */
+
+static ngx_int_t
+ngx_statshouse_predicate_operand(ngx_statshouse_predicate_t *pr,
+    ngx_statshouse_complex_value_pt complex, void *complex_ctx, ngx_str_t *value, double *number)
+{
+    ngx_int_t  rc;
+
+    if (pr->numeric && pr->accessor) {
+        rc = pr->accessor(complex_ctx, number);
+        if (rc != NGX_AGAIN) {
+            return rc;
+        }
+    }
+
+    if (complex(complex_ctx, pr->complex, value) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (!pr->numeric) {
+        return NGX_OK;
+    }
+
+    if (value->len == 0 || ngx_statshouse_parse_number(value->data, value->len, number) != NGX_OK) {
+        return NGX_DECLINED;
+    }
+
+    return NGX_OK;
+}
@@ -0,0 +1,67 @@
+/* Copyright 2022 V Kontakte LLC
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef _NGX_STATSHOUSE_PREDICATE_H_INCLUDED_
+#define _NGX_STATSHOUSE_PREDICATE_H_INCLUDED_
+
+#include <ngx_core.h>
+
+#include "ngx_statshouse.h"
+
+
+typedef enum {
+    ngx_statshouse_pr_true = 0,
+    ngx_statshouse_pr_eq,
+    ngx_statshouse_pr_ne,
+    ngx_statshouse_pr_lt,
+    ngx_statshouse_pr_le,
+    ngx_statshouse_pr_gt,
+    ngx_statshouse_pr_ge,
+    ngx_statshouse_pr_in,
+    ngx_statshouse_pr_not,
+    ngx_statshouse_pr_and,
+    ngx_statshouse_pr_or,
+} ngx_statshouse_predicate_op_e;
+
+/* item of "in" list: number range or string */
+typedef struct {
+    double                               min;
+    double                               max;
+    ngx_str_t                            string;
+} ngx_statshouse_predicate_item_t;
+
+struct ngx_statshouse_predicate_s {
+    ngx_statshouse_predicate_op_e        op;
+
+    /* operand, compiled by module */
+    void                                *complex;
+    ngx_statshouse_number_value_pt       accessor;
+
+    /* literal, compared as number if numeric */
+    ngx_flag_t                           numeric;
+    double                               number;
+    ngx_str_t                            string;
+
+    ngx_statshouse_predicate_item_t     *items;
+    ngx_uint_t                           nitems;
+
+    ngx_statshouse_predicate_t          *left;
+    ngx_statshouse_predicate_t          *right;
+};
+
+
+/* compiles operand string, sets native getter if variable has one */
+typedef void *(*ngx_statshouse_predicate_operand_pt)(ngx_conf_t *cf, ngx_str_t *value,
+    ngx_statshouse_number_value_pt *accessor);
+
+
+ngx_statshouse_predicate_t  *ngx_statshouse_predicate_compile(ngx_conf_t *cf, ngx_array_t *tokens,
+    ngx_statshouse_predicate_operand_pt operand);
+ngx_int_t  ngx_statshouse_predicate_test(ngx_statshouse_predicate_t *pr,
+    ngx_statshouse_complex_value_pt complex, void *complex_ctx);
+
+#endif
@@ -0,0 +1,175 @@
+/* Copyright 2022 V Kontakte LLC
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include <ngx_core.h>
+
+#include "ngx_statshouse_rate.h"
+
+
+/*
+ * Token bucket per key tuple hash in a small set-associative table.
+ * A tuple without a free way evicts the bucket with the least suppressed
+ * events, so rare tuples get their own bucket and are not limited.
+ * Suppressed events of evicted buckets are kept in dropped and sent
+ * once per window. Hash 0 marks an empty bucket.
+ */
+
+
+ngx_int_t
+ngx_statshouse_rate_init(ngx_statshouse_rate_t *rate, ngx_pool_t *pool)
+{
+    rate->buckets = ngx_pcalloc(pool, sizeof(ngx_statshouse_rate_bucket_t)
+                                      * NGX_STATSHOUSE_RATE_SETS * NGX_STATSHOUSE_RATE_WAYS);
+    if (rate->buckets == NULL) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * Returns NGX_OK and number of events the passed one stands for in
+ * weight (1 + suppressed since last passed), NGX_BUSY if suppressed.
+ */
+
+ngx_int_t
+ngx_statshouse_rate(ngx_statshouse_rate_t *rate, uint32_t hash, ngx_msec_t now,
+    ngx_uint_t *weight)
+{
+    ngx_statshouse_rate_bucket_t  *set, *bucket;
+    ngx_msec_int_t                 ms;
+    ngx_int_t                      excess;
+    ngx_uint_t                     i;
+
+    if (hash == 0) {
+        hash = 1;
+    }
+
+    set = &rate->buckets[(hash % NGX_STATSHOUSE_RATE_SETS) * NGX_STATSHOUSE_RATE_WAYS];
+    bucket = NULL;
+
+    for (i = 0; i < NGX_STATSHOUSE_RATE_WAYS; i++) {
+        if (set[i].hash == hash) {
+            bucket = &set[i];
+            break;
+        }
+    }
+
+    if (bucket == NULL) {
+        bucket = &set[0];
+
+        for (i = 1; i < NGX_STATSHOUSE_RATE_WAYS; i++) {
+            if (set[i].suppressed < bucket->suppressed
+                || (set[i].suppressed == bucket->suppressed
+                    && (ngx_msec_int_t) (set[i].last - bucket->last) < 0))
+            {
+                bucket = &set[i];
+            }
+        }
+
+        rate->dropped += bucket->suppressed;
+
+        bucket->hash = hash;
+        bucket->last = now;
+        bucket->excess = 0;
+        bucket->suppressed = 0;
+
+        *weight = 1;
+
+        return NGX_OK;
+    }
+
+    ms = (ngx_msec_int_t) (now - bucket->last);
+
+    if (ms < 0) {
+        ms = 0;
+    }
+
+    excess = bucket->excess - rate->rate * ms / 1000 + 1000;
+
+    if (excess < 0) {
+        excess = 0;
+    }
+
+    if ((ngx_uint_t) excess > rate->burst) {
+        bucket->suppressed++;
+        return NGX_BUSY;
+    }
+
+    bucket->excess = excess;
+    bucket->last = now;
+
+    *weight = 1 + bucket->suppressed;
+    bucket->suppressed = 0;
+
+    return NGX_OK;
+}
+
+
+/*
+ * A bucket that has not passed an event for one token period has no
+ * incoming events, its suppressed events would be kept until the tuple
+ * comes back. They are moved to dropped, all of them on worker shutdown.
+ * Dropped events are sent under the metric name in key1, scaled by the
+ * sampling weight of the metric. Returns NGX_AGAIN if suppressed events
+ * remain in buckets.
+ */
+
+ngx_int_t
+ngx_statshouse_rate_process(ngx_statshouse_rate_t *rate, ngx_msec_t now, double weight,
+    ngx_statshouse_aggregate_pt handler, void *ctx)
+{
+    ngx_statshouse_rate_bucket_t  *bucket;
+    ngx_statshouse_stat_t          stat;
+    ngx_str_t                      keys[1];
+    ngx_str_t                      name;
+    ngx_msec_t                     period;
+    ngx_uint_t                     i, flush;
+    ngx_int_t                      rc;
+
+    flush = ngx_terminate || ngx_exiting;
+    period = 1000 * 1000 / rate->rate;
+    rc = NGX_OK;
+
+    for (i = 0; i < NGX_STATSHOUSE_RATE_SETS * NGX_STATSHOUSE_RATE_WAYS; i++) {
+        bucket = &rate->buckets[i];
+
+        if (bucket->suppressed == 0) {
+            continue;
+        }
+
+        if (!flush && (ngx_msec_int_t) (now - bucket->last) < (ngx_msec_int_t) period) {
+            rc = NGX_AGAIN;
+            continue;
+        }
+
+        rate->dropped += bucket->suppressed;
+        bucket->suppressed = 0;
+    }
+
+    if (rate->dropped == 0) {
+        return rc;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, ngx_cycle->log, 0,
+        "statshouse rate \"%V\", dropped %ui", &rate->name, rate->dropped);
+
+    ngx_str_set(&name, NGX_STATSHOUSE_RATE_METRIC);
+
+    ngx_statshouse_stat_init(&stat, name, ngx_statshouse_mt_counter, keys);
+    ngx_statshouse_stat_value_counter(&stat, 0);
+    ngx_statshouse_stat_key(&stat, 1, rate->name);
+
+    stat.values[0].counter = rate->dropped * weight;
+
+    handler(&stat, ctx);
+
+    rate->dropped = 0;
+
+    return rc;
+}
@@ -0,0 +1,53 @@
+/* Copyright 2022 V Kontakte LLC
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef _NGX_STATSHOUSE_RATE_H_INCLUDED_
+#define _NGX_STATSHOUSE_RATE_H_INCLUDED_
+
+#include <ngx_core.h>
+#include <ngx_statshouse_stat.h>
+
+#include "ngx_statshouse_aggregate.h"
+
+
+#define NGX_STATSHOUSE_RATE_SETS       256
+#define NGX_STATSHOUSE_RATE_WAYS       4
+
+#define NGX_STATSHOUSE_RATE_METRIC     "nginx_statshouse_rate_dropped"
+
+
+typedef struct {
+    uint32_t                       hash;
+    ngx_msec_t                     last;
+
+    /* in 0.001 of event, as in limit_req */
+    ngx_int_t                      excess;
+
+    ngx_uint_t                     suppressed;
+} ngx_statshouse_rate_bucket_t;
+
+typedef struct {
+    ngx_str_t                      name;
+
+    ngx_statshouse_rate_bucket_t  *buckets;
+
+    /* events per second * 1000 */
+    ngx_uint_t                     rate;
+    ngx_uint_t                     burst;
+
+    /* suppressed events of evicted or idle tuples */
+    ngx_uint_t                     dropped;
+} ngx_statshouse_rate_t;
+
+
+ngx_int_t  ngx_statshouse_rate_init(ngx_statshouse_rate_t *rate, ngx_pool_t *pool);
+ngx_int_t  ngx_statshouse_rate(ngx_statshouse_rate_t *rate, uint32_t hash, ngx_msec_t now,
+    ngx_uint_t *weight);
+ngx_int_t  ngx_statshouse_rate_process(ngx_statshouse_rate_t *rate, ngx_msec_t now, double weight,
+    ngx_statshouse_aggregate_pt handler, void *ctx);
+
+#endif
@@ -9,13 +9,33 @@
 #include <ngx_statshouse_stat.h>
 
 
+static ngx_str_t  ngx_statshouse_stat_key_names[NGX_STATSHOUSE_STAT_KEYS_MAX] = {
+    ngx_string("0"), ngx_string("1"), ngx_string("2"), ngx_string("3"),
+    ngx_string("4"), ngx_string("5"), ngx_string("6"), ngx_string("7"),
+    ngx_string("8"), ngx_string("9"), ngx_string("10"), ngx_string("11"),
+    ngx_string("12"), ngx_string("13"), ngx_string("14"), ngx_string("15"),
+    ngx_string("16"), ngx_string("17"), ngx_string("18"), ngx_string("19"),
+    ngx_string("20"), ngx_string("21"), ngx_string("22"), ngx_string("23"),
+    ngx_string("24"), ngx_string("25"), ngx_string("26"), ngx_string("27"),
+    ngx_string("28"), ngx_string("29"), ngx_string("30"), ngx_string("31"),
+    ngx_string("32"), ngx_string("33"), ngx_string("34"), ngx_string("35"),
+    ngx_string("36"), ngx_string("37"), ngx_string("38"), ngx_string("39"),
+    ngx_string("40"), ngx_string("41"), ngx_string("42"), ngx_string("43"),
+    ngx_string("44"), ngx_string("45"), ngx_string("46"), ngx_string("47"),
+    ngx_string("_s")
+};
+
+
 void
-ngx_statshouse_stat_init(ngx_statshouse_stat_t *stat, ngx_str_t name, ngx_statshouse_stat_type_e type)
+ngx_statshouse_stat_init(ngx_statshouse_stat_t *stat, ngx_str_t name, ngx_statshouse_stat_type_e type,
+    ngx_str_t *keys)
 {
     stat->name = name;
     stat->type = type;
 
-    stat->keys_count = 0;
+    stat->keys_mask = 0;
+    stat->keys = keys;
+    stat->count = 0;
     stat->values_count = 0;
 }
 
@@ -62,13 +82,51 @@ ngx_statshouse_stat_value_unique(ngx_statshouse_stat_t *stat, double unique)
 }
 
 
+/*
+ * Weight is the number of events a sampled stat stands for: counter is
+ * multiplied, values are sent with the count of events.
+ */
+
 void
-ngx_statshouse_stat_key(ngx_statshouse_stat_t *stat, ngx_str_t name, ngx_str_t value)
+ngx_statshouse_stat_weight(ngx_statshouse_stat_t *stat, double weight)
 {
-    ngx_statshouse_stat_key_t  *key;
+    if (stat->type == ngx_statshouse_mt_counter) {
+        stat->values[0].counter *= weight;
+        return;
+    }
 
-    key = &stat->keys[stat->keys_count++];
+    stat->count = ngx_statshouse_stat_count(stat) * weight;
+}
+
+
+void
+ngx_statshouse_stat_key(ngx_statshouse_stat_t *stat, ngx_uint_t index, ngx_str_t value)
+{
+    uint64_t    bit;
+    ngx_uint_t  n, count;
 
-    key->name = name;
-    key->value = value;
+    bit = (uint64_t) 1 << index;
+    n = ngx_statshouse_stat_popcount(stat->keys_mask & (bit - 1));
+
+    if (stat->keys_mask & bit) {
+        stat->keys[n] = value;
+        return;
+    }
+
+    /* keys are usually set in index order, so nothing is moved */
+
+    count = ngx_statshouse_stat_popcount(stat->keys_mask);
+    if (n < count) {
+        ngx_memmove(&stat->keys[n + 1], &stat->keys[n], (count - n) * sizeof(ngx_str_t));
+    }
+
+    stat->keys[n] = value;
+    stat->keys_mask |= bit;
+}
+
+
+ngx_str_t *
+ngx_statshouse_stat_key_name(ngx_uint_t index)
+{
+    return &ngx_statshouse_stat_key_names[index];
 }
@@ -31,6 +31,12 @@ static void  ngx_statshouse_tl_double(ngx_buf_t *buf, double n);
 
 static size_t  ngx_statshouse_tl_metric_len(const ngx_statshouse_stat_t *stat);
 static void  ngx_statshouse_tl_metric(ngx_buf_t *buf, const ngx_statshouse_stat_t *stat);
+static size_t  ngx_statshouse_tl_metric_head_len(const ngx_statshouse_stat_t *stat);
+static void  ngx_statshouse_tl_metric_head(ngx_buf_t *buf, const ngx_statshouse_stat_t *stat);
+static size_t  ngx_statshouse_tl_keys_len(const ngx_statshouse_stat_t *stat);
+static void  ngx_statshouse_tl_keys(ngx_buf_t *buf, const ngx_statshouse_stat_t *stat);
+static size_t  ngx_statshouse_tl_values_len(const ngx_statshouse_stat_t *stat);
+static void  ngx_statshouse_tl_values(ngx_buf_t *buf, const ngx_statshouse_stat_t *stat);
 
 
 static size_t
@@ -153,65 +159,134 @@ ngx_statshouse_tl_double(ngx_buf_t *buf, double n)
 static size_t
 ngx_statshouse_tl_metric_len(const ngx_statshouse_stat_t *stat)
 {
-    size_t     len;
-    ngx_int_t  i;
+    return ngx_statshouse_tl_metric_head_len(stat)
+           + ngx_statshouse_tl_keys_len(stat)
+           + ngx_statshouse_tl_values_len(stat);
+}
+
+
+static void
+ngx_statshouse_tl_metric(ngx_buf_t *buf, const ngx_statshouse_stat_t *stat)
+{
+    ngx_statshouse_tl_metric_head(buf, stat);
+    ngx_statshouse_tl_keys(buf, stat);
+    ngx_statshouse_tl_values(buf, stat);
+}
+
+
+static size_t
+ngx_statshouse_tl_metric_head_len(const ngx_statshouse_stat_t *stat)
+{
+    size_t  len;
 
     len = ngx_statshouse_tl_int32_len(); // fieldmask
     len += ngx_statshouse_tl_string_len(&stat->name); // stat name
 
-    len += ngx_statshouse_tl_uint32_len(); // keys count
-    for (i = 0; i < stat->keys_count; i++) {
-        len += ngx_statshouse_tl_string_len(&stat->keys[i].name);
-        len += ngx_statshouse_tl_string_len(&stat->keys[i].value);
-    }
+    return len;
+}
+
+
+static void
+ngx_statshouse_tl_metric_head(ngx_buf_t *buf, const ngx_statshouse_stat_t *stat)
+{
+    uint32_t  field_mask = 0;
 
     switch (stat->type) {
         case ngx_statshouse_mt_counter:
-            len += ngx_statshouse_tl_double_len();
+            field_mask |= (1 << 0);
             break;
 
         case ngx_statshouse_mt_value:
-            len += ngx_statshouse_tl_uint32_len(); // values count
-            len += ngx_statshouse_tl_double_len() * stat->values_count; // values
+            field_mask |= (1 << 1);
             break;
 
         case ngx_statshouse_mt_unique:
-            len += ngx_statshouse_tl_uint32_len(); // unique count
-            len += ngx_statshouse_tl_int64_len() * stat->values_count; // unique
+            field_mask |= (1 << 2);
             break;
     }
 
+    if (stat->count) {
+        field_mask |= (1 << 0);
+    }
+
+    ngx_statshouse_tl_int32(buf, field_mask);
+    ngx_statshouse_tl_string(buf, &stat->name);
+}
+
+
+static size_t
+ngx_statshouse_tl_keys_len(const ngx_statshouse_stat_t *stat)
+{
+    size_t      len;
+    uint64_t    mask;
+    ngx_uint_t  i, n;
+
+    len = ngx_statshouse_tl_uint32_len(); // keys count
+    for (i = 0, n = 0, mask = stat->keys_mask; mask; i++, mask >>= 1) {
+        if (mask & 1) {
+            len += ngx_statshouse_tl_string_len(ngx_statshouse_stat_key_name(i));
+            len += ngx_statshouse_tl_string_len(&stat->keys[n++]);
+        }
+    }
+
     return len;
 }
 
 
 static void
-ngx_statshouse_tl_metric(ngx_buf_t *buf, const ngx_statshouse_stat_t *stat)
+ngx_statshouse_tl_keys(ngx_buf_t *buf, const ngx_statshouse_stat_t *stat)
 {
-    uint32_t   field_mask = 0;
-    ngx_int_t  i;
+    uint64_t    mask;
+    ngx_uint_t  i, n;
+
+    ngx_statshouse_tl_uint32(buf, ngx_statshouse_stat_keys_count(stat));
+    for (i = 0, n = 0, mask = stat->keys_mask; mask; i++, mask >>= 1) {
+        if (mask & 1) {
+            ngx_statshouse_tl_string(buf, ngx_statshouse_stat_key_name(i));
+            ngx_statshouse_tl_string(buf, &stat->keys[n++]);
+        }
+    }
+}
+
+
+static size_t
+ngx_statshouse_tl_values_len(const ngx_statshouse_stat_t *stat)
+{
+    size_t  len;
+
+    len = 0;
+
+    if (stat->type != ngx_statshouse_mt_counter && stat->count) {
+        len += ngx_statshouse_tl_double_len(); // count of weighted values
+    }
 
     switch (stat->type) {
         case ngx_statshouse_mt_counter:
-            field_mask |= (1 << 0);
+            len += ngx_statshouse_tl_double_len();
             break;
 
         case ngx_statshouse_mt_value:
-            field_mask |= (1 << 1);
+            len += ngx_statshouse_tl_uint32_len(); // values count
+            len += ngx_statshouse_tl_double_len() * stat->values_count; // values
             break;
 
         case ngx_statshouse_mt_unique:
-            field_mask |= (1 << 2);
+            len += ngx_statshouse_tl_uint32_len(); // unique count
+            len += ngx_statshouse_tl_int64_len() * stat->values_count; // unique
             break;
     }
 
-    ngx_statshouse_tl_int32(buf, field_mask);
-    ngx_statshouse_tl_string(buf, &stat->name);
+    return len;
+}
 
-    ngx_statshouse_tl_uint32(buf, stat->keys_count);
-    for (i = 0; i < stat->keys_count; i++) {
-        ngx_statshouse_tl_string(buf, &stat->keys[i].name);
-        ngx_statshouse_tl_string(buf, &stat->keys[i].value);
+
+static void
+ngx_statshouse_tl_values(ngx_buf_t *buf, const ngx_statshouse_stat_t *stat)
+{
+    ngx_int_t  i;
+
+    if (stat->type != ngx_statshouse_mt_counter && stat->count) {
+        ngx_statshouse_tl_double(buf, stat->count);
     }
 
     switch (stat->type) {
@@ -228,7 +303,7 @@ ngx_statshouse_tl_metric(ngx_buf_t *buf, const ngx_statshouse_stat_t *stat)
             break;
 
         case ngx_statshouse_mt_unique:
-            ngx_statshouse_tl_uint32(buf, 1);
+            ngx_statshouse_tl_uint32(buf, stat->values_count);
             for (i = 0; i < stat->values_count; i++) {
                 ngx_statshouse_tl_int64(buf, stat->values[i].unique);
             }
@@ -267,3 +342,66 @@ ngx_statshouse_tl_metrics(ngx_buf_t *buf, const ngx_statshouse_stat_t *stat, ngx
         ngx_statshouse_tl_metric(buf, &stat[i]);
     }
 }
+
+
+/* stats of one metric group share keys, their key section is encoded once */
+
+#define ngx_statshouse_tl_same_keys(a, b)                                     \
+    ((a)->keys == (b)->keys && (a)->keys_mask == (b)->keys_mask)
+
+
+size_t
+ngx_statshouse_tl_metrics_list_len(ngx_statshouse_stat_t **stats, ngx_int_t count)
+{
+    size_t     len, keys_len;
+    ngx_int_t  i;
+
+    len = ngx_statshouse_tl_uint32_len(); // tag
+    len += ngx_statshouse_tl_uint32_len(); // field mask
+    len += ngx_statshouse_tl_uint32_len(); // count
+
+    keys_len = 0;
+
+    for (i = 0; i < count; i++) {
+        if (i == 0 || !ngx_statshouse_tl_same_keys(stats[i], stats[i - 1])) {
+            keys_len = ngx_statshouse_tl_keys_len(stats[i]);
+        }
+
+        len += ngx_statshouse_tl_metric_head_len(stats[i]);
+        len += keys_len;
+        len += ngx_statshouse_tl_values_len(stats[i]);
+    }
+
+    return len;
+}
+
+
+void
+ngx_statshouse_tl_metrics_list(ngx_buf_t *buf, ngx_statshouse_stat_t **stats, ngx_int_t count)
+{
+    u_char     *keys;
+    size_t      keys_len;
+    ngx_int_t   i;
+
+    ngx_statshouse_tl_uint32(buf, NGX_STATSHOUSE_TL_TAG);
+    ngx_statshouse_tl_uint32(buf, 0); // field mask
+    ngx_statshouse_tl_uint32(buf, count);
+
+    keys = NULL;
+    keys_len = 0;
+
+    for (i = 0; i < count; i++) {
+        ngx_statshouse_tl_metric_head(buf, stats[i]);
+
+        if (keys && ngx_statshouse_tl_same_keys(stats[i], stats[i - 1])) {
+            buf->last = ngx_cpymem(buf->last, keys, keys_len);
+
+        } else {
+            keys = buf->last;
+            ngx_statshouse_tl_keys(buf, stats[i]);
+            keys_len = buf->last - keys;
+        }
+
+        ngx_statshouse_tl_values(buf, stats[i]);
+    }
+}
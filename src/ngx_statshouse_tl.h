@@ -14,6 +14,8 @@
 
 size_t  ngx_statshouse_tl_metrics_len(const ngx_statshouse_stat_t *stat, ngx_int_t count);
 void  ngx_statshouse_tl_metrics(ngx_buf_t *buf, const ngx_statshouse_stat_t *stat, ngx_int_t count);
+size_t  ngx_statshouse_tl_metrics_list_len(ngx_statshouse_stat_t **stats, ngx_int_t count);
+void  ngx_statshouse_tl_metrics_list(ngx_buf_t *buf, ngx_statshouse_stat_t **stats, ngx_int_t count);
 
 
 #endif
@@ -0,0 +1,356 @@
+/* Copyright 2022 V Kontakte LLC
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include <ngx_core.h>
+#include <ngx_statshouse_stat.h>
+
+#include "ngx_statshouse_topk.h"
+
+
+/*
+ * Space-saving top: at most "size" key tuples are counted per window.
+ * A new tuple replaces the tuple with the minimal count and inherits
+ * its count, so the sum of counts is preserved.  Tuples are found by
+ * rbtree, the minimal one is the root of the min-heap by count.
+ *
+ * Key values of a tuple are packed as 2 bytes length and data.
+ */
+
+static ngx_int_t  ngx_statshouse_topk_pack(ngx_statshouse_stat_t *stat, u_char *buf, size_t *len);
+static ngx_statshouse_topk_entry_t  *ngx_statshouse_topk_lookup(ngx_statshouse_topk_t *topk,
+    uint32_t hash, uint64_t keys_mask, u_char *keys, size_t len);
+static ngx_int_t  ngx_statshouse_topk_cmp(ngx_statshouse_topk_entry_t *entry,
+    uint64_t keys_mask, u_char *keys, size_t len);
+static void  ngx_statshouse_topk_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static void  ngx_statshouse_topk_heap_up(ngx_statshouse_topk_t *topk, ngx_uint_t i);
+static void  ngx_statshouse_topk_heap_down(ngx_statshouse_topk_t *topk, ngx_uint_t i);
+
+
+ngx_int_t
+ngx_statshouse_topk_init(ngx_statshouse_topk_t *topk, ngx_pool_t *pool)
+{
+    topk->entries = ngx_palloc(pool, sizeof(ngx_statshouse_topk_entry_t) * topk->size);
+    if (topk->entries == NULL) {
+        return NGX_ERROR;
+    }
+
+    topk->heap = ngx_palloc(pool, sizeof(ngx_statshouse_topk_entry_t *) * topk->size);
+    if (topk->heap == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_rbtree_init(&topk->rbtree, &topk->sentinel, ngx_statshouse_topk_insert_value);
+    topk->nentries = 0;
+
+    return NGX_OK;
+}
+
+
+/*
+ * Returns NGX_DECLINED if key values are too long to be counted,
+ * such stat should be sent as is.
+ */
+
+ngx_int_t
+ngx_statshouse_topk_add(ngx_statshouse_topk_t *topk, ngx_statshouse_stat_t *stat)
+{
+    ngx_statshouse_topk_entry_t  *entry;
+    u_char                        keys[NGX_STATSHOUSE_TOPK_KEYS_SIZE];
+    size_t                        len;
+    uint32_t                      hash;
+    double                        count;
+    ngx_uint_t                    evict;
+
+    if (ngx_statshouse_topk_pack(stat, keys, &len) != NGX_OK) {
+        return NGX_DECLINED;
+    }
+
+    ngx_crc32_init(hash);
+    ngx_crc32_update(&hash, (u_char *) &stat->keys_mask, sizeof(uint64_t));
+    ngx_crc32_update(&hash, keys, len);
+    ngx_crc32_final(hash);
+
+    count = stat->values[0].counter;
+
+    entry = ngx_statshouse_topk_lookup(topk, hash, stat->keys_mask, keys, len);
+    if (entry != NULL) {
+        entry->count += count;
+        ngx_statshouse_topk_heap_down(topk, entry->heap);
+
+        return NGX_OK;
+    }
+
+    if (topk->nentries < topk->size) {
+        entry = &topk->entries[topk->nentries];
+
+        entry->heap = topk->nentries;
+        entry->count = count;
+
+        topk->heap[topk->nentries++] = entry;
+
+        evict = 0;
+
+    } else {
+        /* replace tuple with minimal count */
+
+        entry = topk->heap[0];
+        ngx_rbtree_delete(&topk->rbtree, &entry->node);
+
+        entry->count += count;
+
+        evict = 1;
+    }
+
+    entry->node.key = hash;
+    entry->keys_mask = stat->keys_mask;
+    entry->len = len;
+    ngx_memcpy(entry->keys, keys, len);
+
+    ngx_rbtree_insert(&topk->rbtree, &entry->node);
+
+    if (evict) {
+        ngx_statshouse_topk_heap_down(topk, entry->heap);
+
+    } else {
+        ngx_statshouse_topk_heap_up(topk, entry->heap);
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_statshouse_topk_process(ngx_statshouse_topk_t *topk,
+    ngx_statshouse_aggregate_pt handler, void *ctx)
+{
+    ngx_statshouse_topk_entry_t  *entry;
+    ngx_statshouse_stat_t         stat;
+    ngx_str_t                     keys[NGX_STATSHOUSE_STAT_KEYS_MAX];
+    ngx_uint_t                    i, n;
+    ngx_int_t                     count = 0;
+    u_char                       *p;
+
+    for (i = 0; i < topk->nentries; i++) {
+        entry = &topk->entries[i];
+
+        ngx_statshouse_stat_init(&stat, topk->name, ngx_statshouse_mt_counter, keys);
+        ngx_statshouse_stat_value_counter(&stat, 0);
+
+        stat.values[0].counter = entry->count;
+        stat.keys_mask = entry->keys_mask;
+
+        p = entry->keys;
+
+        for (n = 0; p < entry->keys + entry->len; n++) {
+            keys[n].len = p[0] | (p[1] << 8);
+            keys[n].data = p + 2;
+
+            p += 2 + keys[n].len;
+        }
+
+        if (handler(&stat, ctx) == NGX_OK) {
+            count++;
+        }
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_CORE, ngx_cycle->log, 0,
+        "statshouse top \"%V\", flush %i of %ui stats", &topk->name, count, topk->nentries);
+
+    ngx_rbtree_init(&topk->rbtree, &topk->sentinel, ngx_statshouse_topk_insert_value);
+    topk->nentries = 0;
+
+    return count ? NGX_OK : NGX_DECLINED;
+}
+
+
+static ngx_int_t
+ngx_statshouse_topk_pack(ngx_statshouse_stat_t *stat, u_char *buf, size_t *len)
+{
+    ngx_uint_t   i, n;
+    ngx_str_t   *key;
+    u_char      *p, *last;
+
+    p = buf;
+    last = buf + NGX_STATSHOUSE_TOPK_KEYS_SIZE;
+
+    n = ngx_statshouse_stat_keys_count(stat);
+
+    for (i = 0; i < n; i++) {
+        key = &stat->keys[i];
+
+        if ((size_t) (last - p) < key->len + 2) {
+            return NGX_DECLINED;
+        }
+
+        *p++ = (u_char) (key->len & 0xff);
+        *p++ = (u_char) (key->len >> 8);
+
+        p = ngx_cpymem(p, key->data, key->len);
+    }
+
+    *len = p - buf;
+
+    return NGX_OK;
+}
+
+
+static ngx_statshouse_topk_entry_t *
+ngx_statshouse_topk_lookup(ngx_statshouse_topk_t *topk, uint32_t hash,
+    uint64_t keys_mask, u_char *keys, size_t len)
+{
+    ngx_statshouse_topk_entry_t  *entry;
+    ngx_rbtree_node_t            *node, *sentinel;
+    ngx_int_t                     rc;
+
+    node = topk->rbtree.root;
+    sentinel = topk->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        entry = ngx_rbtree_data(node, ngx_statshouse_topk_entry_t, node);
+
+        rc = ngx_statshouse_topk_cmp(entry, keys_mask, keys, len);
+        if (rc == 0) {
+            return entry;
+        }
+
+        node = (rc > 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+
+static ngx_int_t
+ngx_statshouse_topk_cmp(ngx_statshouse_topk_entry_t *entry, uint64_t keys_mask, u_char *keys, size_t len)
+{
+    if (entry->keys_mask != keys_mask) {
+        return (entry->keys_mask < keys_mask) ? -1 : 1;
+    }
+
+    if (entry->len != len) {
+        return (entry->len < len) ? -1 : 1;
+    }
+
+    return ngx_memcmp(entry->keys, keys, len);
+}
+
+
+static void
+ngx_statshouse_topk_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t            **p;
+    ngx_statshouse_topk_entry_t   *e, *e_temp;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            e = ngx_rbtree_data(node, ngx_statshouse_topk_entry_t, node);
+            e_temp = ngx_rbtree_data(temp, ngx_statshouse_topk_entry_t, node);
+
+            p = (ngx_statshouse_topk_cmp(e_temp, e->keys_mask, e->keys, e->len) > 0)
+                ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+static void
+ngx_statshouse_topk_heap_up(ngx_statshouse_topk_t *topk, ngx_uint_t i)
+{
+    ngx_statshouse_topk_entry_t  *entry;
+    ngx_uint_t                    parent;
+
+    entry = topk->heap[i];
+
+    while (i > 0) {
+        parent = (i - 1) / 2;
+
+        if (topk->heap[parent]->count <= entry->count) {
+            break;
+        }
+
+        topk->heap[i] = topk->heap[parent];
+        topk->heap[i]->heap = i;
+
+        i = parent;
+    }
+
+    topk->heap[i] = entry;
+    entry->heap = i;
+}
+
+
+static void
+ngx_statshouse_topk_heap_down(ngx_statshouse_topk_t *topk, ngx_uint_t i)
+{
+    ngx_statshouse_topk_entry_t  *entry;
+    ngx_uint_t                    child;
+
+    entry = topk->heap[i];
+
+    for ( ;; ) {
+        child = 2 * i + 1;
+
+        if (child >= topk->nentries) {
+            break;
+        }
+
+        if (child + 1 < topk->nentries
+            && topk->heap[child + 1]->count < topk->heap[child]->count)
+        {
+            child++;
+        }
+
+        if (entry->count <= topk->heap[child]->count) {
+            break;
+        }
+
+        topk->heap[i] = topk->heap[child];
+        topk->heap[i]->heap = i;
+
+        i = child;
+    }
+
+    topk->heap[i] = entry;
+    entry->heap = i;
+}
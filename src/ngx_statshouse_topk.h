@@ -0,0 +1,51 @@
+/* Copyright 2022 V Kontakte LLC
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef _NGX_STATSHOUSE_TOPK_H_INCLUDED_
+#define _NGX_STATSHOUSE_TOPK_H_INCLUDED_
+
+#include <ngx_core.h>
+#include <ngx_statshouse_stat.h>
+
+#include "ngx_statshouse_aggregate.h"
+
+
+#define NGX_STATSHOUSE_TOPK_MAX          1024
+#define NGX_STATSHOUSE_TOPK_KEYS_SIZE    512
+
+
+typedef struct {
+    ngx_rbtree_node_t              node;
+    ngx_uint_t                     heap;
+
+    double                         count;
+
+    uint64_t                       keys_mask;
+    size_t                         len;
+    u_char                         keys[NGX_STATSHOUSE_TOPK_KEYS_SIZE];
+} ngx_statshouse_topk_entry_t;
+
+typedef struct {
+    ngx_str_t                      name;
+
+    ngx_rbtree_t                   rbtree;
+    ngx_rbtree_node_t              sentinel;
+
+    ngx_statshouse_topk_entry_t   *entries;
+    ngx_statshouse_topk_entry_t  **heap;
+    ngx_uint_t                     nentries;
+
+    ngx_uint_t                     size;
+} ngx_statshouse_topk_t;
+
+
+ngx_int_t  ngx_statshouse_topk_init(ngx_statshouse_topk_t *topk, ngx_pool_t *pool);
+ngx_int_t  ngx_statshouse_topk_add(ngx_statshouse_topk_t *topk, ngx_statshouse_stat_t *stat);
+ngx_int_t  ngx_statshouse_topk_process(ngx_statshouse_topk_t *topk,
+    ngx_statshouse_aggregate_pt handler, void *ctx);
+
+#endif
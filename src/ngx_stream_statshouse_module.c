@@ -13,6 +13,7 @@
 #include <ngx_statshouse_stat.h>
 
 #include "ngx_statshouse.h"
+#include "ngx_statshouse_predicate.h"
 
 
 #define NGX_STREAM_STATSHOUSE_CONF              0x100000000
@@ -24,27 +25,67 @@ typedef struct {
     void                                      **statshouse_conf;
 } ngx_stream_statshouse_conf_ctx_t;
 
-typedef struct {
+typedef struct ngx_stream_statshouse_srv_conf_s  ngx_stream_statshouse_srv_conf_t;
+
+struct ngx_stream_statshouse_srv_conf_s {
+    /* own metrics, inherited ones are sent by the chain of parents */
     ngx_array_t                                *confs;
+    ngx_array_t                                *phases;
+    ngx_stream_statshouse_srv_conf_t           *inherit;
+
     ngx_statshouse_server_t                    *server;
 
     ngx_flag_t                                  enable;
-} ngx_stream_statshouse_srv_conf_t;
+};
 
 typedef struct {
     ngx_array_t                                *servers;
+
+    ngx_statshouse_exprs_t                     *exprs;
+    ngx_statshouse_scratch_t                    scratch;
 } ngx_stream_statshouse_main_conf_t;
 
+typedef struct {
+    ngx_str_t                                   name;
+    ngx_statshouse_number_value_pt              handler;
+} ngx_stream_statshouse_number_t;
+
+typedef struct {
+    ngx_stream_complex_value_t                  complex;
+
+    /* index of the only variable of the value, NGX_ERROR if none */
+    ngx_int_t                                   index;
+} ngx_stream_statshouse_complex_value_t;
+
 
 static ngx_int_t   ngx_stream_statshouse_init(ngx_conf_t *cf);
+static ngx_int_t   ngx_stream_statshouse_compile_complex_value(ngx_conf_t *cf, ngx_str_t *value,
+    ngx_stream_statshouse_complex_value_t *cv);
+static ngx_stream_statshouse_complex_value_t *ngx_stream_statshouse_intern_complex_value(ngx_conf_t *cf,
+    ngx_str_t *value);
+static ngx_int_t   ngx_stream_statshouse_complex_value(void *ctx, void *val, ngx_str_t *value);
+static void *      ngx_stream_statshouse_predicate_operand(ngx_conf_t *cf, ngx_str_t *value,
+    ngx_statshouse_number_value_pt *accessor);
+static ngx_int_t   ngx_stream_statshouse_script_value(ngx_stream_session_t *s, ngx_stream_complex_value_t *val,
+    ngx_str_t *value);
+static ngx_int_t   ngx_stream_statshouse_init_phases(ngx_conf_t *cf, ngx_stream_statshouse_srv_conf_t *sscf);
+static ngx_int_t   ngx_stream_statshouse_bind(ngx_conf_t *cf, ngx_stream_statshouse_srv_conf_t *sscf);
 static void *      ngx_stream_statshouse_create_main_conf(ngx_conf_t *cf);
 static void *      ngx_stream_statshouse_create_srv_conf(ngx_conf_t *cf);
 static char *      ngx_stream_statshouse_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child);
-static char *      ngx_stream_statshouse_set_predicate_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static char *      ngx_stream_statshouse_metric_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static char *      ngx_stream_statshouse_value_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static char *      ngx_stream_statshouse_key_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static char *      ngx_stream_statshouse_server_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static ngx_statshouse_number_value_pt  ngx_stream_statshouse_number_accessor(ngx_str_t *value);
+static ngx_int_t   ngx_stream_statshouse_session_time(void *ctx, double *number);
+static ngx_int_t   ngx_stream_statshouse_status(void *ctx, double *number);
+static ngx_int_t   ngx_stream_statshouse_bytes_sent(void *ctx, double *number);
+static ngx_int_t   ngx_stream_statshouse_bytes_received(void *ctx, double *number);
+static ngx_int_t   ngx_stream_statshouse_upstream_session_time(void *ctx, double *number);
+static ngx_int_t   ngx_stream_statshouse_upstream_connect_time(void *ctx, double *number);
+static ngx_int_t   ngx_stream_statshouse_upstream_first_byte_time(void *ctx, double *number);
+static ngx_int_t   ngx_stream_statshouse_upstream_time(ngx_stream_session_t *s, double *number, size_t offset);
 
 static ngx_int_t   ngx_stream_statshouse_handler(ngx_stream_session_t *session);
 
@@ -68,12 +109,30 @@ static ngx_command_t  ngx_stream_statshouse_commands[] = {
         NULL
     },
 
+    { ngx_string("statshouse_metric_group"),
+        NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_BLOCK
+            |NGX_CONF_TAKE1,
+        ngx_stream_statshouse_metric_slot,
+        NGX_STREAM_SRV_CONF_OFFSET,
+        0,
+        (void *) 1
+    },
+
+    { ngx_string("metric"),
+        NGX_STREAM_STATSHOUSE_CONF
+            |NGX_CONF_TAKE3,
+        ngx_statshouse_conf_member_slot,
+        NGX_STREAM_STATSHOUSE_CONF_OFFSET,
+        0,
+        NULL
+    },
+
     { ngx_string("condition"),
         NGX_STREAM_STATSHOUSE_CONF
             |NGX_CONF_1MORE,
-        ngx_stream_statshouse_set_predicate_slot,
+        ngx_statshouse_conf_condition_slot,
         NGX_STREAM_STATSHOUSE_CONF_OFFSET,
-        offsetof(ngx_statshouse_conf_t, condition.complex),
+        0,
         NULL
     },
 
@@ -86,6 +145,24 @@ static ngx_command_t  ngx_stream_statshouse_commands[] = {
         NULL
     },
 
+    { ngx_string("rate"),
+        NGX_STREAM_STATSHOUSE_CONF
+            |NGX_CONF_TAKE12,
+        ngx_statshouse_conf_rate_slot,
+        NGX_STREAM_STATSHOUSE_CONF_OFFSET,
+        0,
+        NULL
+    },
+
+    { ngx_string("cardinality"),
+        NGX_STREAM_STATSHOUSE_CONF
+            |NGX_CONF_TAKE12,
+        ngx_statshouse_conf_cardinality_slot,
+        NGX_STREAM_STATSHOUSE_CONF_OFFSET,
+        0,
+        NULL
+    },
+
     { ngx_string("count"),
         NGX_STREAM_STATSHOUSE_CONF
             |NGX_CONF_1MORE,
@@ -127,7 +204,7 @@ static ngx_command_t  ngx_stream_statshouse_commands[] = {
             |NGX_CONF_1MORE,
         ngx_stream_statshouse_key_slot,
         NGX_STREAM_STATSHOUSE_CONF_OFFSET,
-        offsetof(ngx_statshouse_conf_t, keys[0]),
+        0,
         (void *) "0"
     },
 
@@ -136,7 +213,7 @@ static ngx_command_t  ngx_stream_statshouse_commands[] = {
             |NGX_CONF_1MORE,
         ngx_stream_statshouse_key_slot,
         NGX_STREAM_STATSHOUSE_CONF_OFFSET,
-        offsetof(ngx_statshouse_conf_t, keys[1]),
+        1,
         (void *) "1"
     },
 
@@ -145,7 +222,7 @@ static ngx_command_t  ngx_stream_statshouse_commands[] = {
             |NGX_CONF_1MORE,
         ngx_stream_statshouse_key_slot,
         NGX_STREAM_STATSHOUSE_CONF_OFFSET,
-        offsetof(ngx_statshouse_conf_t, keys[2]),
+        2,
         (void *) "2"
     },
 
@@ -154,7 +231,7 @@ static ngx_command_t  ngx_stream_statshouse_commands[] = {
             |NGX_CONF_1MORE,
         ngx_stream_statshouse_key_slot,
         NGX_STREAM_STATSHOUSE_CONF_OFFSET,
-        offsetof(ngx_statshouse_conf_t, keys[3]),
+        3,
         (void *) "3"
     },
 
@@ -163,7 +240,7 @@ static ngx_command_t  ngx_stream_statshouse_commands[] = {
             |NGX_CONF_1MORE,
         ngx_stream_statshouse_key_slot,
         NGX_STREAM_STATSHOUSE_CONF_OFFSET,
-        offsetof(ngx_statshouse_conf_t, keys[4]),
+        4,
         (void *) "4"
     },
 
@@ -172,7 +249,7 @@ static ngx_command_t  ngx_stream_statshouse_commands[] = {
             |NGX_CONF_1MORE,
         ngx_stream_statshouse_key_slot,
         NGX_STREAM_STATSHOUSE_CONF_OFFSET,
-        offsetof(ngx_statshouse_conf_t, keys[5]),
+        5,
         (void *) "5"
     },
 
@@ -181,7 +258,7 @@ static ngx_command_t  ngx_stream_statshouse_commands[] = {
             |NGX_CONF_1MORE,
         ngx_stream_statshouse_key_slot,
         NGX_STREAM_STATSHOUSE_CONF_OFFSET,
-        offsetof(ngx_statshouse_conf_t, keys[6]),
+        6,
         (void *) "6"
     },
 
@@ -190,7 +267,7 @@ static ngx_command_t  ngx_stream_statshouse_commands[] = {
             |NGX_CONF_1MORE,
         ngx_stream_statshouse_key_slot,
         NGX_STREAM_STATSHOUSE_CONF_OFFSET,
-        offsetof(ngx_statshouse_conf_t, keys[7]),
+        7,
         (void *) "7"
     },
 
@@ -199,7 +276,7 @@ static ngx_command_t  ngx_stream_statshouse_commands[] = {
             |NGX_CONF_1MORE,
         ngx_stream_statshouse_key_slot,
         NGX_STREAM_STATSHOUSE_CONF_OFFSET,
-        offsetof(ngx_statshouse_conf_t, keys[8]),
+        8,
         (void *) "8"
     },
 
@@ -208,7 +285,7 @@ static ngx_command_t  ngx_stream_statshouse_commands[] = {
             |NGX_CONF_1MORE,
         ngx_stream_statshouse_key_slot,
         NGX_STREAM_STATSHOUSE_CONF_OFFSET,
-        offsetof(ngx_statshouse_conf_t, keys[9]),
+        9,
         (void *) "9"
     },
 
@@ -217,7 +294,7 @@ static ngx_command_t  ngx_stream_statshouse_commands[] = {
             |NGX_CONF_1MORE,
         ngx_stream_statshouse_key_slot,
         NGX_STREAM_STATSHOUSE_CONF_OFFSET,
-        offsetof(ngx_statshouse_conf_t, keys[10]),
+        10,
         (void *) "10"
     },
 
@@ -226,7 +303,7 @@ static ngx_command_t  ngx_stream_statshouse_commands[] = {
             |NGX_CONF_1MORE,
         ngx_stream_statshouse_key_slot,
         NGX_STREAM_STATSHOUSE_CONF_OFFSET,
-        offsetof(ngx_statshouse_conf_t, keys[11]),
+        11,
         (void *) "11"
     },
 
@@ -235,128 +312,736 @@ static ngx_command_t  ngx_stream_statshouse_commands[] = {
             |NGX_CONF_1MORE,
         ngx_stream_statshouse_key_slot,
         NGX_STREAM_STATSHOUSE_CONF_OFFSET,
-        offsetof(ngx_statshouse_conf_t, keys[12]),
+        12,
         (void *) "12"
     },
 
-    { ngx_string("key13"),
-        NGX_STREAM_STATSHOUSE_CONF
-            |NGX_CONF_1MORE,
-        ngx_stream_statshouse_key_slot,
-        NGX_STREAM_STATSHOUSE_CONF_OFFSET,
-        offsetof(ngx_statshouse_conf_t, keys[13]),
-        (void *) "13"
-    },
+    { ngx_string("key13"),
+        NGX_STREAM_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_stream_statshouse_key_slot,
+        NGX_STREAM_STATSHOUSE_CONF_OFFSET,
+        13,
+        (void *) "13"
+    },
+
+    { ngx_string("key14"),
+        NGX_STREAM_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_stream_statshouse_key_slot,
+        NGX_STREAM_STATSHOUSE_CONF_OFFSET,
+        14,
+        (void *) "14"
+    },
+
+    { ngx_string("key15"),
+        NGX_STREAM_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_stream_statshouse_key_slot,
+        NGX_STREAM_STATSHOUSE_CONF_OFFSET,
+        15,
+        (void *) "15"
+    },
+
+    { ngx_string("key16"),
+        NGX_STREAM_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_stream_statshouse_key_slot,
+        NGX_STREAM_STATSHOUSE_CONF_OFFSET,
+        16,
+        (void *) "16"
+    },
+
+    { ngx_string("key17"),
+        NGX_STREAM_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_stream_statshouse_key_slot,
+        NGX_STREAM_STATSHOUSE_CONF_OFFSET,
+        17,
+        (void *) "17"
+    },
+
+    { ngx_string("key18"),
+        NGX_STREAM_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_stream_statshouse_key_slot,
+        NGX_STREAM_STATSHOUSE_CONF_OFFSET,
+        18,
+        (void *) "18"
+    },
+
+    { ngx_string("key19"),
+        NGX_STREAM_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_stream_statshouse_key_slot,
+        NGX_STREAM_STATSHOUSE_CONF_OFFSET,
+        19,
+        (void *) "19"
+    },
+
+    { ngx_string("key20"),
+        NGX_STREAM_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_stream_statshouse_key_slot,
+        NGX_STREAM_STATSHOUSE_CONF_OFFSET,
+        20,
+        (void *) "20"
+    },
+
+    { ngx_string("key21"),
+        NGX_STREAM_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_stream_statshouse_key_slot,
+        NGX_STREAM_STATSHOUSE_CONF_OFFSET,
+        21,
+        (void *) "21"
+    },
+
+    { ngx_string("key22"),
+        NGX_STREAM_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_stream_statshouse_key_slot,
+        NGX_STREAM_STATSHOUSE_CONF_OFFSET,
+        22,
+        (void *) "22"
+    },
+
+    { ngx_string("key23"),
+        NGX_STREAM_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_stream_statshouse_key_slot,
+        NGX_STREAM_STATSHOUSE_CONF_OFFSET,
+        23,
+        (void *) "23"
+    },
+
+    { ngx_string("key24"),
+        NGX_STREAM_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_stream_statshouse_key_slot,
+        NGX_STREAM_STATSHOUSE_CONF_OFFSET,
+        24,
+        (void *) "24"
+    },
+
+    { ngx_string("key25"),
+        NGX_STREAM_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_stream_statshouse_key_slot,
+        NGX_STREAM_STATSHOUSE_CONF_OFFSET,
+        25,
+        (void *) "25"
+    },
+
+    { ngx_string("key26"),
+        NGX_STREAM_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_stream_statshouse_key_slot,
+        NGX_STREAM_STATSHOUSE_CONF_OFFSET,
+        26,
+        (void *) "26"
+    },
+
+    { ngx_string("key27"),
+        NGX_STREAM_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_stream_statshouse_key_slot,
+        NGX_STREAM_STATSHOUSE_CONF_OFFSET,
+        27,
+        (void *) "27"
+    },
+
+    { ngx_string("key28"),
+        NGX_STREAM_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_stream_statshouse_key_slot,
+        NGX_STREAM_STATSHOUSE_CONF_OFFSET,
+        28,
+        (void *) "28"
+    },
+
+    { ngx_string("key29"),
+        NGX_STREAM_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_stream_statshouse_key_slot,
+        NGX_STREAM_STATSHOUSE_CONF_OFFSET,
+        29,
+        (void *) "29"
+    },
+
+    { ngx_string("key30"),
+        NGX_STREAM_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_stream_statshouse_key_slot,
+        NGX_STREAM_STATSHOUSE_CONF_OFFSET,
+        30,
+        (void *) "30"
+    },
+
+    { ngx_string("key31"),
+        NGX_STREAM_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_stream_statshouse_key_slot,
+        NGX_STREAM_STATSHOUSE_CONF_OFFSET,
+        31,
+        (void *) "31"
+    },
+
+    { ngx_string("key32"),
+        NGX_STREAM_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_stream_statshouse_key_slot,
+        NGX_STREAM_STATSHOUSE_CONF_OFFSET,
+        32,
+        (void *) "32"
+    },
+
+    { ngx_string("key33"),
+        NGX_STREAM_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_stream_statshouse_key_slot,
+        NGX_STREAM_STATSHOUSE_CONF_OFFSET,
+        33,
+        (void *) "33"
+    },
+
+    { ngx_string("key34"),
+        NGX_STREAM_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_stream_statshouse_key_slot,
+        NGX_STREAM_STATSHOUSE_CONF_OFFSET,
+        34,
+        (void *) "34"
+    },
+
+    { ngx_string("key35"),
+        NGX_STREAM_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_stream_statshouse_key_slot,
+        NGX_STREAM_STATSHOUSE_CONF_OFFSET,
+        35,
+        (void *) "35"
+    },
+
+    { ngx_string("key36"),
+        NGX_STREAM_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_stream_statshouse_key_slot,
+        NGX_STREAM_STATSHOUSE_CONF_OFFSET,
+        36,
+        (void *) "36"
+    },
+
+    { ngx_string("key37"),
+        NGX_STREAM_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_stream_statshouse_key_slot,
+        NGX_STREAM_STATSHOUSE_CONF_OFFSET,
+        37,
+        (void *) "37"
+    },
+
+    { ngx_string("key38"),
+        NGX_STREAM_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_stream_statshouse_key_slot,
+        NGX_STREAM_STATSHOUSE_CONF_OFFSET,
+        38,
+        (void *) "38"
+    },
+
+    { ngx_string("key39"),
+        NGX_STREAM_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_stream_statshouse_key_slot,
+        NGX_STREAM_STATSHOUSE_CONF_OFFSET,
+        39,
+        (void *) "39"
+    },
+
+    { ngx_string("key40"),
+        NGX_STREAM_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_stream_statshouse_key_slot,
+        NGX_STREAM_STATSHOUSE_CONF_OFFSET,
+        40,
+        (void *) "40"
+    },
+
+    { ngx_string("key41"),
+        NGX_STREAM_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_stream_statshouse_key_slot,
+        NGX_STREAM_STATSHOUSE_CONF_OFFSET,
+        41,
+        (void *) "41"
+    },
+
+    { ngx_string("key42"),
+        NGX_STREAM_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_stream_statshouse_key_slot,
+        NGX_STREAM_STATSHOUSE_CONF_OFFSET,
+        42,
+        (void *) "42"
+    },
+
+    { ngx_string("key43"),
+        NGX_STREAM_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_stream_statshouse_key_slot,
+        NGX_STREAM_STATSHOUSE_CONF_OFFSET,
+        43,
+        (void *) "43"
+    },
+
+    { ngx_string("key44"),
+        NGX_STREAM_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_stream_statshouse_key_slot,
+        NGX_STREAM_STATSHOUSE_CONF_OFFSET,
+        44,
+        (void *) "44"
+    },
+
+    { ngx_string("key45"),
+        NGX_STREAM_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_stream_statshouse_key_slot,
+        NGX_STREAM_STATSHOUSE_CONF_OFFSET,
+        45,
+        (void *) "45"
+    },
+
+    { ngx_string("key46"),
+        NGX_STREAM_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_stream_statshouse_key_slot,
+        NGX_STREAM_STATSHOUSE_CONF_OFFSET,
+        46,
+        (void *) "46"
+    },
+
+    { ngx_string("key47"),
+        NGX_STREAM_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_stream_statshouse_key_slot,
+        NGX_STREAM_STATSHOUSE_CONF_OFFSET,
+        47,
+        (void *) "47"
+    },
+
+    { ngx_string("skey"),
+        NGX_STREAM_STATSHOUSE_CONF
+            |NGX_CONF_1MORE,
+        ngx_stream_statshouse_key_slot,
+        NGX_STREAM_STATSHOUSE_CONF_OFFSET,
+        48,
+        (void *) "_s"
+    },
+
+    { ngx_string("sample"),
+        NGX_STREAM_STATSHOUSE_CONF
+            |NGX_CONF_TAKE12,
+        ngx_statshouse_conf_sample_slot,
+        NGX_STREAM_STATSHOUSE_CONF_OFFSET,
+        0,
+        NULL
+    },
+
+    ngx_null_command
+};
+
+static ngx_stream_module_t  ngx_stream_statshouse_module_ctx = {
+    NULL,                                    /* preconfiguration */
+    ngx_stream_statshouse_init,              /* postconfiguration */
+
+    ngx_stream_statshouse_create_main_conf,  /* create main configuration */
+    NULL,                                    /* init main configuration */
+
+    ngx_stream_statshouse_create_srv_conf,   /* create server configuration */
+    ngx_stream_statshouse_merge_srv_conf     /* merge server configuration */
+};
+
+ngx_module_t  ngx_stream_statshouse_module = {
+    NGX_MODULE_V1,
+    &ngx_stream_statshouse_module_ctx,       /* module context */
+    ngx_stream_statshouse_commands,          /* module directives */
+    NGX_STREAM_MODULE,                       /* module type */
+    NULL,                                    /* init master */
+    NULL,                                    /* init module */
+    NULL,                                    /* init process */
+    NULL,                                    /* init thread */
+    NULL,                                    /* exit thread */
+    NULL,                                    /* exit process */
+    NULL,                                    /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+static ngx_stream_variable_t  ngx_stream_statshouse_variables[] = {
+      ngx_stream_null_variable
+};
+
+static ngx_stream_statshouse_number_t  ngx_stream_statshouse_numbers[] = {
+    { ngx_string("$session_time"), ngx_stream_statshouse_session_time },
+    { ngx_string("$status"), ngx_stream_statshouse_status },
+    { ngx_string("$bytes_sent"), ngx_stream_statshouse_bytes_sent },
+    { ngx_string("$bytes_received"), ngx_stream_statshouse_bytes_received },
+    { ngx_string("$upstream_session_time"), ngx_stream_statshouse_upstream_session_time },
+    { ngx_string("$upstream_connect_time"), ngx_stream_statshouse_upstream_connect_time },
+    { ngx_string("$upstream_first_byte_time"), ngx_stream_statshouse_upstream_first_byte_time },
+    { ngx_null_string, NULL }
+};
+
+
+static ngx_int_t
+ngx_stream_statshouse_init(ngx_conf_t *cf)
+{
+    ngx_stream_core_main_conf_t         *cmcf;
+    ngx_stream_variable_t               *cv, *v;
+    ngx_stream_handler_pt               *h;
+    ngx_stream_statshouse_main_conf_t   *smcf;
+    ngx_stream_statshouse_srv_conf_t    *sscf;
+    ngx_statshouse_server_t            **servers;
+    ngx_uint_t                           i;
+
+    for (cv = ngx_stream_statshouse_variables; cv->name.len; cv++) {
+        v = ngx_stream_add_variable(cf, &cv->name, cv->flags);
+        if (v == NULL) {
+            return NGX_ERROR;
+        }
+
+        *v = *cv;
+    }
+
+    /* metrics of stream level, that is never merged */
+
+    sscf = ngx_stream_conf_get_module_srv_conf(cf, ngx_stream_statshouse_module);
+
+    if (ngx_stream_statshouse_bind(cf, sscf) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_stream_statshouse_init_phases(cf, sscf) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    smcf = ngx_stream_conf_get_module_main_conf(cf, ngx_stream_statshouse_module);
+    if (smcf->servers == NULL) {
+        return NGX_OK;
+    }
+
+    servers = smcf->servers->elts;
+    for (i = 0; i < smcf->servers->nelts; i++) {
+        if (ngx_statshouse_server_init(servers[i], cf->pool) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    cmcf = ngx_stream_conf_get_module_main_conf(cf, ngx_stream_core_module);
+
+    h = ngx_array_push(&cmcf->phases[NGX_STREAM_LOG_PHASE].handlers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    *h = ngx_stream_statshouse_handler;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_statshouse_compile_complex_value(ngx_conf_t *cf, ngx_str_t *value,
+    ngx_stream_statshouse_complex_value_t *cv)
+{
+    ngx_stream_compile_complex_value_t  ccv;
+    ngx_str_t                           name;
+
+    ngx_memzero(&ccv, sizeof(ngx_stream_compile_complex_value_t));
+
+    ccv.cf = cf;
+    ccv.value = value;
+    ccv.complex_value = &cv->complex;
+
+    if (ngx_stream_compile_complex_value(&ccv) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    cv->index = NGX_ERROR;
+
+    if (cv->complex.lengths == NULL || ngx_statshouse_conf_variable(value, &name) != NGX_OK) {
+        return NGX_OK;
+    }
+
+    cv->index = ngx_stream_get_variable_index(cf, &name);
+    if (cv->index == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_stream_statshouse_complex_value_t *
+ngx_stream_statshouse_intern_complex_value(ngx_conf_t *cf, ngx_str_t *value)
+{
+    ngx_stream_statshouse_main_conf_t      *smcf;
+    ngx_stream_statshouse_complex_value_t  *cv;
+    ngx_statshouse_expr_t                  *expr;
+    ngx_int_t                               n;
+
+    smcf = ngx_stream_conf_get_module_main_conf(cf, ngx_stream_statshouse_module);
+
+    n = ngx_statshouse_exprs_find(smcf->exprs, value);
+
+    if (n != NGX_DECLINED) {
+        expr = smcf->exprs->exprs.elts;
+        return expr[n].complex;
+    }
+
+    cv = ngx_pcalloc(cf->pool, sizeof(ngx_stream_statshouse_complex_value_t));
+    if (cv == NULL) {
+        return NULL;
+    }
+
+    if (ngx_stream_statshouse_compile_complex_value(cf, value, cv) != NGX_OK) {
+        return NULL;
+    }
+
+    if (ngx_statshouse_exprs_add(smcf->exprs, value, cv) == NGX_ERROR) {
+        return NULL;
+    }
+
+    return cv;
+}
+
+
+static ngx_int_t
+ngx_stream_statshouse_complex_value(void *ctx, void *val, ngx_str_t *value)
+{
+    ngx_stream_session_t                   *s = ctx;
+    ngx_stream_statshouse_complex_value_t  *cv = val;
+    ngx_stream_variable_value_t            *vv;
+
+    if (cv->index == NGX_ERROR) {
+        return ngx_stream_statshouse_script_value(s, &cv->complex, value);
+    }
+
+    vv = ngx_stream_get_indexed_variable(s, cv->index);
+
+    if (vv == NULL || vv->not_found) {
+        ngx_str_null(value);
+        return NGX_OK;
+    }
+
+    value->data = vv->data;
+    value->len = vv->len;
+
+    return NGX_OK;
+}
+
+
+/*
+ * ngx_stream_complex_value() evaluating into the per worker scratch arena
+ * instead of the connection pool
+ */
+
+static ngx_int_t
+ngx_stream_statshouse_script_value(ngx_stream_session_t *s, ngx_stream_complex_value_t *val,
+    ngx_str_t *value)
+{
+    size_t                              len;
+    ngx_stream_script_code_pt           code;
+    ngx_stream_script_len_code_pt       lcode;
+    ngx_stream_script_engine_t          e;
+    ngx_stream_statshouse_main_conf_t  *smcf;
+
+    if (val->lengths == NULL) {
+        *value = val->value;
+        return NGX_OK;
+    }
+
+    ngx_stream_script_flush_complex_value(s, val);
+
+    ngx_memzero(&e, sizeof(ngx_stream_script_engine_t));
+
+    e.ip = val->lengths;
+    e.session = s;
+    e.flushed = 1;
+
+    len = 0;
+
+    while (*(uintptr_t *) e.ip) {
+        lcode = *(ngx_stream_script_len_code_pt *) e.ip;
+        len += lcode(&e);
+    }
+
+    smcf = ngx_stream_get_module_main_conf(s, ngx_stream_statshouse_module);
+
+    value->len = len;
+    value->data = ngx_statshouse_scratch_alloc(&smcf->scratch, len);
+
+    if (value->data == NULL) {
+        value->data = ngx_pnalloc(s->connection->pool, len);
+        if (value->data == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    e.ip = val->values;
+    e.pos = value->data;
+    e.buf = *value;
+
+    while (*(uintptr_t *) e.ip) {
+        code = *(ngx_stream_script_code_pt *) e.ip;
+        code((ngx_stream_script_engine_t *) &e);
+    }
+
+    *value = e.buf;
+
+    return NGX_OK;
+}
+
+
+static ngx_statshouse_number_value_pt
+ngx_stream_statshouse_number_accessor(ngx_str_t *value)
+{
+    ngx_stream_statshouse_number_t  *number;
+
+    for (number = ngx_stream_statshouse_numbers; number->name.len; number++) {
+        if (number->name.len == value->len
+            && ngx_strncmp(number->name.data, value->data, value->len) == 0)
+        {
+            return number->handler;
+        }
+    }
+
+    return NULL;
+}
+
+
+static void *
+ngx_stream_statshouse_predicate_operand(ngx_conf_t *cf, ngx_str_t *value,
+    ngx_statshouse_number_value_pt *accessor)
+{
+    ngx_stream_statshouse_complex_value_t  *cv;
+
+    cv = ngx_stream_statshouse_intern_complex_value(cf, value);
+    if (cv == NULL) {
+        return NULL;
+    }
+
+    if (cv->complex.lengths != NULL) {
+        *accessor = ngx_stream_statshouse_number_accessor(value);
+    }
+
+    return cv;
+}
+
+
+static ngx_int_t
+ngx_stream_statshouse_session_time(void *ctx, double *number)
+{
+    ngx_stream_session_t  *s = ctx;
+    ngx_time_t            *tp;
+    ngx_msec_int_t         ms;
+
+    tp = ngx_timeofday();
+
+    ms = (ngx_msec_int_t)
+             ((tp->sec - s->start_sec) * 1000 + (tp->msec - s->start_msec));
+    ms = ngx_max(ms, 0);
+
+    *number = (double) ms / 1000;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_statshouse_status(void *ctx, double *number)
+{
+    ngx_stream_session_t  *s = ctx;
+
+    *number = s->status;
+
+    return NGX_OK;
+}
 
-    { ngx_string("key14"),
-        NGX_STREAM_STATSHOUSE_CONF
-            |NGX_CONF_1MORE,
-        ngx_stream_statshouse_key_slot,
-        NGX_STREAM_STATSHOUSE_CONF_OFFSET,
-        offsetof(ngx_statshouse_conf_t, keys[14]),
-        (void *) "14"
-    },
 
-    { ngx_string("key15"),
-        NGX_STREAM_STATSHOUSE_CONF
-            |NGX_CONF_1MORE,
-        ngx_stream_statshouse_key_slot,
-        NGX_STREAM_STATSHOUSE_CONF_OFFSET,
-        offsetof(ngx_statshouse_conf_t, keys[15]),
-        (void *) "15"
-    },
+static ngx_int_t
+ngx_stream_statshouse_bytes_sent(void *ctx, double *number)
+{
+    ngx_stream_session_t  *s = ctx;
 
-    { ngx_string("skey"),
-        NGX_STREAM_STATSHOUSE_CONF
-            |NGX_CONF_1MORE,
-        ngx_stream_statshouse_key_slot,
-        NGX_STREAM_STATSHOUSE_CONF_OFFSET,
-        offsetof(ngx_statshouse_conf_t, keys[16]),
-        (void *) "_s"
-    },
+    *number = s->connection->sent;
 
-    { ngx_string("sample"),
-        NGX_STREAM_STATSHOUSE_CONF
-            |NGX_CONF_TAKE1,
-        ngx_conf_set_num_slot,
-        NGX_STREAM_STATSHOUSE_CONF_OFFSET,
-        offsetof(ngx_statshouse_conf_t, sample),
-        NULL
-    },
+    return NGX_OK;
+}
 
-    ngx_null_command
-};
 
-static ngx_stream_module_t  ngx_stream_statshouse_module_ctx = {
-    NULL,                                    /* preconfiguration */
-    ngx_stream_statshouse_init,              /* postconfiguration */
+static ngx_int_t
+ngx_stream_statshouse_bytes_received(void *ctx, double *number)
+{
+    ngx_stream_session_t  *s = ctx;
 
-    ngx_stream_statshouse_create_main_conf,  /* create main configuration */
-    NULL,                                    /* init main configuration */
+    *number = s->received;
 
-    ngx_stream_statshouse_create_srv_conf,   /* create server configuration */
-    ngx_stream_statshouse_merge_srv_conf     /* merge server configuration */
-};
+    return NGX_OK;
+}
 
-ngx_module_t  ngx_stream_statshouse_module = {
-    NGX_MODULE_V1,
-    &ngx_stream_statshouse_module_ctx,       /* module context */
-    ngx_stream_statshouse_commands,          /* module directives */
-    NGX_STREAM_MODULE,                       /* module type */
-    NULL,                                    /* init master */
-    NULL,                                    /* init module */
-    NULL,                                    /* init process */
-    NULL,                                    /* init thread */
-    NULL,                                    /* exit thread */
-    NULL,                                    /* exit process */
-    NULL,                                    /* exit master */
-    NGX_MODULE_V1_PADDING
-};
 
-static ngx_stream_variable_t  ngx_stream_statshouse_variables[] = {
-      ngx_stream_null_variable
-};
+static ngx_int_t
+ngx_stream_statshouse_upstream_session_time(void *ctx, double *number)
+{
+    return ngx_stream_statshouse_upstream_time(ctx, number,
+        offsetof(ngx_stream_upstream_state_t, response_time));
+}
 
 
 static ngx_int_t
-ngx_stream_statshouse_init(ngx_conf_t *cf)
+ngx_stream_statshouse_upstream_connect_time(void *ctx, double *number)
 {
-    ngx_stream_core_main_conf_t         *cmcf;
-    ngx_stream_variable_t               *cv, *v;
-    ngx_stream_handler_pt               *h;
-    ngx_stream_statshouse_main_conf_t   *smcf;
-    ngx_statshouse_server_t            **servers;
-    ngx_uint_t                           i;
+    return ngx_stream_statshouse_upstream_time(ctx, number,
+        offsetof(ngx_stream_upstream_state_t, connect_time));
+}
 
-    for (cv = ngx_stream_statshouse_variables; cv->name.len; cv++) {
-        v = ngx_stream_add_variable(cf, &cv->name, cv->flags);
-        if (v == NULL) {
-            return NGX_ERROR;
-        }
 
-        *v = *cv;
-    }
+static ngx_int_t
+ngx_stream_statshouse_upstream_first_byte_time(void *ctx, double *number)
+{
+    return ngx_stream_statshouse_upstream_time(ctx, number,
+        offsetof(ngx_stream_upstream_state_t, first_byte_time));
+}
 
-    smcf = ngx_stream_conf_get_module_main_conf(cf, ngx_stream_statshouse_module);
-    if (smcf->servers == NULL) {
-        return NGX_OK;
+
+static ngx_int_t
+ngx_stream_statshouse_upstream_time(ngx_stream_session_t *s, double *number, size_t offset)
+{
+    ngx_stream_upstream_state_t  *state;
+    ngx_msec_int_t                ms;
+
+    if (s->upstream_states == NULL || s->upstream_states->nelts == 0) {
+        return NGX_DECLINED;
     }
 
-    servers = smcf->servers->elts;
-    for (i = 0; i < smcf->servers->nelts; i++) {
-        if (ngx_statshouse_server_init(servers[i], cf->pool) != NGX_OK) {
-            return NGX_ERROR;
-        }
+    /* lists of several upstreams and "-" are left to the variable */
+
+    if (s->upstream_states->nelts > 1) {
+        return NGX_AGAIN;
     }
 
-    cmcf = ngx_stream_conf_get_module_main_conf(cf, ngx_stream_core_module);
+    state = s->upstream_states->elts;
 
-    h = ngx_array_push(&cmcf->phases[NGX_STREAM_LOG_PHASE].handlers);
-    if (h == NULL) {
-        return NGX_ERROR;
+    ms = *(ngx_msec_int_t *) ((u_char *) state + offset);
+    if (ms == -1) {
+        return NGX_AGAIN;
     }
 
-    *h = ngx_stream_statshouse_handler;
+    ms = ngx_max(ms, 0);
+
+    *number = (double) ms / 1000;
 
     return NGX_OK;
 }
@@ -372,6 +1057,15 @@ ngx_stream_statshouse_create_main_conf(ngx_conf_t *cf)
         return NULL;
     }
 
+    conf->exprs = ngx_statshouse_exprs_create(cf->pool);
+    if (conf->exprs == NULL) {
+        return NULL;
+    }
+
+    if (ngx_statshouse_scratch_init(&conf->scratch, NGX_STATSHOUSE_SCRATCH_SIZE, cf->pool) != NGX_OK) {
+        return NULL;
+    }
+
     return conf;
 }
 
@@ -404,86 +1098,94 @@ ngx_stream_statshouse_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
 {
     ngx_stream_statshouse_srv_conf_t  *prev = parent;
     ngx_stream_statshouse_srv_conf_t  *conf = child;
-    ngx_statshouse_conf_t             *sconfs, *sconf;
-    ngx_uint_t                         i;
 
-    if (prev->confs) {
-        if (conf->confs == NULL) {
-            conf->confs = prev->confs;
-        } else {
-            sconfs = prev->confs->elts;
+    conf->inherit = prev->confs ? prev : prev->inherit;
 
-            for (i = 0; i < prev->confs->nelts; i++) {
-                sconf = ngx_array_push(conf->confs);
-                if (sconf == NULL) {
-                    return NGX_CONF_ERROR;
-                }
-
-                *sconf = sconfs[i];
-            }
-        }
+    if (ngx_stream_statshouse_init_phases(cf, conf) != NGX_OK) {
+        return NGX_CONF_ERROR;
     }
 
     ngx_conf_merge_value(conf->enable, prev->enable, 0);
     ngx_conf_merge_ptr_value(conf->server, prev->server, NULL);
 
+    if (ngx_stream_statshouse_bind(cf, conf) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
     return NGX_CONF_OK;
 }
 
 
-static char *
-ngx_stream_statshouse_set_predicate_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+static ngx_int_t
+ngx_stream_statshouse_init_phases(ngx_conf_t *cf, ngx_stream_statshouse_srv_conf_t *sscf)
 {
-    char  *p = conf;
+    ngx_statshouse_conf_t  *confs;
+    ngx_uint_t              i;
 
-    ngx_str_t                            *value;
-    ngx_uint_t                            i;
-    ngx_array_t                         **a;
-    ngx_stream_complex_value_t           *cv;
-    ngx_stream_compile_complex_value_t    ccv;
+    if (sscf->confs == NULL || sscf->phases) {
+        return NGX_OK;
+    }
 
-    a = (ngx_array_t **) (p + cmd->offset);
+    confs = sscf->confs->elts;
 
-    if (*a == NGX_CONF_UNSET_PTR) {
-        *a = ngx_array_create(cf->pool, 1, sizeof(ngx_stream_complex_value_t));
-        if (*a == NULL) {
-            return NGX_CONF_ERROR;
+    for (i = 0; i < sscf->confs->nelts; i++) {
+        if (ngx_statshouse_phases_add(&sscf->phases, &confs[i], cf->pool) != NGX_OK) {
+            return NGX_ERROR;
         }
     }
 
-    value = cf->args->elts;
+    return NGX_OK;
+}
 
-    for (i = 1; i < cf->args->nelts; i++) {
-        cv = ngx_array_push(*a);
-        if (cv == NULL) {
-            return NGX_CONF_ERROR;
-        }
 
-        ngx_memzero(&ccv, sizeof(ngx_stream_compile_complex_value_t));
+/* own and inherited metrics are sent to the server of the configuration */
+
+static ngx_int_t
+ngx_stream_statshouse_bind(ngx_conf_t *cf, ngx_stream_statshouse_srv_conf_t *sscf)
+{
+    ngx_stream_statshouse_srv_conf_t  *scf;
+    ngx_statshouse_conf_t            **confs;
+    ngx_uint_t                         i;
 
-        ccv.cf = cf;
-        ccv.value = &value[i];
-        ccv.complex_value = cv;
+    /* stream level conf is never merged, server may be unset */
 
-        if (ngx_stream_compile_complex_value(&ccv) != NGX_OK) {
-            return NGX_CONF_ERROR;
+    if (sscf->server == NULL || sscf->server == NGX_CONF_UNSET_PTR || sscf->enable != 1) {
+        return NGX_OK;
+    }
+
+    for (scf = sscf; scf; scf = scf->inherit) {
+        if (scf->confs == NULL) {
+            continue;
+        }
+
+        confs = scf->confs->elts;
+
+        for (i = 0; i < scf->confs->nelts; i++) {
+            if (ngx_statshouse_conf_bind(cf, confs[i], sscf->server) != NGX_OK) {
+                return NGX_ERROR;
+            }
         }
     }
 
-    return NGX_CONF_OK;
+    return NGX_OK;
 }
 
 
 static char *
 ngx_stream_statshouse_metric_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    ngx_stream_statshouse_srv_conf_t  *shlc = conf;
-
-    ngx_stream_statshouse_conf_ctx_t  *ctx;
-    ngx_statshouse_conf_t             *shc;
-    ngx_str_t                         *value;
-    ngx_conf_t                         save;
-    char                              *rv;
+    ngx_stream_statshouse_srv_conf_t   *shlc = conf;
+
+    ngx_stream_statshouse_main_conf_t      *smcf;
+    ngx_stream_statshouse_conf_ctx_t       *ctx;
+    ngx_stream_statshouse_complex_value_t  *cv;
+    ngx_statshouse_conf_t                  *shc;
+    ngx_statshouse_conf_member_t           *members;
+    ngx_statshouse_conf_value_t            *field;
+    ngx_str_t                              *value;
+    ngx_conf_t                              save;
+    ngx_uint_t                              i;
+    char                                   *rv;
 
     if (cf->module_type != NGX_STREAM_MODULE) {
         return NGX_CONF_ERROR;
@@ -519,12 +1221,23 @@ ngx_stream_statshouse_metric_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf
 
     ngx_memzero(shc, sizeof(ngx_statshouse_conf_t));
 
+    shc->defs = ngx_pcalloc(cf->pool, sizeof(ngx_statshouse_conf_key_def_t) * NGX_STATSHOUSE_STAT_KEYS_MAX);
+    if (shc->defs == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
     value = cf->args->elts;
     shc->name = value[1];
 
-    shc->condition.complex = NGX_CONF_UNSET_PTR;
+    shc->condition.strings = NGX_CONF_UNSET_PTR;
     shc->timeout = NGX_CONF_UNSET;
-    shc->sample = NGX_CONF_UNSET;
+
+    if (cmd->post) {
+        shc->members = ngx_array_create(cf->pool, 4, sizeof(ngx_statshouse_conf_member_t));
+        if (shc->members == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
 
     ctx->statshouse_conf[ngx_stream_statshouse_module.ctx_index] = shc;
 
@@ -540,14 +1253,62 @@ ngx_stream_statshouse_metric_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf
         return rv;
     }
 
-    if (shc->value.type == 0) {
+    if (shc->members) {
+        if (shc->value.type || shc->members->nelts == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "statshouse_metric_group requires metric params instead of count/unique/value");
+            return NGX_CONF_ERROR;
+        }
+
+        /* key tuples are counted, members are sent with their weight */
+
+        shc->value.type = ngx_statshouse_mt_counter;
+        shc->value.constant = 1;
+        ngx_str_set(&shc->value.string, "1");
+
+        members = shc->members->elts;
+
+        for (i = 0; i < shc->members->nelts; i++) {
+            field = &members[i].value;
+
+            cv = ngx_stream_statshouse_intern_complex_value(cf, &field->string);
+            if (cv == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            field->complex = cv;
+
+            if (cv->complex.lengths == NULL) {
+                field->constant = 1;
+
+            } else {
+                field->accessor = ngx_stream_statshouse_number_accessor(&field->string);
+            }
+        }
+
+    } else if (shc->value.type == 0) {
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "missed count/unique/value param in statshouse_metric");
         return NGX_CONF_ERROR;
     }
 
-    ngx_conf_init_ptr_value(shc->condition.complex, NULL);
+    ngx_conf_init_ptr_value(shc->condition.strings, NULL);
     ngx_conf_init_value(shc->timeout, 0);
-    ngx_conf_init_value(shc->sample, 0);
+
+    if (shc->condition.strings) {
+        shc->condition.predicate = ngx_statshouse_predicate_compile(cf, shc->condition.strings,
+            ngx_stream_statshouse_predicate_operand);
+        if (shc->condition.predicate == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    smcf = ngx_stream_conf_get_module_main_conf(cf, ngx_stream_statshouse_module);
+    shc->exprs = smcf->exprs;
+    shc->scratch = &smcf->scratch;
+
+    if (ngx_statshouse_conf_init(cf, shc) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
 
     return NGX_CONF_OK;
 }
@@ -558,10 +1319,10 @@ ngx_stream_statshouse_value_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
     char  *p = conf;
 
-    ngx_statshouse_conf_value_t         *field;
-    ngx_str_t                           *value;
-    ngx_stream_compile_complex_value_t   ccv;
-    ngx_uint_t                           i;
+    ngx_statshouse_conf_value_t            *field;
+    ngx_stream_statshouse_complex_value_t  *cv;
+    ngx_str_t                              *value;
+    ngx_uint_t                              i;
 
     field = (ngx_statshouse_conf_value_t *) (p + cmd->offset);
 
@@ -571,19 +1332,16 @@ ngx_stream_statshouse_value_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     value = cf->args->elts;
 
-    ngx_memzero(&ccv, sizeof(ngx_stream_compile_complex_value_t));
-
-    field->complex = ngx_pcalloc(cf->pool, sizeof(ngx_stream_complex_value_t));
-    if (field->complex == NULL) {
+    cv = ngx_stream_statshouse_intern_complex_value(cf, &value[1]);
+    if (cv == NULL) {
         return NGX_CONF_ERROR;
     }
 
-    ccv.cf = cf;
-    ccv.value = &value[1];
-    ccv.complex_value = field->complex;
+    field->complex = cv;
+    field->string = value[1];
 
-    if (ngx_stream_compile_complex_value(&ccv) != NGX_OK) {
-        return NGX_CONF_ERROR;
+    if (cv->complex.lengths == NULL) {
+        field->constant = 1;
     }
 
     for (i = 2; i < cf->args->nelts; i++) {
@@ -596,6 +1354,10 @@ ngx_stream_statshouse_value_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    if (!field->constant && !field->split) {
+        field->accessor = ngx_stream_statshouse_number_accessor(&field->string);
+    }
+
     field->type = (ngx_statshouse_stat_type_e) ((intptr_t) cmd->post);
 
     return NGX_CONF_OK;
@@ -605,14 +1367,14 @@ ngx_stream_statshouse_value_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 static char *
 ngx_stream_statshouse_key_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    char  *p = conf;
-
-    ngx_statshouse_conf_key_t           *key;
-    ngx_str_t                           *value;
-    ngx_stream_compile_complex_value_t   ccv;
-    ngx_uint_t                           i;
+    ngx_statshouse_conf_t                  *shc = conf;
+    ngx_statshouse_conf_key_def_t          *key;
+    ngx_stream_statshouse_complex_value_t  *cv;
+    ngx_str_t                              *value;
+    ngx_uint_t                              i;
+    ngx_int_t                               rc;
 
-    key = (ngx_statshouse_conf_key_t *) (p + cmd->offset);
+    key = &shc->defs[cmd->offset];
 
     if (key->name.len) {
         return "is duplicate";
@@ -623,19 +1385,16 @@ ngx_stream_statshouse_key_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     key->name.data = (u_char *) cmd->post;
     key->name.len = ngx_strlen(key->name.data);
 
-    ngx_memzero(&ccv, sizeof(ngx_stream_compile_complex_value_t));
-
-    key->complex = ngx_pcalloc(cf->pool, sizeof(ngx_stream_complex_value_t));
-    if (key->complex == NULL) {
+    cv = ngx_stream_statshouse_intern_complex_value(cf, &value[1]);
+    if (cv == NULL) {
         return NGX_CONF_ERROR;
     }
 
-    ccv.cf = cf;
-    ccv.value = &value[1];
-    ccv.complex_value = key->complex;
+    key->complex = cv;
+    key->string = value[1];
 
-    if (ngx_stream_compile_complex_value(&ccv) != NGX_OK) {
-        return NGX_CONF_ERROR;
+    if (cv->complex.lengths == NULL) {
+        key->constant = 1;
     }
 
     for (i = 2; i < cf->args->nelts; i++) {
@@ -644,6 +1403,16 @@ ngx_stream_statshouse_key_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        rc = ngx_statshouse_conf_key_option(cf, key, &value[i]);
+
+        if (rc == NGX_ERROR) {
+            return NGX_CONF_ERROR;
+        }
+
+        if (rc == NGX_OK) {
+            continue;
+        }
+
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid property \"%V\"", &value[i]);
         return NGX_CONF_ERROR;
     }
@@ -661,10 +1430,10 @@ ngx_stream_statshouse_server_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf
     ngx_url_t                            url;
     ngx_str_t                           *value, s;
     ngx_flag_t                           flush_after_request;
-    ngx_int_t                            splits_max, aggregate_values;
+    ngx_int_t                            splits_max, aggregate_values, adaptive;
     ngx_uint_t                           i;
     ssize_t                              buffer_size;
-    size_t                               aggregate_size;
+    size_t                               aggregate_size, aggregate_intern;
     ngx_msec_t                           flush;
 
     value = cf->args->elts;
@@ -684,9 +1453,11 @@ ngx_stream_statshouse_server_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf
     buffer_size = 4 * 1024;
     aggregate_size = 0;
     aggregate_values = 24;
+    aggregate_intern = 16 * 1024;
     flush_after_request = 0;
     splits_max = 16;
     flush = 1000;
+    adaptive = 0;
 
     ngx_memzero(&url, sizeof(ngx_url_t));
     url.url = value[1];
@@ -745,6 +1516,33 @@ ngx_stream_statshouse_server_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "aggregate_intern=", 17) == 0) {
+
+            s.data =  value[i].data + 17;
+            s.len = value[i].data + value[i].len - s.data;
+
+            aggregate_intern = ngx_parse_size(&s);
+
+            if (aggregate_intern == (size_t) NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid aggregate intern size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "adaptive=", 9) == 0) {
+
+            adaptive = ngx_atoi(value[i].data + 9, value[i].len - 9);
+
+            if (adaptive == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid adaptive budget \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
         if (ngx_strncmp(value[i].data, "flush=", 6) == 0) {
 
             s.data =  value[i].data + 6;
@@ -805,6 +1603,8 @@ ngx_stream_statshouse_server_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf
             servers[i]->splits_max == splits_max &&
             servers[i]->aggregate_size == aggregate_size &&
             servers[i]->aggregate_values == aggregate_values &&
+            servers[i]->aggregate_intern == aggregate_intern &&
+            servers[i]->adaptive == (ngx_uint_t) adaptive &&
             servers[i]->buffer_size == buffer_size)
         {
             server = servers[i];
@@ -837,8 +1637,10 @@ ngx_stream_statshouse_server_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf
     server->buffer_size = buffer_size;
     server->aggregate_size = aggregate_size;
     server->aggregate_values = aggregate_values;
+    server->aggregate_intern = aggregate_intern;
     server->splits_max = splits_max;
     server->flush = flush;
+    server->adaptive = adaptive;
 
     server->log = &cf->cycle->new_log;
 
@@ -859,59 +1661,60 @@ ngx_stream_statshouse_handler(ngx_stream_session_t *session)
 ngx_int_t
 ngx_stream_statshouse_send(ngx_stream_session_t *session, ngx_str_t *phase)
 {
+    ngx_stream_statshouse_main_conf_t *smcf;
     ngx_stream_statshouse_srv_conf_t  *sscf;
 
+    ngx_stream_statshouse_srv_conf_t  *scf;
     ngx_statshouse_server_t           *server;
-    ngx_statshouse_conf_t             *confs;
-    ngx_statshouse_stat_t             *stats;
+    ngx_statshouse_phase_t            *bucket;
+    ngx_statshouse_conf_t            **confs;
     ngx_uint_t                         i;
-    ngx_int_t                          j, n;
+    ngx_int_t                          n;
 
     sscf = ngx_stream_get_module_srv_conf(session, ngx_stream_statshouse_module);
-    if (sscf->server == NULL || sscf->confs == NULL || sscf->enable == 0) {
+    if (sscf->server == NULL || sscf->enable == 0) {
         return NGX_OK;
     }
 
     ngx_log_debug0(NGX_LOG_DEBUG_STREAM, session->connection->log, 0,
         "statshouse handler");
 
-    confs = sscf->confs->elts;
+    smcf = ngx_stream_get_module_main_conf(session, ngx_stream_statshouse_module);
+    ngx_statshouse_exprs_next(smcf->exprs);
+
+    smcf->scratch.pool = session->connection->pool;
+
     server = sscf->server;
-    stats = server->splits;
 
-    for (i = 0; i < sscf->confs->nelts; i++) {
-        if (phase == NULL && confs[i].phase.len != 0) {
+    for (scf = sscf; scf; scf = scf->inherit) {
+        if (scf->phases == NULL) {
             continue;
         }
 
-        if (phase &&
-            (phase->len != confs[i].phase.len ||
-                ngx_strncmp(phase->data, confs[i].phase.data, phase->len) != 0))
-        {
+        bucket = ngx_statshouse_phases_find(scf->phases, phase);
+        if (bucket == NULL) {
             continue;
         }
 
-        if ((confs[i].sample > 0) &&
-            (ngx_random() % 100 > confs[i].sample))
-        {
-            continue;
-        }
+        confs = bucket->confs.elts;
 
-        n = ngx_statshouse_stat_compile(&confs[i], stats, server->splits_max,
-            (ngx_statshouse_complex_value_pt) ngx_stream_complex_value, session,
-            session->connection->log);
-        if (n <= 0) {
-            continue;
-        }
+        for (i = 0; i < bucket->confs.nelts; i++) {
+            n = ngx_statshouse_stat_compile(server, confs[i],
+                ngx_stream_statshouse_complex_value, session,
+                session->connection->log);
+            if (n <= 0) {
+                continue;
+            }
 
-        ngx_log_debug1(NGX_LOG_DEBUG_STREAM, session->connection->log, 0,
-            "statshouse send %d stats", n);
+            ngx_log_debug1(NGX_LOG_DEBUG_STREAM, session->connection->log, 0,
+                "statshouse send %d stats", n);
 
-        for (j = 0; j < n; j++) {
-            ngx_statshouse_send(server, &stats[j]);
+            ngx_statshouse_send_batch(server, server->splits, n);
         }
     }
 
+    ngx_statshouse_scratch_reset(&smcf->scratch);
+
     ngx_statshouse_flush_after_request(server);
     return NGX_OK;
 }
@@ -936,3 +1739,26 @@ ngx_stream_statshouse_send_stat(ngx_stream_session_t *session, ngx_statshouse_st
     ngx_statshouse_send(server, stat);
     return NGX_OK;
 }
+
+
+ngx_statshouse_handle_t *
+ngx_stream_statshouse_register(ngx_conf_t *cf, ngx_str_t *name, ngx_statshouse_stat_type_e type,
+    ngx_uint_t *keys, ngx_uint_t nkeys)
+{
+    return ngx_statshouse_handle_create(cf, name, type, keys, nkeys);
+}
+
+
+ngx_int_t
+ngx_stream_statshouse_send_handle(ngx_stream_session_t *session, ngx_statshouse_handle_t *handle,
+    ngx_str_t *keys, double number)
+{
+    ngx_stream_statshouse_srv_conf_t  *sscf;
+
+    sscf = ngx_stream_get_module_srv_conf(session, ngx_stream_statshouse_module);
+    if (sscf->server == NULL || sscf->enable == 0) {
+        return NGX_OK;
+    }
+
+    return ngx_statshouse_handle_send(sscf->server, handle, keys, number);
+}